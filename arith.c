@@ -0,0 +1,586 @@
+#include "arith.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+
+enum arith_token {
+    at_end,
+    at_error,
+    at_num,
+    at_name,
+    at_param,       /* the index is in tok_num */
+    at_lparen,
+    at_rparen,
+    at_question,
+    at_colon,
+    at_inc,
+    at_dec,
+    at_not,
+    at_bnot,
+    at_assign,      /* = and op=, the operator is in tok_op */
+    at_binary       /* the operator is in tok_op */
+};
+
+typedef struct {
+    const char *p;
+    enum arith_token tok;
+    enum arith_op tok_op;
+    long long tok_num;
+    const char *name;
+    int name_len;
+    int error;
+} arith_parser;
+
+static const struct {
+    const char *str;
+    enum arith_token tok;
+    enum arith_op op;
+} operators[] = {
+    { "<<=", at_assign, aop_shl },  { ">>=", at_assign, aop_shr },
+    { "++", at_inc, aop_none },     { "--", at_dec, aop_none },
+    { "<<", at_binary, aop_shl },   { ">>", at_binary, aop_shr },
+    { "<=", at_binary, aop_le },    { ">=", at_binary, aop_ge },
+    { "==", at_binary, aop_eq },    { "!=", at_binary, aop_ne },
+    { "&&", at_binary, aop_land },  { "||", at_binary, aop_lor },
+    { "+=", at_assign, aop_add },   { "-=", at_assign, aop_sub },
+    { "*=", at_assign, aop_mul },   { "/=", at_assign, aop_div },
+    { "%=", at_assign, aop_mod },   { "&=", at_assign, aop_band },
+    { "^=", at_assign, aop_bxor },  { "|=", at_assign, aop_bor },
+    { "+", at_binary, aop_add },    { "-", at_binary, aop_sub },
+    { "*", at_binary, aop_mul },    { "/", at_binary, aop_div },
+    { "%", at_binary, aop_mod },    { "<", at_binary, aop_lt },
+    { ">", at_binary, aop_gt },     { "&", at_binary, aop_band },
+    { "^", at_binary, aop_bxor },   { "|", at_binary, aop_bor },
+    { ",", at_binary, aop_comma },  { "=", at_assign, aop_none },
+    { "(", at_lparen, aop_none },   { ")", at_rparen, aop_none },
+    { "?", at_question, aop_none }, { ":", at_colon, aop_none },
+    { "!", at_not, aop_none },      { "~", at_bnot, aop_none }
+};
+
+static int binary_prec(enum arith_op op)
+{
+    switch (op) {
+    case aop_comma:
+        return 1;
+    case aop_lor:
+        return 2;
+    case aop_land:
+        return 3;
+    case aop_bor:
+        return 4;
+    case aop_bxor:
+        return 5;
+    case aop_band:
+        return 6;
+    case aop_eq:    case aop_ne:
+        return 7;
+    case aop_lt:    case aop_le:    case aop_gt:    case aop_ge:
+        return 8;
+    case aop_shl:   case aop_shr:
+        return 9;
+    case aop_add:   case aop_sub:
+        return 10;
+    case aop_mul:   case aop_div:   case aop_mod:
+        return 11;
+    default:
+        return 0;
+    }
+}
+
+static void next_token(arith_parser *ap)
+{
+    const char *p = ap->p;
+    int i;
+
+    while (isspace(*p)) {
+        p++;
+    }
+    if (*p == '\0') {
+        ap->tok = at_end;
+        ap->p = p;
+        return;
+    }
+    if (isdigit(*p)) {
+        char *end;
+
+        ap->tok_num = strtoll(p, &end, 0);
+        if (isalnum(*end) || *end == '_') {
+            ap->tok = at_error;
+            return;
+        }
+        ap->tok = at_num;
+        ap->p = end;
+        return;
+    }
+    if (*p == '$' && (isdigit(p[1]) || p[1] == '#')) {
+        ap->tok = at_param;
+        ap->tok_num = p[1] == '#' ? 0 : p[1] - '0';
+        ap->p = p + 2;
+        return;
+    }
+    if (*p == '$' && p[1] == '{') {
+        const char *close = strchr(p, '}');
+
+        if (close == NULL) {
+            ap->tok = at_error;
+            return;
+        }
+        if (isdigit(p[2]) || (p[2] == '#' && close == p + 3)) {
+            ap->tok = at_param;
+            ap->tok_num = p[2] == '#' ? 0 : atoi(p + 2);
+            ap->p = close + 1;
+            return;
+        }
+        ap->tok = at_name;
+        ap->name = p + 2;
+        ap->name_len = close - ap->name;
+        ap->p = close + 1;
+        return;
+    }
+    if (*p == '$') {
+        p++;
+    }
+    if (isalpha(*p) || *p == '_') {
+        ap->tok = at_name;
+        ap->name = p;
+        while (isalnum(*p) || *p == '_') {
+            p++;
+        }
+        ap->name_len = p - ap->name;
+        ap->p = p;
+        return;
+    }
+    for (i = 0; i < sizeof(operators) / sizeof(*operators); i++) {
+        int len = strlen(operators[i].str);
+
+        if (strncmp(p, operators[i].str, len) == 0) {
+            ap->tok = operators[i].tok;
+            ap->tok_op = operators[i].op;
+            ap->p = p + len;
+            return;
+        }
+    }
+    ap->tok = at_error;
+}
+
+static arith_node *new_node(enum arith_kind kind, enum arith_op op)
+{
+    arith_node *node;
+
+    node = calloc(1, sizeof(arith_node));
+    node->kind = kind;
+    node->op = op;
+    return node;
+}
+
+static arith_node *new_num(long long value)
+{
+    arith_node *node;
+
+    node = new_node(arith_num, aop_none);
+    node->value = value;
+    return node;
+}
+
+static long long wrap_add(long long a, long long b)
+{
+    return (long long)((unsigned long long)a + (unsigned long long)b);
+}
+
+static long long wrap_mul(long long a, long long b)
+{
+    return (long long)((unsigned long long)a * (unsigned long long)b);
+}
+
+static enum arith_error apply_binary(
+    enum arith_op op, long long a, long long b, long long *res)
+{
+    switch (op) {
+    case aop_add:   *res = wrap_add(a, b);              break;
+    case aop_sub:   *res = wrap_add(a, wrap_mul(b, -1)); break;
+    case aop_mul:   *res = wrap_mul(a, b);              break;
+    case aop_div:
+    case aop_mod:
+        if (b == 0) {
+            return arith_div_by_zero;
+        }
+        if (a == LLONG_MIN && b == -1) {
+            *res = op == aop_div ? LLONG_MIN : 0;
+        } else {
+            *res = op == aop_div ? a / b : a % b;
+        }
+        break;
+    case aop_shl:
+        *res = (long long)((unsigned long long)a << (b & 63));
+        break;
+    case aop_shr:   *res = a >> (b & 63);   break;
+    case aop_lt:    *res = a < b;           break;
+    case aop_le:    *res = a <= b;          break;
+    case aop_gt:    *res = a > b;           break;
+    case aop_ge:    *res = a >= b;          break;
+    case aop_eq:    *res = a == b;          break;
+    case aop_ne:    *res = a != b;          break;
+    case aop_band:  *res = a & b;           break;
+    case aop_bxor:  *res = a ^ b;           break;
+    case aop_bor:   *res = a | b;           break;
+    case aop_land:  *res = a && b;          break;
+    case aop_lor:   *res = a || b;          break;
+    case aop_comma: *res = b;               break;
+    default:
+        return arith_syntax;
+    }
+    return arith_ok;
+}
+
+static long long apply_unary(enum arith_op op, long long a)
+{
+    switch (op) {
+    case aop_neg:
+        return wrap_mul(a, -1);
+    case aop_not:
+        return !a;
+    case aop_bnot:
+        return ~a;
+    default:
+        return a;
+    }
+}
+
+/* Constant subexpressions are folded as soon as they are built, so the
+ * tree that is kept holds only what depends on variables. */
+static arith_node *make_unary(enum arith_op op, arith_node *a)
+{
+    arith_node *node;
+
+    if (a->kind == arith_num) {
+        a->value = apply_unary(op, a->value);
+        return a;
+    }
+    node = new_node(arith_unary, op);
+    node->a = a;
+    return node;
+}
+
+static arith_node *make_binary(enum arith_op op, arith_node *a, arith_node *b)
+{
+    arith_node *node;
+    long long res;
+
+    if (a->kind == arith_num && (op == aop_land || op == aop_lor) &&
+        (a->value != 0) == (op == aop_lor))
+    {
+        arith_free(b);
+        a->value = op == aop_lor;
+        return a;
+    }
+    if (a->kind == arith_num && b->kind == arith_num &&
+        apply_binary(op, a->value, b->value, &res) == arith_ok)
+    {
+        arith_free(b);
+        a->value = res;
+        return a;
+    }
+    node = new_node(arith_binary, op);
+    node->a = a;
+    node->b = b;
+    return node;
+}
+
+static arith_node *make_ternary(arith_node *cond, arith_node *a, arith_node *b)
+{
+    arith_node *node;
+
+    if (cond->kind == arith_num) {
+        node = cond->value ? a : b;
+        arith_free(node == a ? b : a);
+        arith_free(cond);
+        return node;
+    }
+    node = new_node(arith_ternary, aop_none);
+    node->a = cond;
+    node->b = a;
+    node->c = b;
+    return node;
+}
+
+static arith_node *make_var(enum arith_kind kind, enum arith_op op,
+                            const arith_parser *ap)
+{
+    arith_node *node;
+
+    node = new_node(kind, op);
+    node->name = strndup(ap->name, ap->name_len);
+    return node;
+}
+
+static arith_node *parse_expr(arith_parser *ap, int min_prec);
+
+static arith_node *parse_unary(arith_parser *ap)
+{
+    arith_node *node;
+
+    switch (ap->tok) {
+    case at_num:
+        node = new_num(ap->tok_num);
+        next_token(ap);
+        return node;
+    case at_param:
+        node = new_node(arith_param, aop_none);
+        node->value = ap->tok_num;
+        next_token(ap);
+        return node;
+    case at_name:
+        node = make_var(arith_var, aop_none, ap);
+        next_token(ap);
+        if (ap->tok == at_inc || ap->tok == at_dec) {
+            node->kind = arith_postinc;
+            node->value = ap->tok == at_inc ? 1 : -1;
+            next_token(ap);
+        }
+        return node;
+    case at_inc:
+    case at_dec:
+        next_token(ap);
+        if (ap->tok != at_name) {
+            ap->error = 1;
+            return NULL;
+        }
+        node = make_var(arith_preinc, aop_none, ap);
+        node->value = ap->tok == at_inc ? 1 : -1;
+        next_token(ap);
+        return node;
+    case at_lparen:
+        next_token(ap);
+        node = parse_expr(ap, 1);
+        if (node == NULL || ap->tok != at_rparen) {
+            arith_free(node);
+            ap->error = 1;
+            return NULL;
+        }
+        next_token(ap);
+        return node;
+    case at_not:
+    case at_bnot:
+    case at_binary:
+        if (ap->tok == at_binary && ap->tok_op != aop_add &&
+            ap->tok_op != aop_sub)
+        {
+            break;
+        }
+        {
+            enum arith_op op = ap->tok == at_not ? aop_not
+                : ap->tok == at_bnot ? aop_bnot
+                : ap->tok_op == aop_sub ? aop_neg : aop_pos;
+
+            next_token(ap);
+            node = parse_unary(ap);
+            return node != NULL ? make_unary(op, node) : NULL;
+        }
+    default:
+        break;
+    }
+    ap->error = 1;
+    return NULL;
+}
+
+/* Assignment and ?: bind looser than every binary operator except the
+ * comma and both associate to the right. */
+static arith_node *parse_assignment(arith_parser *ap)
+{
+    arith_node *node, *a, *b;
+    const char *save = ap->p;
+    enum arith_token save_tok = ap->tok;
+
+    if (ap->tok == at_name) {
+        arith_parser probe = *ap;
+
+        next_token(&probe);
+        if (probe.tok == at_assign) {
+            node = make_var(arith_assign, probe.tok_op, ap);
+            *ap = probe;
+            next_token(ap);
+            node->a = parse_assignment(ap);
+            if (node->a == NULL) {
+                arith_free(node);
+                return NULL;
+            }
+            return node;
+        }
+    }
+    ap->p = save;
+    ap->tok = save_tok;
+    node = parse_expr(ap, 2);
+    if (node == NULL || ap->tok != at_question) {
+        return node;
+    }
+    next_token(ap);
+    a = parse_expr(ap, 1);
+    if (a == NULL || ap->tok != at_colon) {
+        arith_free(node);
+        arith_free(a);
+        ap->error = 1;
+        return NULL;
+    }
+    next_token(ap);
+    b = parse_assignment(ap);
+    if (b == NULL) {
+        arith_free(node);
+        arith_free(a);
+        return NULL;
+    }
+    return make_ternary(node, a, b);
+}
+
+static arith_node *parse_expr(arith_parser *ap, int min_prec)
+{
+    arith_node *left, *right;
+
+    left = min_prec <= 1 ? parse_assignment(ap) : parse_unary(ap);
+    while (left != NULL && ap->tok == at_binary &&
+           binary_prec(ap->tok_op) >= min_prec)
+    {
+        enum arith_op op = ap->tok_op;
+        int prec = binary_prec(op);
+
+        next_token(ap);
+        right = prec == 1 ? parse_assignment(ap) : parse_expr(ap, prec + 1);
+        if (right == NULL) {
+            arith_free(left);
+            return NULL;
+        }
+        left = make_binary(op, left, right);
+    }
+    return left;
+}
+
+enum arith_error arith_parse(const char *src, arith_node **pnode)
+{
+    arith_parser ap;
+
+    ap.p = src;
+    ap.error = 0;
+    next_token(&ap);
+    if (ap.tok == at_end) {
+        *pnode = new_num(0);
+        return arith_ok;
+    }
+    *pnode = parse_expr(&ap, 1);
+    if (*pnode != NULL && ap.tok == at_end && !ap.error) {
+        return arith_ok;
+    }
+    arith_free(*pnode);
+    *pnode = NULL;
+    return arith_syntax;
+}
+
+void arith_free(arith_node *node)
+{
+    if (node == NULL) {
+        return;
+    }
+    arith_free(node->a);
+    arith_free(node->b);
+    arith_free(node->c);
+    free(node->name);
+    free(node);
+}
+
+static enum arith_error param_value(
+    const param_frame *params, int idx, long long *result)
+{
+    if (idx == 0) {
+        *result = params->argc;
+        return arith_ok;
+    }
+    if (idx > params->argc) {
+        *result = 0;
+        return arith_ok;
+    }
+    return var_parse_int(params->argv[idx-1], result) == 0
+        ? arith_ok
+        : arith_bad_value;
+}
+
+enum arith_error arith_eval(var_table *vars, const param_frame *params,
+                            const arith_node *node, long long *result)
+{
+    long long a, b;
+    enum arith_error err;
+
+    switch (node->kind) {
+    case arith_num:
+        *result = node->value;
+        return arith_ok;
+    case arith_var:
+        return var_get_int(vars, node->name, result) == 0
+            ? arith_ok
+            : arith_bad_value;
+    case arith_param:
+        return param_value(params, node->value, result);
+    case arith_unary:
+        err = arith_eval(vars, params, node->a, &a);
+        if (err == arith_ok) {
+            *result = apply_unary(node->op, a);
+        }
+        return err;
+    case arith_binary:
+        err = arith_eval(vars, params, node->a, &a);
+        if (err != arith_ok) {
+            return err;
+        }
+        if ((node->op == aop_land && !a) || (node->op == aop_lor && a)) {
+            *result = node->op == aop_lor;
+            return arith_ok;
+        }
+        err = arith_eval(vars, params, node->b, &b);
+        if (err != arith_ok) {
+            return err;
+        }
+        return apply_binary(node->op, a, b, result);
+    case arith_ternary:
+        err = arith_eval(vars, params, node->a, &a);
+        if (err != arith_ok) {
+            return err;
+        }
+        return arith_eval(vars, params, a ? node->b : node->c, result);
+    case arith_assign:
+        err = arith_eval(vars, params, node->a, &b);
+        if (err == arith_ok && node->op != aop_none) {
+            if (var_get_int(vars, node->name, &a) != 0) {
+                return arith_bad_value;
+            }
+            err = apply_binary(node->op, a, b, &b);
+        }
+        if (err == arith_ok) {
+            var_set_int(vars, node->name, b);
+            *result = b;
+        }
+        return err;
+    case arith_preinc:
+    case arith_postinc:
+        if (var_get_int(vars, node->name, &a) != 0) {
+            return arith_bad_value;
+        }
+        var_set_int(vars, node->name, wrap_add(a, node->value));
+        *result = node->kind == arith_preinc ? wrap_add(a, node->value) : a;
+        return arith_ok;
+    }
+    return arith_syntax;
+}
+
+const char *arith_error_msg(enum arith_error err)
+{
+    switch (err) {
+    case arith_ok:
+        return "OK";
+    case arith_syntax:
+        return "syntax error in expression";
+    case arith_div_by_zero:
+        return "division by zero";
+    case arith_bad_value:
+        return "value is not a number";
+    }
+    return NULL;
+}
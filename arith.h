@@ -0,0 +1,48 @@
+#ifndef ARITH_SENTRY
+#define ARITH_SENTRY
+#include "vars.h"
+
+
+enum arith_kind {
+    arith_num,
+    arith_var,
+    arith_param,        /* $1..., value is the index, 0 for $# */
+    arith_unary,
+    arith_binary,
+    arith_ternary,
+    arith_assign,
+    arith_preinc,       /* ++x, --x */
+    arith_postinc       /* x++, x-- */
+};
+
+enum arith_op {
+    aop_none,
+    aop_add, aop_sub, aop_mul, aop_div, aop_mod, aop_shl, aop_shr,
+    aop_lt, aop_le, aop_gt, aop_ge, aop_eq, aop_ne,
+    aop_band, aop_bxor, aop_bor, aop_land, aop_lor, aop_comma,
+    aop_neg, aop_pos, aop_not, aop_bnot
+};
+
+enum arith_error {
+    arith_ok = 0,
+    arith_syntax = -1,
+    arith_div_by_zero = -2,
+    arith_bad_value = -3
+};
+
+typedef struct arith_node arith_node;
+struct arith_node {
+    enum arith_kind kind;
+    enum arith_op op;
+    long long value;
+    char *name;
+    arith_node *a, *b, *c;
+};
+
+enum arith_error arith_parse(const char *src, arith_node **pnode);
+enum arith_error arith_eval(var_table *vars, const param_frame *params,
+                            const arith_node *node, long long *result);
+void arith_free(arith_node *node);
+const char *arith_error_msg(enum arith_error err);
+
+#endif
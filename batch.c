@@ -0,0 +1,127 @@
+#include "batch.h"
+#include "wrappers.h"
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+
+extern char **environ;
+
+static int parse_count(const char *str, int min, int *res)
+{
+    char *end;
+    long value;
+
+    if (!isdigit((unsigned char)*str)) {
+        return -1;
+    }
+    value = strtol(str, &end, 10);
+    if (*end != '\0' || value < min || value > INT_MAX) {
+        return -1;
+    }
+    *res = value;
+    return 0;
+}
+
+/* batch [-P JOBS] [-k COUNT] COMMAND [ARG...]; the first COUNT arguments
+ * go to every run of COMMAND and default to its leading options, up to
+ * and including a --. Returns the index of COMMAND. */
+int parse_batch_args(char **argv, batch_options *opts)
+{
+    int i, cmd;
+
+    opts->jobs = 1;
+    opts->keep = -1;
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i += 2) {
+        const char *opt = argv[i], *arg = argv[i + 1];
+
+        if (opt[1] == '\0' || opt[2] != '\0' || arg == NULL) {
+            break;
+        }
+        if (opt[1] == 'P') {
+            if (parse_count(arg, 1, &opts->jobs) == -1) {
+                log_error("batch: %s: invalid job count", arg);
+                return -1;
+            }
+        } else if (opt[1] == 'k') {
+            if (parse_count(arg, 0, &opts->keep) == -1) {
+                log_error("batch: %s: invalid argument count", arg);
+                return -1;
+            }
+        } else {
+            break;
+        }
+    }
+    if (argv[i] == NULL || argv[i][0] == '-') {
+        log_error("batch: usage: batch [-P JOBS] [-k COUNT] "
+                  "COMMAND [ARG...]");
+        return -1;
+    }
+    cmd = i;
+    if (opts->keep == -1) {
+        for (i = cmd + 1; argv[i] != NULL && argv[i][0] == '-' &&
+                          argv[i][1] != '\0'; i++)
+        {
+            if (strcmp(argv[i], "--") == 0) {
+                i++;
+                break;
+            }
+        }
+        opts->keep = i - cmd - 1;
+    }
+    for (i = cmd + 1; i <= cmd + opts->keep; i++) {
+        if (argv[i] == NULL) {
+            opts->keep = i - cmd - 1;
+            break;
+        }
+    }
+    return cmd;
+}
+
+/* What a string takes of the exec limit: itself and its pointer. */
+static long arg_cost(const char *arg)
+{
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+/* Bytes left for the batched arguments once the environment, the
+ * assignments in env and the count fixed arguments are in. */
+long batch_budget(char **env, char **fixed, int count)
+{
+    long budget;
+    char **p;
+    int i;
+
+    budget = sysconf(_SC_ARG_MAX);
+    if (budget <= 0) {
+        budget = _POSIX_ARG_MAX;
+    }
+    budget -= batch_headroom + 2 * sizeof(char *);
+    for (p = environ; *p != NULL; p++) {
+        budget -= arg_cost(*p);
+    }
+    for (p = env; p != NULL && *p != NULL; p++) {
+        budget -= arg_cost(*p);
+    }
+    for (i = 0; i < count; i++) {
+        budget -= arg_cost(fixed[i]);
+    }
+    return budget;
+}
+
+/* How many of args fit in budget; at least one, so that an argument too
+ * long on its own still gets its run and its error. */
+int batch_fit(char **args, long budget)
+{
+    int n;
+
+    for (n = 0; args[n] != NULL; n++) {
+        budget -= arg_cost(args[n]);
+        if (budget < 0) {
+            return n > 0 ? n : 1;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,17 @@
+#ifndef BATCH_SENTRY
+#define BATCH_SENTRY
+
+
+/* Room left in the exec limit for what the kernel and the loader put
+ * next to the strings, as xargs leaves it. */
+enum { batch_headroom = 2048 };
+
+typedef struct {
+    int jobs, keep;
+} batch_options;
+
+int parse_batch_args(char **argv, batch_options *opts);
+long batch_budget(char **env, char **fixed, int count);
+int batch_fit(char **args, long budget);
+
+#endif
@@ -0,0 +1,495 @@
+#include "builtins.h"
+#include "lines.h"
+#include "wrappers.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+
+
+void builtin_write(builtin_io *io, const char *str, int len)
+{
+    int n;
+
+    if (io->out != NULL) {
+        strbuf_append_mem(io->out, str, len);
+        return;
+    }
+    while (len > 0) {
+        n = write(io->out_fd, str, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* a pipeline stage on a thread sees a gone reader this way */
+            if (errno != EPIPE) {
+                log_error("write: %s", strerror(errno));
+            }
+            return;
+        }
+        str += n;
+        len -= n;
+    }
+}
+
+static int cd_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    int status;
+    const char *path;
+
+    if (argv[1] == NULL) {
+        path = var_get(&sh->vars, "HOME");
+        if (path == NULL) {
+            log_error("HOME variable is not set");
+            return 1;
+        }
+    } else {
+        path = argv[1];
+    }
+
+    status = chdir(path);
+    if (status == -1) {
+        log_error("cd: %s: %s", path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int echo_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    strbuf line;
+    int newline = 1, i = 1;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    strbuf_init(&line, 256);
+    strbuf_clear(&line);
+    for (; argv[i] != NULL; i++) {
+        strbuf_join(&line, argv[i]);
+        if (argv[i+1] != NULL) {
+            strbuf_append(&line, ' ');
+        }
+    }
+    if (newline) {
+        strbuf_append(&line, '\n');
+    }
+    builtin_write(io, line.chars, line.len);
+    strbuf_free(&line);
+    return 0;
+}
+
+static int pwd_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    char path[PATH_MAX + 1];
+    int len;
+
+    if (getcwd(path, PATH_MAX) == NULL) {
+        log_error("pwd: %s", strerror(errno));
+        return 1;
+    }
+    len = strlen(path);
+    path[len++] = '\n';
+    builtin_write(io, path, len);
+    return 0;
+}
+
+static int true_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    return 0;
+}
+
+static int false_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    return 1;
+}
+
+static int export_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    int i, status = 0;
+
+    for (i = 1; argv[i] != NULL; i++) {
+        char *eq = strchr(argv[i], '=');
+        int len = eq != NULL ? eq - argv[i] : strlen(argv[i]);
+
+        if (!is_var_name(argv[i], len)) {
+            log_error("export: %s: not a valid identifier", argv[i]);
+            status = 1;
+            continue;
+        }
+        if (eq != NULL) {
+            *eq = '\0';
+            var_set(&sh->vars, argv[i], eq + 1);
+        }
+        var_export(&sh->vars, argv[i]);
+        if (eq != NULL) {
+            *eq = '=';
+        }
+    }
+    return status;
+}
+
+static int unset_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    int i = 1, functions = 0;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-f") == 0) {
+        functions = 1;
+        i++;
+    } else if (argv[1] != NULL && strcmp(argv[1], "-v") == 0) {
+        i++;
+    }
+    for (; argv[i] != NULL; i++) {
+        if (functions) {
+            func_unset(&sh->funcs, argv[i]);
+        } else {
+            var_unset(&sh->vars, argv[i]);
+        }
+    }
+    return 0;
+}
+
+static int return_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    if (sh->func_depth == 0) {
+        log_error("return: can only be used in a function");
+        return 1;
+    }
+    sh->returning = 1;
+    return argv[1] != NULL ? atoi(argv[1]) : sh->last_status;
+}
+
+static int shift_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    int n;
+
+    n = argv[1] != NULL ? atoi(argv[1]) : 1;
+    if (n < 0 || n > sh->params->argc) {
+        log_error("shift: %d: shift count out of range", n);
+        return 1;
+    }
+    if (n > 0) {
+        sh->params->argv += n;
+        sh->params->argc -= n;
+    }
+    return 0;
+}
+
+static int is_ifs(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n';
+}
+
+static int parse_input_fd(const char *name, const char *str, int *fd)
+{
+    char *end;
+    long value;
+
+    value = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || value < 0 || value > INT_MAX) {
+        log_error("%s: %s: invalid file descriptor", name, str);
+        return -1;
+    }
+    *fd = value;
+    return 0;
+}
+
+/* Drops the backslashes of line, marking the characters they quoted. */
+static void unescape_line(strbuf *line, char *quoted)
+{
+    int i, len = 0;
+
+    for (i = 0; i < line->len; i++) {
+        quoted[len] = 0;
+        if (line->chars[i] == '\\' && i + 1 < line->len) {
+            i++;
+            quoted[len] = 1;
+        }
+        line->chars[len++] = line->chars[i];
+    }
+    strbuf_truncate(line, len);
+}
+
+/* Each name but the last takes a field; the last one takes the rest of
+ * the line without the separators around it. */
+static void assign_fields(shell *sh, char **names, const strbuf *line,
+                          const char *quoted)
+{
+    const char *text = line->chars;
+    char *value;
+    int pos = 0, start, end;
+
+    for (; *names != NULL; names++) {
+        while (pos < line->len && is_ifs(text[pos]) && !quoted[pos]) {
+            pos++;
+        }
+        start = pos;
+        if (names[1] == NULL) {
+            end = line->len;
+            while (end > start && is_ifs(text[end-1]) && !quoted[end-1]) {
+                end--;
+            }
+        } else {
+            while (pos < line->len && !(is_ifs(text[pos]) && !quoted[pos])) {
+                pos++;
+            }
+            end = pos;
+        }
+        value = strndup(text + start, end - start);
+        var_set(&sh->vars, *names, value);
+        free(value);
+    }
+}
+
+/* read [-r] [-u FD] [NAME...] reads a line and splits it between the
+ * names, or puts all of it in REPLY. Without -r a backslash quotes the
+ * next character and one at the end joins the next line. */
+static int read_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    static char *reply[] = { "REPLY", NULL };
+    strbuf line;
+    char **names, *quoted;
+    int raw = 0, fd = 0, status, i;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            raw = 1;
+        } else if (strcmp(argv[i], "-u") == 0 && argv[i+1] != NULL) {
+            if (parse_input_fd("read", argv[++i], &fd) == -1) {
+                return 2;
+            }
+        } else {
+            log_error("read: usage: read [-r] [-u FD] [NAME...]");
+            return 2;
+        }
+    }
+    names = argv[i] != NULL ? argv + i : reply;
+    for (i = 0; names[i] != NULL; i++) {
+        if (!is_var_name(names[i], strlen(names[i]))) {
+            log_error("read: %s: not a valid identifier", names[i]);
+            return 2;
+        }
+    }
+    strbuf_init(&line, 256);
+    strbuf_clear(&line);
+    status = read_line(fd, &line);
+    while (!raw && status == 1 && line.len > 0 &&
+           line.chars[line.len-1] == '\\')
+    {
+        for (i = line.len - 1; i > 0 && line.chars[i-1] == '\\'; i--)
+            {}
+        if ((line.len - i) % 2 == 0) {
+            break;
+        }
+        strbuf_truncate(&line, line.len - 1);
+        status = read_line(fd, &line);
+    }
+    if (status == -1) {
+        log_error("read: %s", strerror(errno));
+        strbuf_free(&line);
+        return 1;
+    }
+    quoted = calloc(line.len + 1, 1);
+    if (!raw) {
+        unescape_line(&line, quoted);
+    }
+    if (names == reply) {
+        var_set(&sh->vars, "REPLY", line.chars);
+    } else {
+        assign_fields(sh, names, &line, quoted);
+    }
+    free(quoted);
+    strbuf_free(&line);
+    return status == 1 ? 0 : 1;
+}
+
+/* mapfile [-t] [-n COUNT] [-u FD] loads the lines of the input into the
+ * positional parameters, the one list the shell has; -t drops their
+ * newlines. Without -n the input is read to the end in large blocks. */
+static int mapfile_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    param_frame *params = sh->params;
+    strbuf text;
+    char **lines;
+    long count = -1;
+    int strip = 0, fd = 0, status = 0, n, i;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-t") == 0) {
+            strip = 1;
+        } else if (strcmp(argv[i], "-n") == 0 && argv[i+1] != NULL) {
+            count = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-u") == 0 && argv[i+1] != NULL) {
+            if (parse_input_fd(argv[0], argv[++i], &fd) == -1) {
+                return 2;
+            }
+        } else {
+            log_error("%s: usage: %s [-t] [-n COUNT] [-u FD]",
+                      argv[0], argv[0]);
+            return 2;
+        }
+    }
+    strbuf_init(&text, line_block);
+    strbuf_clear(&text);
+    if (count > 0) {
+        for (n = 0; n < count; n++) {
+            status = read_line(fd, &text);
+            if (status != 1) {
+                break;
+            }
+            strbuf_append(&text, '\n');
+        }
+    } else {
+        status = read_rest(fd, &text);
+    }
+    if (status == -1) {
+        log_error("%s: %s", argv[0], strerror(errno));
+        strbuf_free(&text);
+        return 1;
+    }
+    lines = split_lines(text.chars, text.len, !strip, &n);
+    strbuf_free(&text);
+    free(params->owned);
+    params->owned = lines;
+    params->argv = lines;
+    params->argc = n;
+    return 0;
+}
+
+static void write_rlimit(builtin_io *io, const rlimit_kind *kind,
+                         rlim_t value, int with_name)
+{
+    char buf[128];
+    int len = 0;
+
+    if (with_name) {
+        len = snprintf(buf, sizeof(buf), "%-28s(-%c) ",
+                       kind->description, kind->letter);
+    }
+    if (value == RLIM_INFINITY) {
+        len += snprintf(buf + len, sizeof(buf) - len, "unlimited\n");
+    } else {
+        len += snprintf(buf + len, sizeof(buf) - len, "%llu\n",
+                        (unsigned long long)(value / kind->unit));
+    }
+    builtin_write(io, buf, len);
+}
+
+/* ulimit [-H|-S] [-a | -LETTER [VALUE]] works on the shell's own limits,
+ * which everything it starts inherits. A new value without -H or -S
+ * sets both. */
+static int ulimit_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    const rlimit_kind *kind = find_rlimit_kind('f');
+    struct rlimit rl;
+    rlim_t value;
+    int hard = 0, soft = 0, all = 0, i;
+    const char *opt;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        for (opt = argv[i] + 1; *opt != '\0'; opt++) {
+            if (*opt == 'H') {
+                hard = 1;
+            } else if (*opt == 'S') {
+                soft = 1;
+            } else if (*opt == 'a') {
+                all = 1;
+            } else if ((kind = find_rlimit_kind(*opt)) == NULL) {
+                log_error("ulimit: -%c: invalid option", *opt);
+                return 2;
+            }
+        }
+    }
+    if (all) {
+        for (kind = rlimit_kinds(); kind->letter != 0; kind++) {
+            getrlimit(kind->resource, &rl);
+            write_rlimit(io, kind, hard ? rl.rlim_max : rl.rlim_cur, 1);
+        }
+        return 0;
+    }
+    getrlimit(kind->resource, &rl);
+    if (argv[i] == NULL) {
+        write_rlimit(io, kind, hard ? rl.rlim_max : rl.rlim_cur, 0);
+        return 0;
+    }
+    if (parse_rlimit_value(argv[i], kind, &value) == -1) {
+        log_error("ulimit: %s: invalid limit", argv[i]);
+        return 1;
+    }
+    if (hard || !soft) {
+        rl.rlim_max = value;
+    }
+    if (soft || !hard) {
+        rl.rlim_cur = value;
+    }
+    if (setrlimit(kind->resource, &rl) == -1) {
+        log_error("ulimit: %s", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/* stats [-p] prints the runtime counters, with -p in the Prometheus
+ * text format that also goes to $SHELLMA_METRICS_FILE on exit. */
+static int stats_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    strbuf text;
+    int prometheus = 0;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-p") == 0) {
+        prometheus = 1;
+    } else if (argv[1] != NULL) {
+        log_error("stats: usage: stats [-p]");
+        return 2;
+    }
+    strbuf_init(&text, 1024);
+    strbuf_clear(&text);
+    metrics_format(&text, prometheus);
+    builtin_write(io, text.chars, text.len);
+    strbuf_free(&text);
+    return 0;
+}
+
+static int exit_builtin(shell *sh, char **argv, builtin_io *io)
+{
+    int status;
+
+    status = argv[1] != NULL ? atoi(argv[1]) : sh->last_status;
+    exit_shell(sh, status);
+    return status;
+}
+
+static const builtin builtins[] = {
+    { ":",          &true_builtin,      builtin_pure },
+    { "cd",         &cd_builtin,        0 },
+    { "echo",       &echo_builtin,      builtin_pure },
+    { "exit",       &exit_builtin,      0 },
+    { "export",     &export_builtin,    0 },
+    { "false",      &false_builtin,     builtin_pure },
+    { "mapfile",    &mapfile_builtin,   0 },
+    { "pwd",        &pwd_builtin,       builtin_pure },
+    { "read",       &read_builtin,      0 },
+    { "readarray",  &mapfile_builtin,   0 },
+    { "return",     &return_builtin,    0 },
+    { "shift",      &shift_builtin,     0 },
+    { "stats",      &stats_builtin,     builtin_pure },
+    { "true",       &true_builtin,      builtin_pure },
+    { "ulimit",     &ulimit_builtin,    0 },
+    { "unset",      &unset_builtin,     0 }
+};
+
+const builtin *find_builtin(const char *name)
+{
+    int i;
+
+    for (i = 0; i < sizeof(builtins) / sizeof(*builtins); i++) {
+        if (strcmp(name, builtins[i].name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef BUILTINS_SENTRY
+#define BUILTINS_SENTRY
+#include "shell.h"
+#include "strbuf.h"
+
+
+enum builtin_flags {
+    builtin_pure = 1<<0     /* leaves the shell state alone */
+};
+
+typedef struct {
+    int out_fd;
+    strbuf *out;
+} builtin_io;
+
+typedef int (*builtin_fn)(shell *sh, char **argv, builtin_io *io);
+
+typedef struct {
+    const char *name;
+    builtin_fn fn;
+    int flags;
+} builtin;
+
+const builtin *find_builtin(const char *name);
+void builtin_write(builtin_io *io, const char *str, int len);
+
+#endif
@@ -0,0 +1,271 @@
+#include "capture.h"
+#include "parser.h"
+#include "executor.h"
+#include "optimize.h"
+#include "metrics.h"
+#include "lines.h"
+#include "wrappers.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+enum { syntax_error_status = 2 };
+
+static long long realtime_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void put_u32(strbuf *buf, uint32_t value)
+{
+    strbuf_append_mem(buf, (const char *)&value, sizeof(value));
+}
+
+static void put_i64(strbuf *buf, int64_t value)
+{
+    strbuf_append_mem(buf, (const char *)&value, sizeof(value));
+}
+
+/* $SHELLMA_CAPTURE names the file; what is already in it is kept, so
+ * several sessions can go to one recording. */
+int capture_open(capture *cap, const char *path)
+{
+    cap->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (cap->fd == -1) {
+        log_error("%s: %s", path, strerror(errno));
+        return -1;
+    }
+    cap->fd = move_internal_fd(cap->fd);
+    if (lseek(cap->fd, 0, SEEK_END) == 0) {
+        write(cap->fd, CAPTURE_MAGIC, capture_magic_len);
+    }
+    strbuf_init(&cap->text, 256);
+    strbuf_clear(&cap->text);
+    strbuf_init(&cap->record, 256);
+    cap->cwd = NULL;
+    cap->run_start = 0;
+    return 0;
+}
+
+void capture_char(capture *cap, char ch)
+{
+    if (cap->text.len == 0) {
+        cap->start_ns = realtime_ns();
+    }
+    strbuf_append(&cap->text, ch);
+}
+
+void capture_begin_run(capture *cap)
+{
+    cap->run_start = metrics_clock_ns();
+}
+
+/* One write per statement, with a directory record in front when the
+ * statement before it changed the directory. */
+void capture_statement(capture *cap, int status)
+{
+    char cwd[4096];
+
+    if (cap->text.len == 0) {
+        return;
+    }
+    strbuf_clear(&cap->record);
+    if (getcwd(cwd, sizeof(cwd)) != NULL &&
+        (cap->cwd == NULL || strcmp(cap->cwd, cwd) != 0))
+    {
+        free(cap->cwd);
+        cap->cwd = strdup(cwd);
+        strbuf_append(&cap->record, 'd');
+        put_u32(&cap->record, strlen(cwd));
+        strbuf_append_mem(&cap->record, cwd, strlen(cwd));
+    }
+    strbuf_append(&cap->record, 's');
+    put_i64(&cap->record, cap->start_ns);
+    put_i64(&cap->record, cap->run_start != 0
+            ? metrics_clock_ns() - cap->run_start : 0);
+    put_u32(&cap->record, status);
+    put_u32(&cap->record, cap->text.len);
+    strbuf_append_mem(&cap->record, cap->text.chars, cap->text.len);
+    if (write(cap->fd, cap->record.chars, cap->record.len) != cap->record.len) {
+        log_error("capture: %s", strerror(errno));
+    }
+    strbuf_clear(&cap->text);
+    cap->run_start = 0;
+}
+
+void capture_close(capture *cap)
+{
+    close(cap->fd);
+    strbuf_free(&cap->text);
+    strbuf_free(&cap->record);
+    free(cap->cwd);
+}
+
+typedef struct {
+    const char *pos, *end;
+} reader;
+
+static int get_bytes(reader *r, void *dst, long len)
+{
+    if (r->end - r->pos < len) {
+        return -1;
+    }
+    memcpy(dst, r->pos, len);
+    r->pos += len;
+    return 0;
+}
+
+typedef struct {
+    long long lex_ns, parse_ns, exec_ns;
+} phase_times;
+
+/* Runs one recorded statement the way the prompt would, timing each
+ * phase on its own. */
+static int replay_statement(shell *sh, const char *text, int len,
+                            phase_times *t)
+{
+    lexer lex;
+    token_item *tokens, *err_pos;
+    ast_list_node *stmts;
+    long long start;
+    int i, status;
+
+    start = metrics_clock_ns();
+    lexer_init(&lex);
+    lexer_start(&lex);
+    for (i = 0; i < len; i++) {
+        lexer_feed(&lex, text[i]);
+    }
+    status = lexer_end(&lex, &tokens);
+    t->lex_ns = metrics_clock_ns() - start;
+    t->parse_ns = t->exec_ns = 0;
+    if (status == lexer_ok) {
+        start = metrics_clock_ns();
+        status = parse(&stmts, tokens, &err_pos);
+        if (status == 0 && optimize_wanted(&sh->vars)) {
+            optimize_ast(stmts, &sh->funcs, 0);
+        }
+        t->parse_ns = metrics_clock_ns() - start;
+    }
+    if (status == 0) {
+        start = metrics_clock_ns();
+        execute(sh, stmts);
+        t->exec_ns = metrics_clock_ns() - start;
+        ast_list_free(stmts);
+    }
+    tokens_free(tokens);
+    lexer_free(&lex);
+    return status == 0 ? sh->last_status : syntax_error_status;
+}
+
+/* The first line of the statement, for the report. */
+static int summary_len(const char *text, int len)
+{
+    const char *nl = memchr(text, '\n', len);
+
+    return nl != NULL ? nl - text : len;
+}
+
+/* shellma --replay [--stub] FILE runs a capture again with stdin and
+ * stdout on /dev/null. --stub makes external commands exit 0 right
+ * after the fork. The report on the original stdout has a line per
+ * statement: lexer, parser and executor time in nanoseconds, the time
+ * it ran for when captured, the status now and then, and its first
+ * line. */
+int replay_main(shell *sh, int argc, const char **argv)
+{
+    strbuf data;
+    reader r;
+    phase_times t, total = { 0, 0, 0 };
+    char magic[capture_magic_len], *dir, *text;
+    int64_t start_ns, run_ns;
+    int32_t old_status;
+    uint32_t len;
+    int fd, report, null_fd, count = 0, status;
+    char kind;
+    FILE *out;
+
+    if (argc > 0 && strcmp(argv[0], "--stub") == 0) {
+        sh->stub_exec = 1;
+        argc--;
+        argv++;
+    }
+    if (argc != 1) {
+        log_error("usage: shellma --replay [--stub] FILE");
+        return 2;
+    }
+    fd = open(argv[0], O_RDONLY | O_CLOEXEC);
+    strbuf_init(&data, 4096);
+    strbuf_clear(&data);
+    if (fd == -1 || read_rest(fd, &data) == -1) {
+        log_error("%s: %s", argv[0], strerror(errno));
+        return 1;
+    }
+    close(fd);
+    r.pos = data.chars;
+    r.end = data.chars + data.len;
+    if (get_bytes(&r, magic, capture_magic_len) == -1 ||
+        memcmp(magic, CAPTURE_MAGIC, capture_magic_len) != 0)
+    {
+        log_error("%s: not a capture file", argv[0]);
+        strbuf_free(&data);
+        return 1;
+    }
+
+    fflush(stdout);
+    report = dup_internal_fd(1);
+    out = fdopen(report, "w");
+    null_fd = open("/dev/null", O_RDWR);
+    dup2(null_fd, 0);
+    dup2(null_fd, 1);
+    close(null_fd);
+
+    fprintf(out, "#\tlex_ns\tparse_ns\texec_ns\tcaptured_ns\tstatus\t"
+            "captured\tstatement\n");
+    while (get_bytes(&r, &kind, 1) == 0) {
+        if (kind == 'd' && get_bytes(&r, &len, sizeof(len)) == 0 &&
+            r.end - r.pos >= len)
+        {
+            dir = strndup(r.pos, len);
+            r.pos += len;
+            if (chdir(dir) == -1) {
+                log_error("cd: %s: %s", dir, strerror(errno));
+            }
+            free(dir);
+            continue;
+        }
+        if (kind != 's' ||
+            get_bytes(&r, &start_ns, sizeof(start_ns)) == -1 ||
+            get_bytes(&r, &run_ns, sizeof(run_ns)) == -1 ||
+            get_bytes(&r, &old_status, sizeof(old_status)) == -1 ||
+            get_bytes(&r, &len, sizeof(len)) == -1 ||
+            r.end - r.pos < len)
+        {
+            log_error("%s: truncated or damaged record", argv[0]);
+            break;
+        }
+        text = (char *)r.pos;
+        r.pos += len;
+        status = replay_statement(sh, text, len, &t);
+        total.lex_ns += t.lex_ns;
+        total.parse_ns += t.parse_ns;
+        total.exec_ns += t.exec_ns;
+        fprintf(out, "%d\t%lld\t%lld\t%lld\t%lld\t%d\t%d\t%.*s\n", ++count,
+                t.lex_ns, t.parse_ns, t.exec_ns, (long long)run_ns, status,
+                old_status, summary_len(text, len), text);
+    }
+    fprintf(out, "total\t%lld\t%lld\t%lld\n", total.lex_ns, total.parse_ns,
+            total.exec_ns);
+    fclose(out);
+    strbuf_free(&data);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef CAPTURE_SENTRY
+#define CAPTURE_SENTRY
+#include "shell.h"
+#include "strbuf.h"
+
+
+/* A capture file starts with capture_magic and holds records of one
+ * kind byte each, in host byte order:
+ *   'd' u32 len, the directory the following statements ran in
+ *   's' i64 start_ns (CLOCK_REALTIME), i64 run_ns, i32 status,
+ *       u32 len, the input lines of one statement */
+#define CAPTURE_MAGIC "SHCAP1\n"
+
+enum { capture_magic_len = 8 };
+
+typedef struct {
+    int fd;
+    strbuf text, record;
+    char *cwd;
+    long long start_ns, run_start;
+} capture;
+
+int capture_open(capture *cap, const char *path);
+void capture_char(capture *cap, char ch);
+void capture_begin_run(capture *cap);
+void capture_statement(capture *cap, int status);
+void capture_close(capture *cap);
+int replay_main(shell *sh, int argc, const char **argv);
+
+#endif
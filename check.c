@@ -0,0 +1,142 @@
+#include "check.h"
+#include "parser.h"
+#include "wrappers.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* Files go to the workers one at a time from a shared counter, so a few
+ * large scripts do not leave the other threads idle. Messages are kept
+ * per file and printed in argument order once all of them are done. */
+typedef struct {
+    const char **files;
+    int count, next;
+    char **messages;
+    int *statuses;
+} check_job;
+
+/* Each file is parsed as a whole, the way a script file is run. */
+static int check_text(const char *path, const char *text, long len,
+                      char **message)
+{
+    ast_list_node *stmts;
+    char *error, buf[4096];
+
+    if (parse_text(&stmts, text, len, &error) != 0) {
+        snprintf(buf, sizeof(buf), "%s:%s", path, error);
+        *message = strdup(buf);
+        free(error);
+        return check_error_status;
+    }
+    ast_list_free(stmts);
+    return 0;
+}
+
+static int check_file(const char *path, char **message)
+{
+    struct stat st;
+    char buf[4096];
+    void *text;
+    int fd, status;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        snprintf(buf, sizeof(buf), "%s: %s", path, strerror(errno));
+        *message = strdup(buf);
+        if (fd != -1) {
+            close(fd);
+        }
+        return check_open_status;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        snprintf(buf, sizeof(buf), "%s: %s", path, strerror(errno));
+        *message = strdup(buf);
+        return check_open_status;
+    }
+    posix_madvise(text, st.st_size, POSIX_MADV_SEQUENTIAL);
+    status = check_text(path, text, st.st_size, message);
+    munmap(text, st.st_size);
+    return status;
+}
+
+static void *check_worker(void *arg)
+{
+    check_job *job = arg;
+    int i;
+
+    for (;;) {
+        i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) {
+            return NULL;
+        }
+        job->statuses[i] = check_file(job->files[i], &job->messages[i]);
+    }
+}
+
+static int worker_count(int files)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) {
+        n = 1;
+    }
+    return n < files ? n : files;
+}
+
+/* shellma -n FILE... only lexes and parses the files, one per worker
+ * thread at a time. The status is 2 if any of them has a syntax error
+ * and 1 if one could not be read. */
+int check_main(int argc, const char **argv)
+{
+    check_job job;
+    pthread_t *threads;
+    int count, status = 0, i;
+
+    if (argc < 1) {
+        log_error("usage: shellma -n FILE...");
+        return 2;
+    }
+    job.files = argv;
+    job.count = argc;
+    job.next = 0;
+    job.messages = calloc(argc, sizeof(char *));
+    job.statuses = calloc(argc, sizeof(int));
+    count = worker_count(argc);
+    threads = malloc(sizeof(pthread_t) * count);
+    for (i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, &check_worker, &job) != 0) {
+            count = i;
+            break;
+        }
+    }
+    check_worker(&job);
+    for (i = 1; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < argc; i++) {
+        if (job.messages[i] != NULL) {
+            log_error("%s", job.messages[i]);
+            free(job.messages[i]);
+        }
+        if (job.statuses[i] > status) {
+            status = job.statuses[i];
+        }
+    }
+    free(threads);
+    free(job.messages);
+    free(job.statuses);
+    return status;
+}
@@ -0,0 +1,9 @@
+#ifndef CHECK_SENTRY
+#define CHECK_SENTRY
+
+
+enum { check_error_status = 2, check_open_status = 1 };
+
+int check_main(int argc, const char **argv);
+
+#endif
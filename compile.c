@@ -0,0 +1,248 @@
+#include "compile.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct {
+    vm_program *prog;
+    int depth;
+} compiler;
+
+static void compile_ast_node(compiler *c, const ast_node *node);
+
+static int emit(compiler *c, enum vm_opcode op)
+{
+    vm_program *prog = c->prog;
+    vm_instr *instr;
+
+    if (prog->len == prog->capacity) {
+        prog->capacity *= 2;
+        prog->code = realloc(prog->code, sizeof(vm_instr) * prog->capacity);
+    }
+    instr = &prog->code[prog->len];
+    instr->op = op;
+    instr->slot = c->depth;
+    instr->target = -1;
+    instr->node = NULL;
+    return prog->len++;
+}
+
+/* Points a forward jump at the next instruction to be emitted. */
+static void patch(compiler *c, int idx)
+{
+    c->prog->code[idx].target = c->prog->len;
+}
+
+static void enter_slot(compiler *c)
+{
+    c->depth++;
+    if (c->depth > c->prog->slot_count) {
+        c->prog->slot_count = c->depth;
+    }
+}
+
+static void compile_ast_list(compiler *c, const ast_list_node *stmts)
+{
+    for (; stmts != NULL; stmts = stmts->next) {
+        compile_ast_node(c, stmts->node);
+    }
+}
+
+/* exec with redirections only, which changes the fds of the shell. */
+int is_fd_exec(const ast_node *node)
+{
+    return node->type == ast_type_command && node->command.argc == 1 &&
+        node->command.assign_count == 0 &&
+        node->command.words[0].parts == NULL &&
+        strcmp(node->command.argv[0], "exec") == 0;
+}
+
+static void compile_redirection(compiler *c, const ast_redirection *redir)
+{
+    int start, keep = is_fd_exec(redir->child);
+
+    start = emit(c, op_redirect);
+    c->prog->code[start].redir = redir->entries;
+    enter_slot(c);
+    if (!keep) {
+        compile_ast_node(c, redir->child);
+    }
+    c->depth--;
+    c->prog->code[emit(c, keep ? op_keep : op_restore)].redir =
+        redir->entries;
+    patch(c, start);
+}
+
+static void compile_pipeline(compiler *c, const ast_pipeline *pipeline)
+{
+    const ast_list_node *stage;
+
+    for (stage = pipeline->chain; stage != NULL; stage = stage->next) {
+        enum vm_opcode op = stage == pipeline->chain ? op_pipe_first
+            : stage->next == NULL ? op_pipe_last
+            : op_pipe_middle;
+
+        c->prog->code[emit(c, op)].node = stage->node;
+    }
+    emit(c, op_wait);
+}
+
+static void compile_logical(compiler *c, const ast_logical *logic)
+{
+    int jump;
+
+    compile_ast_node(c, logic->left);
+    jump = emit(c, logic->type == token_and ? op_jump_fail : op_jump_ok);
+    compile_ast_node(c, logic->right);
+    patch(c, jump);
+}
+
+/* An if without a taken branch succeeds. */
+static void compile_if(compiler *c, const ast_if *clause)
+{
+    int to_else, to_end;
+
+    compile_ast_list(c, clause->cond);
+    to_else = emit(c, op_jump_fail);
+    compile_ast_list(c, clause->then_body);
+    to_end = emit(c, op_jump);
+    patch(c, to_else);
+    if (clause->else_body != NULL) {
+        compile_ast_list(c, clause->else_body);
+    } else {
+        c->prog->code[emit(c, op_set_status)].status = 0;
+    }
+    patch(c, to_end);
+}
+
+static void compile_loop(compiler *c, const ast_loop *loop)
+{
+    int cond, leave;
+
+    emit(c, op_loop_begin);
+    enter_slot(c);
+    cond = c->prog->len;
+    compile_ast_list(c, loop->cond);
+    leave = emit(c, loop->until ? op_jump_ok : op_jump_fail);
+    compile_ast_list(c, loop->body);
+    c->depth--;
+    emit(c, op_loop_record);
+    c->prog->code[emit(c, op_jump)].target = cond;
+    patch(c, leave);
+    emit(c, op_loop_end);
+}
+
+static void compile_for(compiler *c, const ast_for *clause)
+{
+    int next;
+
+    c->prog->code[emit(c, op_for_begin)].for_clause = clause;
+    next = emit(c, op_for_next);
+    c->prog->code[next].for_clause = clause;
+    enter_slot(c);
+    compile_ast_list(c, clause->body);
+    c->depth--;
+    emit(c, op_loop_record);
+    c->prog->code[emit(c, op_jump)].target = next;
+    patch(c, next);
+    emit(c, op_for_end);
+}
+
+static void compile_ast_node(compiler *c, const ast_node *node)
+{
+    switch (node->type) {
+    case ast_type_command:
+        c->prog->code[emit(c, op_command)].command = &node->command;
+        break;
+    case ast_type_arith:
+        c->prog->code[emit(c, op_arith)].arith = &node->arith;
+        break;
+    case ast_type_subshell:
+        c->prog->code[emit(c, op_subshell)].subshell = &node->subshell;
+        break;
+    case ast_type_background:
+        c->prog->code[emit(c, op_background)].node = node->background.child;
+        break;
+    case ast_type_coproc:
+        c->prog->code[emit(c, op_coproc)].coproc = &node->coproc;
+        break;
+    case ast_type_function:
+        c->prog->code[emit(c, op_define)].function = &node->function;
+        break;
+    case ast_type_redirection:
+        compile_redirection(c, &node->redirection);
+        break;
+    case ast_type_pipeline:
+        compile_pipeline(c, &node->pipeline);
+        break;
+    case ast_type_logical:
+        compile_logical(c, &node->logical);
+        break;
+    case ast_type_if:
+        compile_if(c, &node->if_clause);
+        break;
+    case ast_type_loop:
+        compile_loop(c, &node->loop);
+        break;
+    case ast_type_for:
+        compile_for(c, &node->for_clause);
+        break;
+    case ast_type_group:
+        compile_ast_list(c, node->group.statements);
+        break;
+    case ast_type_fanout:
+        c->prog->code[emit(c, op_fanout)].fanout = &node->fanout;
+        break;
+    }
+}
+
+static void init_compiler(compiler *c)
+{
+    c->prog = malloc(sizeof(vm_program));
+    c->prog->capacity = 16;
+    c->prog->len = c->prog->slot_count = 0;
+    c->prog->code = malloc(sizeof(vm_instr) * c->prog->capacity);
+    c->depth = 0;
+}
+
+vm_program *compile_list(const ast_list_node *stmts)
+{
+    compiler c;
+
+    init_compiler(&c);
+    compile_ast_list(&c, stmts);
+    emit(&c, op_end);
+    return c.prog;
+}
+
+vm_program *compile_node(const ast_node *node)
+{
+    compiler c;
+
+    init_compiler(&c);
+    compile_ast_node(&c, node);
+    emit(&c, op_end);
+    return c.prog;
+}
+
+void program_free(vm_program *prog)
+{
+    if (prog == NULL) {
+        return;
+    }
+    free(prog->code);
+    free(prog);
+}
+
+const char *opcode_name(enum vm_opcode op)
+{
+    static const char *const names[] = {
+        "command", "arith", "subshell", "background", "coproc", "define",
+        "redirect", "restore", "keep", "pipe_first", "pipe_middle",
+        "pipe_last", "wait", "fanout", "jump", "jump_ok", "jump_fail",
+        "set_status", "loop_begin", "loop_record", "loop_end",
+        "for_begin", "for_next", "for_end", "end"
+    };
+
+    return names[op];
+}
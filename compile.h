@@ -0,0 +1,64 @@
+#ifndef COMPILE_SENTRY
+#define COMPILE_SENTRY
+#include "parser.h"
+
+
+enum vm_opcode {
+    op_command,         /* run a simple command */
+    op_arith,           /* (( expr )) */
+    op_subshell,
+    op_background,
+    op_coproc,          /* start a coprocess */
+    op_define,          /* function definition */
+    op_redirect,        /* apply redirections, jump to target on failure */
+    op_restore,         /* undo the redirections of the slot */
+    op_keep,            /* or keep them, for exec without a command */
+    op_pipe_first,      /* fork a pipeline stage */
+    op_pipe_middle,
+    op_pipe_last,
+    op_wait,            /* wait for the stages of the pipeline */
+    op_fanout,          /* run a fan-out and wait for all of it */
+    op_jump,
+    op_jump_ok,         /* jump when the last status is zero */
+    op_jump_fail,       /* jump when it is not */
+    op_set_status,
+    op_loop_begin,      /* a loop keeps the status of its last body run */
+    op_loop_record,
+    op_loop_end,
+    op_for_begin,       /* expand the words of a for loop into the slot */
+    op_for_next,        /* assign the next word or jump to target */
+    op_for_end,
+    op_end
+};
+
+/* Loops and redirections keep their state in a slot; nested constructs
+ * get different slots, siblings share them. */
+typedef struct {
+    enum vm_opcode op;
+    int slot, target;
+    union {
+        const ast_node *node;
+        const ast_command *command;
+        const ast_arith *arith;
+        const ast_subshell *subshell;
+        const ast_function *function;
+        const ast_for *for_clause;
+        const ast_fanout *fanout;
+        const ast_coproc *coproc;
+        redir_entry *redir;
+        int status;
+    };
+} vm_instr;
+
+struct vm_program {
+    vm_instr *code;
+    int len, capacity, slot_count;
+};
+
+int is_fd_exec(const ast_node *node);
+vm_program *compile_list(const ast_list_node *stmts);
+vm_program *compile_node(const ast_node *node);
+void program_free(vm_program *prog);
+const char *opcode_name(enum vm_opcode op);
+
+#endif
@@ -0,0 +1,88 @@
+#include "deadline.h"
+#include "wrappers.h"
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+
+/* Deadlines are milliseconds on the monotonic clock; 0 means none. */
+long long monotonic_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Durations are written like for timeout(1): a number of seconds,
+ * possibly fractional, with an optional s, m, h or d suffix. */
+int parse_duration(const char *str, long long *ms)
+{
+    static const struct {
+        char suffix;
+        long long scale;
+    } units[] = {
+        { '\0', 1000 }, { 's', 1000 }, { 'm', 60000 },
+        { 'h', 3600000 }, { 'd', 86400000 }
+    };
+    char *end;
+    double value;
+    int i;
+
+    if (!isdigit((unsigned char)*str) && *str != '.') {
+        return -1;
+    }
+    value = strtod(str, &end);
+    for (i = 0; i < sizeof(units) / sizeof(*units); i++) {
+        if (*end == units[i].suffix &&
+            (*end == '\0' || end[1] == '\0'))
+        {
+            value *= units[i].scale;
+            if (value > 1e15) {
+                return -1;
+            }
+            *ms = (long long)value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+long long earlier_deadline(long long a, long long b)
+{
+    if (a == 0) {
+        return b;
+    }
+    return b == 0 || a < b ? a : b;
+}
+
+/* timeout [-k DURATION] DURATION COMMAND [ARG...]; returns the index of
+ * COMMAND. A zero duration means no timeout. */
+int parse_timeout_args(char **argv, long long *duration, int *kill_after)
+{
+    long long ms;
+    int i = 1;
+
+    if (argv[i] != NULL && strcmp(argv[i], "-k") == 0) {
+        if (argv[i + 1] == NULL || parse_duration(argv[i + 1], &ms) == -1 ||
+            ms > INT_MAX)
+        {
+            log_error("timeout: invalid kill duration");
+            return -1;
+        }
+        *kill_after = ms;
+        i += 2;
+    }
+    if (argv[i] == NULL || argv[i + 1] == NULL) {
+        log_error("timeout: usage: timeout [-k DURATION] DURATION "
+                  "COMMAND [ARG...]");
+        return -1;
+    }
+    if (parse_duration(argv[i], duration) == -1) {
+        log_error("timeout: %s: invalid duration", argv[i]);
+        return -1;
+    }
+    return i + 1;
+}
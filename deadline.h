@@ -0,0 +1,12 @@
+#ifndef DEADLINE_SENTRY
+#define DEADLINE_SENTRY
+
+
+enum { default_kill_after = 5000 };
+
+long long monotonic_ms();
+int parse_duration(const char *str, long long *ms);
+long long earlier_deadline(long long a, long long b);
+int parse_timeout_args(char **argv, long long *duration, int *kill_after);
+
+#endif
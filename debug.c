@@ -6,7 +6,7 @@ void log_tokens(FILE *f, const token_item *token)
 {
     fprintf(f, "LOG: TOKENS:\n");
     while (token != NULL) {
-        if (is_token_type(token, token_word)) {
+        if (is_token_type(token, token_word | token_arith)) {
             fprintf(f, "(%s: %s)", token_name(token->type),
                     token->str_val);
         } else if (is_token_redir(token)) {
@@ -29,27 +29,98 @@ static void put_tabs(FILE *f, int count)
 
 static void log_ast_list(FILE *f, const ast_list_node *head, int depth);
 
+static void log_word(FILE *f, const ast_word *word)
+{
+    const ast_word_part *part;
+
+    if (word->parts == NULL) {
+        fprintf(f, "%s", word->text);
+        return;
+    }
+    for (part = word->parts; part != NULL; part = part->next) {
+        const char *quote = part->quoted ? "\"" : "";
+
+        switch (part->type) {
+        case part_literal:
+            fprintf(f, "%s%s%s", quote, part->text, quote);
+            break;
+        case part_param:
+            fprintf(f, "%s${%s}%s", quote, part->text, quote);
+            break;
+        case part_command:
+            fprintf(f, "%s$(%s)%s", quote, part->text, quote);
+            break;
+        case part_arith:
+            fprintf(f, "%s$((%s))%s", quote, part->text, quote);
+            break;
+        case part_procsub_in:
+            fprintf(f, "<(%s)", part->text);
+            break;
+        case part_procsub_out:
+            fprintf(f, ">(%s)", part->text);
+            break;
+        }
+    }
+}
+
 static void log_command(FILE *f, const ast_command *cmd)
 {
-    char **argv = cmd->argv;
+    int i;
 
     fprintf(f, "command: [");
-    while (*argv != NULL) {
-        fprintf(f, "%s%s", *argv, argv[1] == NULL ? "]\n" : ", ");
-        argv++;
+    for (i = 0; i < cmd->assign_count; i++) {
+        fprintf(f, "%s=", cmd->assigns[i].name);
+        log_word(f, &cmd->assigns[i].value);
+        fprintf(f, "%s", i+1 < cmd->assign_count + cmd->argc ? ", " : "");
+    }
+    for (i = 0; i < cmd->argc; i++) {
+        log_word(f, &cmd->words[i]);
+        fprintf(f, "%s", i+1 < cmd->argc ? ", " : "");
     }
+    fprintf(f, "]\n");
 }
 
 static void log_redirection(FILE *f, const redir_entry *entries)
 {
     fprintf(f, "redirection: [");
     while (entries != NULL) {
-        fprintf(f, "%d%s %s%s", entries->target_fd, token_name(entries->type),
-                entries->filename, entries->next == NULL ? "]\n" : ", ");
+        fprintf(f, "%d%s ", entries->target_fd, token_name(entries->type));
+        log_word(f, &entries->filename);
+        fprintf(f, "%s", entries->next == NULL ? "]\n" : ", ");
         entries = entries->next;
     }
 }
 
+static void log_if(FILE *f, const ast_if *clause, int depth)
+{
+    fprintf(f, "if:\n");
+    log_ast_list(f, clause->cond, depth);
+    put_tabs(f, depth-1);
+    fprintf(f, "then:\n");
+    log_ast_list(f, clause->then_body, depth);
+    if (clause->else_body != NULL) {
+        put_tabs(f, depth-1);
+        fprintf(f, "else:\n");
+        log_ast_list(f, clause->else_body, depth);
+    }
+}
+
+static void log_for(FILE *f, const ast_for *clause, int depth)
+{
+    int i;
+
+    fprintf(f, "for %s in [", clause->name);
+    if (clause->words == NULL) {
+        fprintf(f, "\"$@\"");
+    }
+    for (i = 0; i < clause->word_count; i++) {
+        log_word(f, &clause->words[i]);
+        fprintf(f, "%s", i+1 < clause->word_count ? ", " : "");
+    }
+    fprintf(f, "]:\n");
+    log_ast_list(f, clause->body, depth);
+}
+
 static void log_ast_node(FILE *f, const ast_node *node, int depth)
 {
     put_tabs(f, depth);
@@ -83,6 +154,41 @@ static void log_ast_node(FILE *f, const ast_node *node, int depth)
         fprintf(f, "background:\n");
         log_ast_node(f, node->background.child, depth);
         break;
+    case ast_type_coproc:
+        fprintf(f, "coproc %s:\n", node->coproc.name);
+        log_ast_node(f, node->coproc.child, depth);
+        break;
+    case ast_type_arith:
+        fprintf(f, "arith: %s\n", node->arith.text);
+        break;
+    case ast_type_if:
+        log_if(f, &node->if_clause, depth);
+        break;
+    case ast_type_loop:
+        fprintf(f, "%s:\n", node->loop.until ? "until" : "while");
+        log_ast_list(f, node->loop.cond, depth);
+        put_tabs(f, depth-1);
+        fprintf(f, "do:\n");
+        log_ast_list(f, node->loop.body, depth);
+        break;
+    case ast_type_for:
+        log_for(f, &node->for_clause, depth);
+        break;
+    case ast_type_group:
+        fprintf(f, "group:\n");
+        log_ast_list(f, node->group.statements, depth);
+        break;
+    case ast_type_function:
+        fprintf(f, "function %s:\n", node->function.name);
+        log_ast_node(f, node->function.body->node, depth);
+        break;
+    case ast_type_fanout:
+        fprintf(f, "fanout:\n");
+        log_ast_node(f, node->fanout.source, depth);
+        put_tabs(f, depth-1);
+        fprintf(f, "into:\n");
+        log_ast_list(f, node->fanout.branches, depth);
+        break;
     }
 }
 
@@ -99,3 +205,48 @@ void log_ast(FILE *f, const ast_list_node *list)
     fprintf(f, "LOG: AST:\n");
     log_ast_list(f, list, 0);
 }
+
+void log_program(FILE *f, const vm_program *prog)
+{
+    int i;
+
+    fprintf(f, "LOG: PROGRAM:\n");
+    for (i = 0; i < prog->len; i++) {
+        const vm_instr *instr = &prog->code[i];
+
+        fprintf(f, "%4d %s", i, opcode_name(instr->op));
+        if (instr->target != -1) {
+            fprintf(f, " -> %d", instr->target);
+        }
+        switch (instr->op) {
+        case op_command:
+            fprintf(f, " %s", instr->command->argc > 0
+                    ? instr->command->argv[0] : "<assign>");
+            break;
+        case op_arith:
+            fprintf(f, " %s", instr->arith->text);
+            break;
+        case op_define:
+            fprintf(f, " %s", instr->function->name);
+            break;
+        case op_coproc:
+            fprintf(f, " %s", instr->coproc->name);
+            break;
+        case op_for_begin:
+            fprintf(f, " %s", instr->for_clause->name);
+            break;
+        case op_set_status:
+            fprintf(f, " %d", instr->status);
+            break;
+        default:
+            break;
+        }
+        if (instr->op == op_redirect || instr->op == op_restore ||
+            instr->op == op_keep ||
+            (instr->op >= op_loop_begin && instr->op <= op_for_end))
+        {
+            fprintf(f, " [slot %d]", instr->slot);
+        }
+        fprintf(f, "\n");
+    }
+}
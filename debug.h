@@ -3,9 +3,11 @@
 #include <stdio.h>
 #include "lexer.h"
 #include "parser.h"
+#include "compile.h"
 
 
 void log_tokens(FILE *f, const token_item *token);
 void log_ast(FILE *f, const ast_list_node *list);
+void log_program(FILE *f, const vm_program *prog);
 
 #endif
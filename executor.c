@@ -1,15 +1,41 @@
 #include "executor.h"
+#include "builtins.h"
+#include "expand.h"
+#include "compile.h"
+#include "pin.h"
+#include "deadline.h"
+#include "batch.h"
+#include "metrics.h"
+#include "lines.h"
+#include "optimize.h"
 #include "wrappers.h"
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+#ifndef F_GETPIPE_SZ
+#define F_GETPIPE_SZ 1032
+#endif
 
 
 enum { pipe_read = 0, pipe_write = 1 };
+enum { capture_chunk = 64 * 1024 };
+enum { pidless_poll_ms = 10, timeout_status = 124 };
+enum { fanout_chunk = 1 << 20, splice_move = 1 };
 
 
 /* TODO: maybe it be better way to use vector */
@@ -19,6 +45,7 @@ typedef struct wait_item_tag {
 } wait_item;
 
 static void execute_ast_node(shell *sh, const ast_node *node);
+static void run_program(shell *sh, const vm_program *prog);
 
 
 static void append_pid(wait_item **phead, int pid)
@@ -52,326 +79,2195 @@ static int get_exit_status(int status)
         : 128 + WTERMSIG(status);
 }
 
+/* Waits for pid alone: other children may be process substitutions
+ * that are reaped by the command that started them. */
+static void wait_for_pid(int pid, int *status, int options)
+{
+    int p;
+
+    do {
+        p = waitpid(pid, status, options);
+    } while (p == -1 && errno == EINTR);
+}
+
+/* Children are reaped by pid: a last stage running in the shell waits
+ * for its own commands while the other stages are still going. */
 static int wait_pids(wait_item *head)
 {
-    int p, status = 0, last_cmd, result;
+    int status, result = 0, last_cmd;
 
     last_cmd = head->pid;
     while (head != NULL) {
-        p = xwait(&status);
-        if (p == last_cmd) {
+        status = 0;
+        wait_for_pid(head->pid, &status, 0);
+        if (head->pid == last_cmd) {
             result = get_exit_status(status);
         }
-        remove_pid(&head, p);
+        remove_pid(&head, head->pid);
     }
     return result;
 }
 
-static int cd_builtin(char **argv)
+typedef struct {
+    long long deadline;
+    int kill_after, pgid, timed_out;
+} job_timer;
+
+static void kill_job(wait_item *head, int pgid, int sig)
 {
-    int status;
-    const char *path;
+    if (pgid > 0) {
+        kill(-pgid, sig);
+    }
+    for (; head != NULL; head = head->next) {
+        kill(head->pid, sig);
+    }
+}
+
+/* Like wait_pids, but returns the raw status. Each child gets a pidfd to
+ * poll on until the deadline; then the job gets SIGTERM, and SIGKILL
+ * kill_after milliseconds later if it is still there. */
+static int wait_pids_until(wait_item *head, job_timer *timer)
+{
+    struct pollfd *fds;
+    wait_item *item;
+    int *pids, count = 0, i, p = 0, status = 0, result = 0;
+    int last_cmd = head->pid;
+    int sig = SIGTERM, timeout;
+    long long now, deadline = timer->deadline;
 
-    if (argv[1] == NULL) {
-        path = getenv("HOME");
-        if (path == NULL) {
-            log_error("HOME variable is not set");
-            return 1;
+    for (item = head; item != NULL; item = item->next) {
+        count++;
+    }
+    fds = malloc(sizeof(struct pollfd) * count);
+    pids = malloc(sizeof(int) * count);
+    for (i = 0, item = head; item != NULL; i++, item = item->next) {
+        pids[i] = item->pid;
+        fds[i].fd = syscall(SYS_pidfd_open, item->pid, 0);
+        fds[i].events = POLLIN;
+    }
+    timer->timed_out = 0;
+    while (head != NULL) {
+        for (i = 0; i < count; i++) {
+            if (pids[i] != 0 &&
+                (p = waitpid(pids[i], &status, WNOHANG)) != 0)
+            {
+                break;
+            }
         }
-    } else {
-        path = argv[1];
+        if (i < count) {
+            if (p == last_cmd) {
+                result = status;
+            }
+            remove_pid(&head, pids[i]);
+            if (fds[i].fd != -1) {
+                close(fds[i].fd);
+            }
+            fds[i].fd = -1;
+            pids[i] = 0;
+            continue;
+        }
+        now = monotonic_ms();
+        if (deadline != 0 && now >= deadline) {
+            kill_job(head, timer->pgid, sig);
+            timer->timed_out = 1;
+            deadline = sig == SIGTERM ? now + timer->kill_after : 0;
+            sig = SIGKILL;
+            continue;
+        }
+        timeout = deadline != 0 ? deadline - now : -1;
+        for (i = 0; i < count; i++) {
+            /* no pidfd, so look again in a while */
+            if (fds[i].fd == -1 && pids[i] != 0 && timeout != 0 &&
+                (timeout == -1 || timeout > pidless_poll_ms))
+            {
+                timeout = pidless_poll_ms;
+            }
+        }
+        poll(fds, count, timeout);
     }
+    for (i = 0; i < count; i++) {
+        if (fds[i].fd != -1) {
+            close(fds[i].fd);
+        }
+    }
+    free(fds);
+    free(pids);
+    return result;
+}
 
-    status = chdir(path);
-    if (status == -1) {
-        log_error("cd: %s: %s", path, strerror(errno));
-        return 1;
+static void export_env(char **env)
+{
+    while (env != NULL && *env != NULL) {
+        putenv(*env++);
     }
-    return 0;
 }
 
-typedef int (*builtin_fn)(char **argv);
+/* Bodies of compound commands fork for their commands as usual, so a
+ * pipeline stage running one has to exit by itself once it is done. */
+static int enter_compound(shell *sh)
+{
+    int in_pipeline = sh->in_pipeline;
+
+    sh->in_pipeline = 0;
+    return in_pipeline;
+}
 
-builtin_fn find_builtin(const char *name)
+static void leave_compound(shell *sh, int in_pipeline)
 {
-    if (strcmp(name, "cd") == 0) {
-        return &cd_builtin;
+    if (in_pipeline) {
+        _exit(sh->last_status);
     }
-    return NULL;
 }
 
-static void wait_for_pid(int pid, int *status, int options)
+/* Functions run in the shell itself. argv[0] stays the function name
+ * and the rest becomes $1... on a frame that lives for the call. */
+static void call_function(shell *sh, func_body *body, char **argv)
 {
-    int p;
+    int in_pipeline = enter_compound(sh);
+    param_frame frame;
 
-    do {
-        p = waitpid(-1, status, options);
-    } while (p != pid);
+    frame.argv = argv + 1;
+    for (frame.argc = 0; frame.argv[frame.argc] != NULL; frame.argc++)
+        {}
+    frame.owned = NULL;
+    frame.prev = sh->params;
+    sh->params = &frame;
+    METRICS_ADD(functions, 1);
+    sh->func_depth++;
+    body->refs++;
+    if (body->code == NULL) {
+        body->code = compile_node(body->node);
+    }
+    run_program(sh, body->code);
+    func_body_release(body);
+    sh->func_depth--;
+    sh->params = frame.prev;
+    free(frame.owned);
+    sh->returning = 0;
+    leave_compound(sh, in_pipeline);
 }
 
-static void execute_command(shell *sh, const ast_command *cmd)
+static void run_command(shell *sh, char **argv, char **env);
+
+/* Finds name in $PATH the way execvp would, into path. */
+static int find_command(const char *name, strbuf *path)
 {
-    builtin_fn builtin_cb;
-    int pid, status;
+    const char *dirs = getenv("PATH"), *end;
+    struct stat st;
 
-    builtin_cb = find_builtin(cmd->argv[0]);
-    if (builtin_cb != NULL) {
-        sh->last_status = builtin_cb(cmd->argv);
-        if (sh->in_pipeline) {
-            exit(sh->last_status);
+    strbuf_clear(path);
+    if (strchr(name, '/') != NULL) {
+        strbuf_join(path, name);
+        return 0;
+    }
+    if (dirs == NULL) {
+        dirs = "/bin:/usr/bin";
+    }
+    for (; ; dirs = end + 1) {
+        end = strchr(dirs, ':');
+        if (end == NULL) {
+            end = dirs + strlen(dirs);
+        }
+        strbuf_clear(path);
+        strbuf_append_mem(path, dirs, end - dirs);
+        if (end > dirs) {
+            strbuf_append(path, '/');
+        }
+        strbuf_join(path, name);
+        if (stat(path->chars, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(path->chars, X_OK) == 0)
+        {
+            return 0;
+        }
+        if (*end == '\0') {
+            return -1;
         }
-        return;
     }
-    if (sh->in_pipeline) {
-        xexecvp(cmd->argv[0], cmd->argv);
+}
+
+/* Runs a script in the child already forked for it rather than have
+ * exec start another shell. Like a new shell, it only keeps what is
+ * exported and has the arguments as its parameters. */
+static void run_script(shell *sh, const char *path, char **argv)
+{
+    ast_list_node *stmts;
+    const char *src;
+    strbuf text;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    strbuf_init(&text, 4096);
+    strbuf_clear(&text);
+    if (fd == -1 || read_rest(fd, &text) == -1) {
+        log_error("%s: %s", path, strerror(errno));
+        _exit(126);
+    }
+    close(fd);
+    src = text.chars;
+    if (src[0] == '#' && src[1] == '!') {
+        src = strchr(src, '\n');
+        src = src != NULL ? src + 1 : "";
+    }
+    /* sh->pid stays the parent's, so exit_shell leaves without flushing
+     * the stdio buffers the child shares with it */
+    sh->pgid = getpgid(0);
+    sh->in_pipeline = 0;
+    sh->func_depth = sh->returning = 0;
+    sh->status_fd = -1;
+    sh->deadline = 0;
+    sh->procsubs = NULL;
+    drop_coprocs(sh);
+    vars_free(&sh->vars);
+    vars_init(&sh->vars);
+    /* the bodies may still be running further up; this process ends
+     * before it could go back to them */
+    funcs_init(&sh->funcs);
+    sh->top_params.argv = argv + 1;
+    for (sh->top_params.argc = 0; argv[sh->top_params.argc + 1] != NULL;
+         sh->top_params.argc++)
+        {}
+    sh->top_params.owned = NULL;
+    sh->top_params.prev = NULL;
+    sh->params = &sh->top_params;
+    METRICS_ADD(scripts, 1);
+    if (parse_string(&stmts, src) != 0) {
+        log_error("%s: syntax error", path);
+        exit_shell(sh, 2);
+    }
+    if (optimize_wanted(&sh->vars)) {
+        optimize_ast(stmts, &sh->funcs, isatty(1));
+    }
+    execute(sh, stmts);
+    exit_shell(sh, sh->last_status);
+}
+
+/* The last step of every external command, in its own process. A
+ * script without #!, which exec refuses, runs right here; one naming
+ * a shell goes through exec, as looking at the file before every exec
+ * would cost more than it saves. A replay with stubs ends the process
+ * at this point. */
+static void exec_command(shell *sh, char **argv, char **env)
+{
+    strbuf path;
+
+    if (sh->stub_exec) {
+        _exit(0);
+    }
+    if (sh->limits != NULL) {
+        apply_spawn_limits(sh->limits);
     }
+    METRICS_ADD(execs, 1);
+    export_env(env);
+    strbuf_init(&path, 256);
+    if (find_command(argv[0], &path) == -1) {
+        log_error("%s: %s", argv[0], strerror(ENOENT));
+        _exit(13);
+    }
+    execv(path.chars, argv);
+    if (errno == ENOEXEC) {
+        run_script(sh, path.chars, argv);
+    }
+    log_error("%s: %s", argv[0], strerror(errno));
+    _exit(13);
+}
+
+/* A server worker still owes its client the status, which it writes on
+ * exit; so exec runs the command in a child and exits with its status
+ * instead of replacing the worker. */
+static void exec_for_client(shell *sh, char **argv, char **env)
+{
+    int pid, status = 0;
+
     disable_zombie_cleanup();
     pid = xfork();
     if (pid == 0) {
-        raise(SIGSTOP);
         reset_signals();
-        xexecvp(cmd->argv[0], cmd->argv);
-    }
-    wait_for_pid(pid, NULL, WUNTRACED);
-    if (sh->in_background) {
-        xsetpgid(pid, sh->pgid);
-    } else {
-        xsetpgid(pid, pid);
-        set_fg_pgroup(sh, pid);
+        exec_command(sh, argv, env);
     }
-    kill(pid, SIGCONT);
     wait_for_pid(pid, &status, 0);
-    restore_fg_pgroup(sh);
-    enable_zombie_cleanup();
-    sh->last_status = get_exit_status(status);
+    exit_shell(sh, get_exit_status(status));
 }
 
-static void close_redir_files(redir_entry *entry, redir_entry *stop)
+int is_prefix(const char *name)
 {
-    while (entry != NULL && entry != stop) {
-        xclose(entry->src_fd);
-        entry = entry->next; 
-    }
+    return strcmp(name, "pin") == 0 || strcmp(name, "limit") == 0 ||
+        strcmp(name, "timeout") == 0 || strcmp(name, "batch") == 0 ||
+        strcmp(name, "exec") == 0;
 }
 
-static void close_redir_target(redir_entry *entry)
+/* A foreground job has to finish by the deadline of an enclosing timeout
+ * prefix and within $SHELLMA_CMD_TIMEOUT, whichever ends first. */
+static long long job_deadline(shell *sh)
 {
-    while (entry != NULL) {
-        xclose(entry->target_fd);
-        entry = entry->next; 
+    const char *str = var_get(&sh->vars, "SHELLMA_CMD_TIMEOUT");
+    long long ms;
+
+    if (str == NULL || *str == '\0') {
+        return sh->deadline;
+    }
+    if (parse_duration(str, &ms) == -1) {
+        log_error("SHELLMA_CMD_TIMEOUT: %s: invalid duration", str);
+        return sh->deadline;
     }
+    return ms == 0
+        ? sh->deadline
+        : earlier_deadline(sh->deadline, monotonic_ms() + ms);
 }
 
-static int open_redir_files(redir_entry *head)
+/* pin is a prefix: the command after it runs with the placement, which
+ * a forked command inherits and the shell itself gives up afterwards. */
+static void run_pinned(shell *sh, char **argv, char **env)
 {
-    redir_entry *entry = head; 
+    placement pl, saved;
+    int cmd;
 
-    while (entry != NULL) {
-        switch (entry->type) {
-        case redir_in:
-            entry->src_fd = xopen(entry->filename, O_RDONLY, 0666);
-            break;
-        case redir_out:
-            entry->src_fd = xopen(entry->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            break;
-        case redir_append:
-            entry->src_fd = xopen(entry->filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
-            break;
+    cmd = parse_pin_args(argv, &pl);
+    if (cmd == -1 || apply_placement(&pl, &saved) == -1) {
+        sh->last_status = cmd == -1 ? 2 : 1;
+        if (sh->in_pipeline) {
+            _exit(sh->last_status);
         }
-        if (entry->src_fd == -1) {
-            log_error("%s: %s", entry->filename, strerror(errno));
-            close_redir_files(head, entry);
-            return -1;
+        return;
+    }
+    run_command(sh, argv + cmd, env);
+    restore_placement(&saved);
+}
+
+/* limit records its settings for the external commands started while
+ * the prefixed command runs; an inner limit adds to an outer one. */
+static void run_limited(shell *sh, char **argv, char **env)
+{
+    const spawn_limits *outer = sh->limits;
+    spawn_limits lim;
+    int cmd;
+
+    if (outer != NULL) {
+        lim = *outer;
+    } else {
+        memset(&lim, 0, sizeof(lim));
+    }
+    cmd = parse_limit_args(argv, &lim);
+    if (cmd == -1) {
+        sh->last_status = 2;
+        if (sh->in_pipeline) {
+            _exit(sh->last_status);
         }
-        entry = entry->next; 
+        return;
     }
-    return 0;
+    sh->limits = &lim;
+    run_command(sh, argv + cmd, env);
+    sh->limits = outer;
 }
 
-static void replace_fd(int oldfd, int newfd)
+/* Once the deadline of a timeout prefix has passed, the commands left
+ * fail and functions return, so the prefixed command winds down. */
+static void deadline_passed(shell *sh)
 {
-    if (oldfd != newfd) {
-        xdup2(oldfd, newfd);
-        xclose(oldfd);
+    sh->last_status = timeout_status;
+    if (sh->func_depth > 0) {
+        sh->returning = 1;
+    }
+    if (sh->in_pipeline) {
+        _exit(sh->last_status);
     }
 }
 
-static void execute_redirection(shell *sh, const ast_redirection *redir)
+/* timeout sets a deadline for everything the prefixed command starts in
+ * the foreground; a function runs its commands against one deadline. */
+static void run_timed(shell *sh, char **argv, char **env)
 {
-    redir_entry *entry = redir->entries;
-    int status, i, orig_streams[3] = { -1, -1, -1 };
+    long long outer = sh->deadline, duration;
+    int outer_kill_after = sh->kill_after, cmd;
 
-    status = open_redir_files(entry);
-    if (status == -1) {
-        sh->last_status = 1;
+    cmd = parse_timeout_args(argv, &duration, &sh->kill_after);
+    if (cmd == -1) {
+        sh->kill_after = outer_kill_after;
+        sh->last_status = 2;
+        if (sh->in_pipeline) {
+            _exit(sh->last_status);
+        }
         return;
     }
-    while (entry != NULL) {
-        for (i = 0; i < 3; i++) {
-            if (entry->target_fd == i) {
-                if (orig_streams[i] == -1) {
-                    orig_streams[i] = xdup(i);
-                }
-                break;
-            }
+    if (duration > 0) {
+        sh->deadline = earlier_deadline(outer, monotonic_ms() + duration);
+    }
+    run_command(sh, argv + cmd, env);
+    sh->deadline = outer;
+    sh->kill_after = outer_kill_after;
+}
+
+/* Runs the chunks of a batch -P JOBS at a time in children of their own;
+ * statuses[i] gets the status of chunk i. */
+static void run_chunks_parallel(shell *sh, char **argv, char **env,
+                                int fixed, const int *sizes, int count,
+                                int jobs, int *statuses)
+{
+    char **chunk;
+    int *pids, next = fixed, largest = 0, done = 0, status, i;
+
+    for (i = 0; i < count; i++) {
+        if (sizes[i] > largest) {
+            largest = sizes[i];
         }
-        replace_fd(entry->src_fd, entry->target_fd);
-        entry = entry->next;
     }
-    execute_ast_node(sh, redir->child);
-    close_redir_target(redir->entries);
-    for (i = 0; i < 3; i++) {
-        if (orig_streams[i] != -1) {
-            replace_fd(orig_streams[i], i);
+    chunk = malloc(sizeof(char *) * (fixed + largest + 1));
+    pids = malloc(sizeof(int) * count);
+    memcpy(chunk, argv, sizeof(char *) * fixed);
+    disable_zombie_cleanup();
+    /* chunks are reaped by pid, oldest first, so other children of the
+     * shell stay with whoever waits for them; chunks are about the same
+     * size, so a slot rarely waits long behind an older one */
+    for (i = 0; done < count; ) {
+        if (i < count && i - done < jobs) {
+            memcpy(chunk + fixed, argv + next, sizeof(char *) * sizes[i]);
+            chunk[fixed + sizes[i]] = NULL;
+            next += sizes[i];
+            pids[i] = xfork();
+            if (pids[i] == 0) {
+                reset_signals();
+                sh->in_pipeline = 1;
+                run_command(sh, chunk, env);
+                _exit(sh->last_status);
+            }
+            i++;
+            continue;
         }
+        status = 0;
+        wait_for_pid(pids[done], &status, 0);
+        statuses[done++] = get_exit_status(status);
     }
+    enable_zombie_cleanup();
+    free(pids);
+    free(chunk);
 }
 
-typedef struct {
-    int pgid;
-    int next_read;
-    wait_item *pids;
-} pipeline_job;
-
-static void redirect_and_exec(
-    shell *sh, const ast_node *node,
-    int read_fd, int write_fd)
+/* batch runs the command once per chunk of arguments that fits in the
+ * exec limit, which it would otherwise fail with E2BIG. The status is
+ * that of the first chunk that failed. */
+static void run_batched(shell *sh, char **argv, char **env)
 {
-    replace_fd(read_fd, 0);
-    replace_fd(write_fd, 1);
-    sh->in_pipeline = 1;
-    reset_signals();
-    execute_ast_node(sh, node);
+    batch_options opts;
+    char **chunk;
+    int *sizes, *statuses, in_pipeline = sh->in_pipeline;
+    int cmd, fixed, total, count, next, i;
+    long budget;
+
+    cmd = parse_batch_args(argv, &opts);
+    if (cmd == -1) {
+        sh->last_status = 2;
+        if (sh->in_pipeline) {
+            _exit(sh->last_status);
+        }
+        return;
+    }
+    argv += cmd;
+    fixed = 1 + opts.keep;
+    for (total = fixed; argv[total] != NULL; total++)
+        {}
+    budget = batch_budget(env, argv, fixed);
+    if (batch_fit(argv + fixed, budget) == total - fixed) {
+        run_command(sh, argv, env);
+        return;
+    }
+
+    sizes = malloc(sizeof(int) * (total - fixed));
+    for (count = 0, next = fixed; next < total; count++) {
+        sizes[count] = batch_fit(argv + next, budget);
+        next += sizes[count];
+    }
+    statuses = malloc(sizeof(int) * count);
+    sh->in_pipeline = 0;
+    if (opts.jobs > 1) {
+        run_chunks_parallel(sh, argv, env, fixed, sizes, count, opts.jobs,
+                            statuses);
+    } else {
+        chunk = malloc(sizeof(char *) * (total + 1));
+        memcpy(chunk, argv, sizeof(char *) * fixed);
+        for (i = 0, next = fixed; i < count; next += sizes[i++]) {
+            memcpy(chunk + fixed, argv + next, sizeof(char *) * sizes[i]);
+            chunk[fixed + sizes[i]] = NULL;
+            run_command(sh, chunk, env);
+            statuses[i] = sh->last_status;
+        }
+        free(chunk);
+    }
+    sh->last_status = 0;
+    for (i = 0; i < count && sh->last_status == 0; i++) {
+        sh->last_status = statuses[i];
+    }
+    sh->in_pipeline = in_pipeline;
+    free(statuses);
+    free(sizes);
+    if (sh->in_pipeline) {
+        _exit(sh->last_status);
+    }
 }
 
-static void pipeline_first(shell *sh, pipeline_job *job, const ast_node *node)
+static void run_command(shell *sh, char **argv, char **env)
 {
-    int fd[2], pid;
+    const builtin *b;
+    builtin_io io = { 1, NULL };
+    func_body *func;
+    wait_item *pids;
+    job_timer timer;
+    long long start;
+    int pid, status;
 
-    xpipe(fd);
+    if (sh->deadline != 0 && monotonic_ms() >= sh->deadline) {
+        deadline_passed(sh);
+        return;
+    }
+    func = func_find(&sh->funcs, argv[0]);
+    if (func != NULL) {
+        call_function(sh, func, argv);
+        return;
+    }
+    if (strcmp(argv[0], "pin") == 0) {
+        run_pinned(sh, argv, env);
+        return;
+    }
+    if (strcmp(argv[0], "limit") == 0) {
+        run_limited(sh, argv, env);
+        return;
+    }
+    if (strcmp(argv[0], "timeout") == 0) {
+        run_timed(sh, argv, env);
+        return;
+    }
+    if (strcmp(argv[0], "batch") == 0) {
+        run_batched(sh, argv, env);
+        return;
+    }
+    /* exec COMMAND replaces the shell; its redirections alone are kept
+     * by the executor */
+    if (strcmp(argv[0], "exec") == 0) {
+        if (argv[1] != NULL && sh->status_fd != -1 &&
+            getpid() == sh->pid)
+        {
+            exec_for_client(sh, argv + 1, env);
+        }
+        if (argv[1] != NULL && !sh->stub_exec) {
+            exec_command(sh, argv + 1, env);
+        }
+        sh->last_status = 0;
+        if (sh->in_pipeline) {
+            _exit(0);
+        }
+        return;
+    }
+    b = find_builtin(argv[0]);
+    if (b != NULL) {
+        METRICS_ADD(builtins, 1);
+        sh->last_status = b->fn(sh, argv, &io);
+        if (sh->in_pipeline) {
+            _exit(sh->last_status);
+        }
+        return;
+    }
+    /* a pipeline stage is timed as a whole unless a prefix says more */
+    timer.deadline = sh->in_pipeline ? sh->deadline : job_deadline(sh);
+    if (sh->in_pipeline && timer.deadline == 0) {
+        exec_command(sh, argv, env);
+    }
+    disable_zombie_cleanup();
     pid = xfork();
     if (pid == 0) {
         raise(SIGSTOP);
-        xclose(fd[pipe_read]);
-        redirect_and_exec(sh, node, 0, fd[pipe_write]);
+        reset_signals();
+        exec_command(sh, argv, env);
     }
     wait_for_pid(pid, NULL, WUNTRACED);
-    xsetpgid(pid, pid);
-    set_fg_pgroup(sh, pid);
+    timer.pgid = 0;
+    if (sh->in_pipeline) {
+        xsetpgid(pid, getpgid(0));
+    } else if (sh->in_background) {
+        xsetpgid(pid, sh->pgid);
+    } else {
+        xsetpgid(pid, pid);
+        set_fg_pgroup(sh, pid);
+        timer.pgid = pid;
+    }
     kill(pid, SIGCONT);
-    job->pgid = pid;
-    xclose(fd[pipe_write]);
-    job->next_read = fd[pipe_read];
-    append_pid(&job->pids, pid);
+    start = metrics_clock_ns();
+    if (timer.deadline == 0) {
+        wait_for_pid(pid, &status, 0);
+    } else {
+        pids = NULL;
+        append_pid(&pids, pid);
+        timer.kill_after = sh->kill_after;
+        status = wait_pids_until(pids, &timer);
+    }
+    metrics_record_wait(metrics_clock_ns() - start);
+    if (!sh->in_pipeline) {
+        restore_fg_pgroup(sh);
+    }
+    enable_zombie_cleanup();
+    sh->last_status = get_exit_status(status);
+    if (timer.deadline != 0 && timer.timed_out) {
+        log_error("%s: timed out", argv[0]);
+        sh->last_status = timeout_status;
+    } else if (sh->limits != NULL && WIFSIGNALED(status)) {
+        report_limit_signal(argv[0], WTERMSIG(status));
+    }
+    if (sh->in_pipeline) {
+        _exit(sh->last_status);
+    }
 }
 
-static void pipeline_middle(shell *sh, pipeline_job *job, const ast_node *node)
+/* Closes the shell's ends of the process substitutions started since
+ * mark and reaps their children; $PROCSUB_STATUS lists how they ended,
+ * in the order they appeared. */
+static void finish_procsubs(shell *sh, const procsub_item *mark)
 {
-    int fd[2], pid;
+    procsub_item *item;
+    strbuf text;
+    char num[16];
+    int *statuses, count = 0, status, i;
 
-    xpipe(fd);
-    pid = xfork();
-    if (pid == 0) {
-        xsetpgid(0, job->pgid);
-        xclose(fd[pipe_read]);
-        redirect_and_exec(sh, node, job->next_read, fd[pipe_write]);
+    if (sh->procsubs == mark) {
+        return;
     }
-    xclose(fd[pipe_write]);
-    xclose(job->next_read);
-    job->next_read = fd[pipe_read];
-    append_pid(&job->pids, pid);
+    for (item = sh->procsubs; item != mark; item = item->next) {
+        if (item->fd != -1) {
+            xclose(item->fd);
+            item->fd = -1;
+        }
+        count++;
+    }
+    statuses = malloc(sizeof(int) * count);
+    for (i = count - 1; i >= 0; i--) {
+        item = sh->procsubs;
+        sh->procsubs = item->next;
+        /* a pipeline inside a loop may have reaped it already */
+        status = 0;
+        wait_for_pid(item->pid, &status, 0);
+        statuses[i] = get_exit_status(status);
+        release_zombie_cleanup();
+        free(item);
+    }
+    strbuf_init(&text, 64);
+    strbuf_clear(&text);
+    for (i = 0; i < count; i++) {
+        snprintf(num, sizeof(num), i > 0 ? " %d" : "%d", statuses[i]);
+        strbuf_join(&text, num);
+    }
+    var_set(&sh->vars, "PROCSUB_STATUS", text.chars);
+    strbuf_free(&text);
+    free(statuses);
 }
 
-static void pipeline_last(shell *sh, pipeline_job *job, const ast_node *node)
+/* A redirection reopens the pipe through /dev/fd, so the shell's end is
+ * not needed past the open and is not passed on to the command. */
+static void close_procsub_fds(shell *sh, const procsub_item *mark)
 {
-    int pid;
+    procsub_item *item;
 
-    pid = xfork();
-    if (pid == 0) {
-        xsetpgid(0, job->pgid);
-        redirect_and_exec(sh, node, job->next_read, 1);
+    for (item = sh->procsubs; item != mark; item = item->next) {
+        if (item->fd != -1) {
+            xclose(item->fd);
+            item->fd = -1;
+        }
     }
-    xclose(job->next_read);
-    append_pid(&job->pids, pid);
 }
 
-static void execute_pipeline(shell *sh, const ast_pipeline *pipeline)
+static int has_substitution(const ast_command *cmd)
 {
-    pipeline_job job;
-    ast_list_node *head = pipeline->chain; 
-    
-    job.pids = NULL;
-    disable_zombie_cleanup();
-    pipeline_first(sh, &job, head->node);
-    head = head->next;
-    while (head->next != NULL) {
-        pipeline_middle(sh, &job, head->node);
-        head = head->next;
-    }
-    pipeline_last(sh, &job, head->node);
-    sh->last_status = wait_pids(job.pids);
-    enable_zombie_cleanup();
-    restore_fg_pgroup(sh);
+    const ast_word_part *part;
+    int i;
+
+    for (i = 0; i < cmd->assign_count; i++) {
+        for (part = cmd->assigns[i].value.parts; part; part = part->next) {
+            if (part->type == part_command) {
+                return 1;
+            }
+        }
+    }
+    return 0;
 }
 
-static void execute_background(shell *sh, const ast_background *bg)
+/* A command without words only assigns; its status is that of the last
+ * command substitution, if there was one. */
+static void assign_vars(shell *sh, const ast_command *cmd, arg_list *env)
 {
-    int pid;
+    int i;
 
-    pid = xfork();
-    if (pid == 0) {
-        reset_signals();
-        xsetpgid(0, 0);
-        sh->pgid = getpgid(0);
-        sh->in_background = 1;
-        execute_ast_node(sh, bg->child);
-        _exit(sh->last_status);
+    if (!has_substitution(cmd)) {
+        sh->last_status = 0;
     }
-    sh->last_status = 0;
-}
+    for (i = 0; i < env->argc; i++) {
+        char *eq = strchr(env->argv[i], '=');
 
-static void execute_logical(shell *sh, const ast_logical *logic)
-{
-    execute_ast_node(sh, logic->left);
-    if ((sh->last_status == 0 && logic->type == token_and) ||
-        (sh->last_status != 0 && logic->type == token_or))
-    {
-        execute_ast_node(sh, logic->right);
+        *eq = '\0';
+        var_set(&sh->vars, env->argv[i], eq + 1);
+        *eq = '=';
     }
 }
 
-static void execute_ast_node(shell *sh, const ast_node *node)
+static void execute_command(shell *sh, const ast_command *cmd)
 {
-    switch (node->type) {
-    case ast_type_command:
-        execute_command(sh, &node->command);
+    procsub_item *mark = sh->procsubs;
+    arg_list args, env;
+    int in_pipeline;
+
+    if (!cmd->need_expand) {
+        run_command(sh, cmd->argv, NULL);
+        return;
+    }
+    arg_list_init(&args);
+    arg_list_init(&env);
+    sh->expand_failed = 0;
+    expand_command(sh, &args, cmd);
+    expand_assignments(sh, &env, cmd);
+    in_pipeline = sh->in_pipeline;
+    /* a stage that exec'd would leave its process substitutions behind */
+    if (sh->procsubs != mark) {
+        sh->in_pipeline = 0;
+    }
+    if (sh->expand_failed) {
+        sh->last_status = 1;
+    } else if (args.argc > 0) {
+        run_command(sh, args.argv, env.argv);
+    } else {
+        assign_vars(sh, cmd, &env);
+    }
+    finish_procsubs(sh, mark);
+    if (in_pipeline) {
+        _exit(sh->last_status);
+    }
+    arg_list_free(&env);
+    arg_list_free(&args);
+}
+
+static int is_simple_command(const ast_node *node)
+{
+    if (node->type == ast_type_redirection) {
+        node = node->redirection.child;
+    }
+    return node->type == ast_type_command;
+}
+
+/* Runs a statement list in an already forked child. A lone command may
+ * replace the child instead of forking once more. */
+static void run_subshell(shell *sh, const ast_list_node *stmts)
+{
+    if (stmts != NULL && stmts->next == NULL &&
+        is_simple_command(stmts->node))
+    {
+        sh->in_pipeline = 1;
+        execute_ast_node(sh, stmts->node);
+    } else {
+        sh->in_pipeline = 0;
+        execute(sh, stmts);
+    }
+    _exit(sh->last_status);
+}
+
+static void execute_subshell(shell *sh, const ast_subshell *sub)
+{
+    int pid, status;
+
+    if (sh->in_pipeline) {
+        run_subshell(sh, sub->statements);
+    }
+    disable_zombie_cleanup();
+    pid = xfork();
+    if (pid == 0) {
+        run_subshell(sh, sub->statements);
+    }
+    wait_for_pid(pid, &status, 0);
+    enable_zombie_cleanup();
+    sh->last_status = get_exit_status(status);
+}
+
+static void replace_fd(int oldfd, int newfd)
+{
+    if (oldfd != newfd) {
+        xdup2(oldfd, newfd);
+        xclose(oldfd);
+    }
+}
+
+static void read_all(int fd, strbuf *out)
+{
+    int n;
+
+    for (;;) {
+        strbuf_reserve(out, capture_chunk);
+        n = read(fd, out->chars + out->len, out->capacity - out->len - 1);
+        if (n > 0) {
+            out->len += n;
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    out->chars[out->len] = '\0';
+}
+
+/* Forks a child whose stdout is a pipe. Returns 0 in the child and the
+ * child's pid in the parent, where *pfd is the read end. */
+static int start_capture(int *pfd)
+{
+    int fd[2], pid;
+
+    xpipe(fd);
+    disable_zombie_cleanup();
+    pid = xfork();
+    if (pid == 0) {
+        xclose(fd[pipe_read]);
+        replace_fd(fd[pipe_write], 1);
+        return 0;
+    }
+    xclose(fd[pipe_write]);
+    *pfd = fd[pipe_read];
+    return pid;
+}
+
+static void finish_capture(shell *sh, int pid, int fd, strbuf *out)
+{
+    int status;
+
+    read_all(fd, out);
+    xclose(fd);
+    wait_for_pid(pid, &status, 0);
+    enable_zombie_cleanup();
+    sh->last_status = get_exit_status(status);
+}
+
+/* Builtins that leave the shell state alone write straight into the
+ * buffer; anything else runs in a child with its already expanded argv. */
+static void substitute_command(shell *sh, const ast_command *cmd, strbuf *out)
+{
+    procsub_item *mark = sh->procsubs;
+    arg_list args, env;
+    char **argv = cmd->argv, **envp = NULL;
+    const builtin *b = NULL;
+    func_body *func = NULL;
+    int pid, fd;
+
+    sh->expand_failed = 0;
+    if (cmd->need_expand) {
+        arg_list_init(&args);
+        arg_list_init(&env);
+        expand_command(sh, &args, cmd);
+        expand_assignments(sh, &env, cmd);
+        argv = args.argv;
+        envp = env.argv;
+    }
+    if (argv[0] != NULL) {
+        func = func_find(&sh->funcs, argv[0]);
+        b = func == NULL ? find_builtin(argv[0]) : NULL;
+    }
+    if (sh->expand_failed) {
+        sh->last_status = 1;
+    } else if (b != NULL && b->flags & builtin_pure &&
+               cmd->assign_count == 0)
+    {
+        builtin_io io = { 1, out };
+
+        METRICS_ADD(builtins, 1);
+        sh->last_status = b->fn(sh, argv, &io);
+    } else if (argv[0] == NULL) {
+        sh->last_status = 0;
+    } else {
+        pid = start_capture(&fd);
+        if (pid == 0) {
+            sh->in_pipeline = 1;
+            if (b != NULL || func != NULL || is_prefix(argv[0])) {
+                run_command(sh, argv, envp);
+            }
+            reset_signals();
+            exec_command(sh, argv, envp);
+        }
+        finish_capture(sh, pid, fd, out);
+    }
+    if (cmd->need_expand) {
+        finish_procsubs(sh, mark);
+        arg_list_free(&env);
+        arg_list_free(&args);
+    }
+}
+
+void execute_substitution(shell *sh, const ast_list_node *stmts, strbuf *out)
+{
+    int pid, fd;
+
+    if (stmts == NULL) {
+        sh->last_status = 0;
+        return;
+    }
+    if (stmts->next == NULL && stmts->node->type == ast_type_command) {
+        substitute_command(sh, &stmts->node->command, out);
+        return;
+    }
+    pid = start_capture(&fd);
+    if (pid == 0) {
+        run_subshell(sh, stmts);
+    }
+    finish_capture(sh, pid, fd, out);
+}
+
+/* Forgets the process substitutions of the parent in a new child. */
+static void drop_procsubs(shell *sh)
+{
+    procsub_item *item;
+
+    while (sh->procsubs != NULL) {
+        item = sh->procsubs;
+        sh->procsubs = item->next;
+        if (item->fd != -1) {
+            xclose(item->fd);
+        }
+        release_zombie_cleanup();
+        free(item);
+    }
+}
+
+/* <(list) reads what list writes and >(list) writes to what it reads:
+ * list runs in a child on one end of a pipe and the word becomes the
+ * /dev/fd path of the other end, left open for the command to inherit. */
+void execute_procsub(shell *sh, const ast_list_node *stmts, int output,
+                     strbuf *out)
+{
+    procsub_item *item;
+    char path[32];
+    int fd[2], mine, theirs, pid;
+
+    xpipe(fd);
+    mine = output ? fd[pipe_write] : fd[pipe_read];
+    theirs = output ? fd[pipe_read] : fd[pipe_write];
+    hold_zombie_cleanup();
+    pid = xfork();
+    if (pid == 0) {
+        xclose(mine);
+        replace_fd(theirs, output ? 0 : 1);
+        drop_procsubs(sh);
+        release_zombie_cleanup();
+        run_subshell(sh, stmts);
+    }
+    xclose(theirs);
+    item = malloc(sizeof(procsub_item));
+    item->pid = pid;
+    item->fd = mine;
+    item->next = sh->procsubs;
+    sh->procsubs = item;
+    snprintf(path, sizeof(path), "/dev/fd/%d", mine);
+    strbuf_join(out, path);
+}
+
+/* What a redirection found under its target fd: a copy of it, or it was
+ * closed; an earlier redirection of the same fd in the list saves it
+ * instead. */
+enum { fd_not_saved = -2, fd_was_closed = -1 };
+
+static int save_redir_target(redir_entry *head, redir_entry *entry)
+{
+    redir_entry *prev;
+    int fd;
+
+    if (entry->flags & redir_open_only) {
+        return fd_not_saved;
+    }
+    for (prev = head; prev != entry; prev = prev->next) {
+        if (prev->target_fd == entry->target_fd &&
+            !(prev->flags & redir_open_only))
+        {
+            return fd_not_saved;
+        }
+    }
+    fd = dup_internal_fd(entry->target_fd);
+    return fd != -1 ? fd : fd_was_closed;
+}
+
+/* >&N and <&N copy fd N, >&- and <&- close the target. */
+static int parse_dup_source(const char *word, int *fd)
+{
+    char *end;
+    long value;
+
+    if (strcmp(word, "-") == 0) {
+        *fd = -1;
+        return 0;
+    }
+    value = strtol(word, &end, 10);
+    if (*word == '\0' || *end != '\0' || value < 0 || value > INT_MAX) {
+        return -1;
+    }
+    *fd = value;
+    return 0;
+}
+
+/* What cat would do with a file it cannot read: say so and go on as if
+ * it were empty. */
+static int empty_if_unreadable(int fd, const char *filename)
+{
+    struct stat st;
+
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        close(fd);
+        fd = -1;
+        errno = EISDIR;
+    }
+    if (fd == -1) {
+        log_error("%s: %s", filename, strerror(errno));
+        fd = xopen("/dev/null", O_RDONLY, 0);
+    }
+    return fd;
+}
+
+/* Opens the file of the entry, or finds the fd it duplicates, as
+ * src_fd; -1 stands for closing the target. */
+static int open_redir_source(shell *sh, redir_entry *entry, strbuf *name)
+{
+    procsub_item *mark = sh->procsubs;
+    const char *filename = entry->filename.text;
+
+    if (entry->filename.parts != NULL) {
+        strbuf_clear(name);
+        sh->expand_failed = 0;
+        expand_word_string(sh, &entry->filename, name);
+        if (sh->expand_failed) {
+            close_procsub_fds(sh, mark);
+            return -1;
+        }
+        filename = name->chars;
+    }
+    switch (entry->type) {
+    case redir_in:
+        entry->src_fd = xopen(filename, O_RDONLY, 0666);
+        if (entry->flags & redir_empty_on_error) {
+            entry->src_fd = empty_if_unreadable(entry->src_fd, filename);
+        }
         break;
-    case ast_type_subshell:
-        printf("Not implemented yet :(\n");
-        if (sh->in_pipeline) {
-            exit(0);
+    case redir_out:
+        entry->src_fd = xopen(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        break;
+    case redir_append:
+        entry->src_fd = xopen(filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        break;
+    case redir_dup:
+        if (parse_dup_source(filename, &entry->src_fd) == -1) {
+            log_error("%s: ambiguous redirect", filename);
+            return -1;
+        }
+        if (entry->src_fd != -1 && fcntl(entry->src_fd, F_GETFD) == -1) {
+            log_error("%d: %s", entry->src_fd, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    close_procsub_fds(sh, mark);
+    if (entry->src_fd == -1) {
+        log_error("%s: %s", filename, strerror(errno));
+        return -1;
+    }
+    METRICS_ADD(redirections, 1);
+    return 0;
+}
+
+/* Puts back what the entries from head up to stop found under their
+ * targets. */
+static void undo_redirections(redir_entry *head, redir_entry *stop,
+                              int *saved)
+{
+    redir_entry *entry;
+    int i;
+
+    for (entry = head, i = 0; entry != stop; entry = entry->next, i++) {
+        if (saved[i] == fd_was_closed) {
+            close(entry->target_fd);
+        } else if (saved[i] != fd_not_saved) {
+            replace_fd(saved[i], entry->target_fd);
+        }
+    }
+    free(saved);
+}
+
+/* The entries take effect one by one, so a file opened for one of them
+ * never lands on an fd a later one still has to save. What was under
+ * each target goes to *psaved, kept at high close-on-exec fds, for
+ * restore_redirections; the entries are shared by every run of the
+ * code, recursive ones included. */
+static int apply_redirections(shell *sh, redir_entry *head, int **psaved)
+{
+    redir_entry *entry;
+    strbuf name;
+    int count = 0, i;
+
+    for (entry = head; entry != NULL; entry = entry->next) {
+        count++;
+    }
+    *psaved = malloc(sizeof(int) * count);
+    strbuf_init(&name, 64);
+    for (entry = head, i = 0; entry != NULL; entry = entry->next, i++) {
+        (*psaved)[i] = save_redir_target(head, entry);
+        if (open_redir_source(sh, entry, &name) == -1) {
+            undo_redirections(head, entry->next, *psaved);
+            *psaved = NULL;
+            strbuf_free(&name);
+            sh->last_status = 1;
+            return -1;
+        }
+        if (entry->flags & redir_open_only) {
+            if (entry->src_fd != -1 && entry->type != redir_dup) {
+                xclose(entry->src_fd);
+            }
+        } else if (entry->src_fd == -1) {
+            close(entry->target_fd);
+        } else if (entry->type == redir_dup) {
+            if (entry->src_fd != entry->target_fd) {
+                xdup2(entry->src_fd, entry->target_fd);
+            }
+        } else {
+            replace_fd(entry->src_fd, entry->target_fd);
+        }
+    }
+    strbuf_free(&name);
+    return 0;
+}
+
+static void restore_redirections(redir_entry *entries, int *saved)
+{
+    undo_redirections(entries, NULL, saved);
+}
+
+/* exec with nothing but redirections leaves them in place for good. */
+static void keep_redirections(redir_entry *entry, int *saved)
+{
+    int i;
+
+    for (i = 0; entry != NULL; entry = entry->next, i++) {
+        if (saved[i] >= 0) {
+            xclose(saved[i]);
+        }
+    }
+    free(saved);
+}
+
+static void execute_redirection(shell *sh, const ast_redirection *redir)
+{
+    procsub_item *mark = sh->procsubs;
+    int *saved;
+
+    if (apply_redirections(sh, redir->entries, &saved) == -1) {
+        finish_procsubs(sh, mark);
+        return;
+    }
+    execute_ast_node(sh, redir->child);
+    if (is_fd_exec(redir->child)) {
+        keep_redirections(redir->entries, saved);
+    } else {
+        restore_redirections(redir->entries, saved);
+    }
+    finish_procsubs(sh, mark);
+}
+/* A builtin stage running on a thread of the shell. It owns the pipe
+ * ends in fds until it closes them itself; -1 marks one it has not. */
+typedef struct stage_thread_tag {
+    pthread_t tid;
+    shell *sh;
+    const builtin *b;
+    arg_list args;
+    char **argv;
+    int out_fd, fds[2];
+    int status, last;
+    struct stage_thread_tag *next;
+} stage_thread;
+
+typedef struct {
+    int pgid;
+    int next_read;
+    int pipe_size, measure, boundary;
+    int lastpipe, shell_status;
+    const int *pin_cpus;
+    int pin_count, stage;
+    job_timer timer;
+    long long started;
+    wait_item *pids;
+    stage_thread *threads;
+} pipeline_job;
+
+/* Held by a thread closing its pipe ends and across each fork of a
+ * stage, so a child sees which ends are still open under their number. */
+static pthread_mutex_t stage_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The group leader may already be gone when a short first stage has
+ * finished; the stage then stays in the shell's group. */
+static void join_pgroup(int pgid)
+{
+    setpgid(0, pgid);
+}
+
+/* $SHELLMA_PIPE_SIZE sets the capacity of the pipes between stages and
+ * a non-zero $SHELLMA_PIPE_STATS puts a meter on each of them. A
+ * non-zero $SHELLMA_LASTPIPE runs the last stage in the shell, but as
+ * in bash only without job control, which would need the shell in the
+ * job's process group, and without a deadline it could not enforce. */
+static void init_pipeline_job(shell *sh, pipeline_job *job)
+{
+    long long value;
+
+    job->pgid = 0;
+    job->pids = NULL;
+    job->threads = NULL;
+    job->boundary = 0;
+    if (var_get_int(&sh->vars, "SHELLMA_PIPE_SIZE", &value) != 0 ||
+        value < 0 || value > INT_MAX)
+    {
+        log_error("SHELLMA_PIPE_SIZE: invalid pipe size");
+        value = 0;
+    }
+    job->pipe_size = value;
+    if (var_get_int(&sh->vars, "SHELLMA_PIPE_STATS", &value) != 0) {
+        value = 0;
+    }
+    job->measure = value != 0;
+    job->pin_cpus = stage_cpus(var_get(&sh->vars, "SHELLMA_PIN_STAGES"),
+                               &job->pin_count);
+    job->stage = 0;
+    job->timer.deadline = job_deadline(sh);
+    job->timer.kill_after = sh->kill_after;
+    if (var_get_int(&sh->vars, "SHELLMA_LASTPIPE", &value) != 0) {
+        value = 0;
+    }
+    job->lastpipe = value != 0 && !sh->in_pipeline &&
+        job->timer.deadline == 0 &&
+        (sh->tty_fd == -1 || sh->in_background);
+    job->shell_status = -1;
+    job->started = metrics_clock_ns();
+}
+
+static void place_stage(const pipeline_job *job)
+{
+    if (job->pin_cpus != NULL) {
+        pin_to_cpu(job->pin_cpus[job->stage % job->pin_count]);
+    }
+}
+
+static void make_pipe(const pipeline_job *job, int fd[2])
+{
+    xpipe(fd);
+    if (job->pipe_size > 0 &&
+        fcntl(fd[pipe_write], F_SETPIPE_SZ, job->pipe_size) == -1)
+    {
+        log_error("SHELLMA_PIPE_SIZE: %s", strerror(errno));
+    }
+}
+
+/* Forks a process for a stage; the child lets go of the pipe ends the
+ * builtin threads of the job write to or read from. */
+static int fork_stage(pipeline_job *job)
+{
+    stage_thread *t;
+    int pid, i;
+
+    pthread_mutex_lock(&stage_fds_lock);
+    pid = xfork();
+    if (pid == 0) {
+        for (t = job->threads; t != NULL; t = t->next) {
+            for (i = 0; i < 2; i++) {
+                if (t->fds[i] != -1) {
+                    close(t->fds[i]);
+                }
+            }
+        }
+        pthread_mutex_unlock(&stage_fds_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&stage_fds_lock);
+    return pid;
+}
+
+/* The first stage that is a process leads the job's process group. */
+static void lead_job(shell *sh, pipeline_job *job, int pid)
+{
+    if (job->pgid == 0) {
+        setpgid(pid, pid);
+        set_fg_pgroup(sh, pid);
+        job->pgid = pid;
+    }
+}
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Relays one stage boundary. Time spent in read() is time the stage to
+ * the left kept the pipe empty; time in write() is time the stage to
+ * the right kept it full. */
+static void meter_pipe(int boundary, int in, int out, int bufsize)
+{
+    struct timespec start, t;
+    double read_wait = 0, write_wait = 0, total;
+    long long bytes = 0;
+    char *buf;
+    int n, w, off;
+
+    signal(SIGPIPE, SIG_IGN);
+    buf = malloc(bufsize);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        n = read(in, buf, bufsize);
+        read_wait += seconds_since(&t);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        for (off = 0; off < n; off += w) {
+            w = write(out, buf + off, n - off);
+            if (w == -1 && errno == EINTR) {
+                w = 0;
+            } else if (w == -1) {
+                break;
+            }
+        }
+        write_wait += seconds_since(&t);
+        bytes += off;
+        if (off < n) {
+            break;
+        }
+    }
+    total = seconds_since(&start);
+    fprintf(stderr, "pipe %d: %lld bytes in %.3fs (%.0f B/s), "
+            "waited %.3fs for stage %d, %.3fs for stage %d\n",
+            boundary, bytes, total, total > 0 ? bytes / total : 0.0,
+            read_wait, boundary, write_wait, boundary + 1);
+    _exit(0);
+}
+
+/* Puts a meter between the stage just forked and the next one. */
+static void attach_meter(shell *sh, pipeline_job *job)
+{
+    int fd[2], pid;
+
+    make_pipe(job, fd);
+    job->boundary++;
+    pid = fork_stage(job);
+    if (pid == 0) {
+        join_pgroup(job->pgid);
+        xclose(fd[pipe_read]);
+        meter_pipe(job->boundary, job->next_read, fd[pipe_write],
+                   job->pipe_size > capture_chunk
+                   ? job->pipe_size : capture_chunk);
+    }
+    lead_job(sh, job, pid);
+    xclose(fd[pipe_write]);
+    xclose(job->next_read);
+    job->next_read = fd[pipe_read];
+    append_pid(&job->pids, pid);
+}
+
+static void redirect_and_exec(
+    shell *sh, const ast_node *node,
+    int read_fd, int write_fd)
+{
+    replace_fd(read_fd, 0);
+    replace_fd(write_fd, 1);
+    sh->in_pipeline = 1;
+    reset_signals();
+    execute_ast_node(sh, node);
+}
+
+static void *run_stage_thread(void *arg)
+{
+    stage_thread *t = arg;
+    builtin_io io = { t->out_fd, NULL };
+    sigset_t set;
+    int i;
+
+    /* a reader that is gone shows as EPIPE here, not as SIGPIPE on the
+     * whole shell */
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (t->argv == NULL) {
+        /* its words did not expand */
+        t->status = 1;
+    } else {
+        METRICS_ADD(builtins, 1);
+        t->status = t->b->fn(t->sh, t->argv, &io);
+    }
+    pthread_mutex_lock(&stage_fds_lock);
+    for (i = 0; i < 2; i++) {
+        if (t->fds[i] != -1) {
+            close(t->fds[i]);
+            t->fds[i] = -1;
         }
-        break;
+    }
+    pthread_mutex_unlock(&stage_fds_lock);
+    return NULL;
+}
+
+/* A stage that is a builtin leaving the shell state alone needs no
+ * process of its own, as long as expanding its words cannot change the
+ * state either: only parameters are allowed in them. */
+static const builtin *stage_builtin(shell *sh, const ast_node *node)
+{
+    const ast_command *cmd = &node->command;
+    const ast_word_part *part;
+    const builtin *b;
+    int i;
+
+    if (node->type != ast_type_command || cmd->argc == 0 ||
+        cmd->assign_count > 0 || cmd->words[0].parts != NULL ||
+        cmd->words[0].glob != NULL ||
+        func_find(&sh->funcs, cmd->argv[0]) != NULL)
+    {
+        return NULL;
+    }
+    b = find_builtin(cmd->argv[0]);
+    if (b == NULL || !(b->flags & builtin_pure)) {
+        return NULL;
+    }
+    for (i = 1; i < cmd->argc; i++) {
+        for (part = cmd->words[i].parts; part != NULL; part = part->next) {
+            if (part->type != part_literal && part->type != part_param) {
+                return NULL;
+            }
+        }
+    }
+    return b;
+}
+
+/* Runs node on a thread writing to out_fd if it is such a builtin; the
+ * thread then owns in_fd and out_fd, unless out_fd is the shell's own
+ * standard output. */
+static stage_thread *start_stage_thread(shell *sh, pipeline_job *job,
+                                        const ast_node *node,
+                                        int in_fd, int out_fd)
+{
+    const builtin *b = stage_builtin(sh, node);
+    stage_thread *t;
+
+    if (b == NULL) {
+        return NULL;
+    }
+    t = malloc(sizeof(stage_thread));
+    t->sh = sh;
+    t->b = b;
+    t->out_fd = out_fd;
+    t->fds[0] = in_fd;
+    t->fds[1] = out_fd != 1 ? out_fd : -1;
+    t->status = t->last = 0;
+    arg_list_init(&t->args);
+    t->argv = node->command.argv;
+    if (node->command.need_expand) {
+        sh->expand_failed = 0;
+        expand_command(sh, &t->args, &node->command);
+        t->argv = sh->expand_failed ? NULL : t->args.argv;
+    }
+    if (pthread_create(&t->tid, NULL, &run_stage_thread, t) != 0) {
+        arg_list_free(&t->args);
+        free(t);
+        return NULL;
+    }
+    t->next = job->threads;
+    job->threads = t;
+    return t;
+}
+
+/* Returns the status of the last stage if a thread ran it, else -1. */
+static int join_stage_threads(pipeline_job *job)
+{
+    stage_thread *t;
+    int status = -1;
+
+    while (job->threads != NULL) {
+        t = job->threads;
+        job->threads = t->next;
+        pthread_join(t->tid, NULL);
+        if (t->last) {
+            status = t->status;
+        }
+        arg_list_free(&t->args);
+        free(t);
+    }
+    return status;
+}
+
+static void pipeline_first(shell *sh, pipeline_job *job, const ast_node *node)
+{
+    int fd[2], pid;
+
+    make_pipe(job, fd);
+    if (start_stage_thread(sh, job, node, -1, fd[pipe_write]) == NULL) {
+        pid = fork_stage(job);
+        if (pid == 0) {
+            place_stage(job);
+            raise(SIGSTOP);
+            xclose(fd[pipe_read]);
+            redirect_and_exec(sh, node, 0, fd[pipe_write]);
+        }
+        wait_for_pid(pid, NULL, WUNTRACED);
+        xsetpgid(pid, pid);
+        set_fg_pgroup(sh, pid);
+        kill(pid, SIGCONT);
+        job->pgid = pid;
+        xclose(fd[pipe_write]);
+        append_pid(&job->pids, pid);
+    }
+    job->stage++;
+    job->next_read = fd[pipe_read];
+    if (job->measure) {
+        attach_meter(sh, job);
+    }
+}
+
+static void pipeline_middle(shell *sh, pipeline_job *job, const ast_node *node)
+{
+    int fd[2], pid;
+
+    make_pipe(job, fd);
+    if (start_stage_thread(sh, job, node, job->next_read,
+                           fd[pipe_write]) == NULL)
+    {
+        pid = fork_stage(job);
+        if (pid == 0) {
+            join_pgroup(job->pgid);
+            place_stage(job);
+            xclose(fd[pipe_read]);
+            redirect_and_exec(sh, node, job->next_read, fd[pipe_write]);
+        }
+        lead_job(sh, job, pid);
+        xclose(fd[pipe_write]);
+        xclose(job->next_read);
+        append_pid(&job->pids, pid);
+    }
+    job->stage++;
+    job->next_read = fd[pipe_read];
+    if (job->measure) {
+        attach_meter(sh, job);
+    }
+}
+
+/* Commands the shell forks do not go through fork_stage, so the pipe
+ * ends of the job's builtin threads must not outlive their exec: the
+ * reader of such a pipe would never see its end. */
+static void hide_thread_fds(pipeline_job *job)
+{
+    stage_thread *t;
+    int i;
+
+    pthread_mutex_lock(&stage_fds_lock);
+    for (t = job->threads; t != NULL; t = t->next) {
+        for (i = 0; i < 2; i++) {
+            if (t->fds[i] != -1) {
+                fcntl(t->fds[i], F_SETFD, FD_CLOEXEC);
+            }
+        }
+    }
+    pthread_mutex_unlock(&stage_fds_lock);
+}
+
+/* Runs the last stage in the shell with stdin on the pipe for the time
+ * being. The other stages are left to do_wait, so the handler that
+ * reaps any child stays off until then. */
+static void run_last_stage(shell *sh, pipeline_job *job, const ast_node *node)
+{
+    int saved;
+
+    hold_zombie_cleanup();
+    hide_thread_fds(job);
+    saved = dup_internal_fd(0);
+    replace_fd(job->next_read, 0);
+    execute_ast_node(sh, node);
+    if (saved == -1) {
+        close(0);
+    } else {
+        replace_fd(saved, 0);
+    }
+    job->shell_status = sh->last_status;
+}
+
+static void pipeline_last(shell *sh, pipeline_job *job, const ast_node *node)
+{
+    stage_thread *t;
+    int pid;
+
+    if (job->lastpipe) {
+        run_last_stage(sh, job, node);
+        return;
+    }
+    t = start_stage_thread(sh, job, node, job->next_read, 1);
+    if (t != NULL) {
+        t->last = 1;
+        return;
+    }
+    pid = fork_stage(job);
+    if (pid == 0) {
+        join_pgroup(job->pgid);
+        place_stage(job);
+        redirect_and_exec(sh, node, job->next_read, 1);
+    }
+    lead_job(sh, job, pid);
+    xclose(job->next_read);
+    append_pid(&job->pids, pid);
+}
+
+/* Bytes [from, n) at the head of in, for a branch that tee() served only
+ * in part: tee() always starts at the head, so the data goes through a
+ * scratch pipe and user space instead. */
+static void copy_tail(int in, int out, long from, long n)
+{
+    int scratch[2];
+    char *buf;
+    long got, w;
+
+    xpipe(scratch);
+    fcntl(scratch[pipe_write], F_SETPIPE_SZ, fcntl(in, F_GETPIPE_SZ));
+    buf = malloc(n);
+    got = syscall(SYS_tee, in, scratch[pipe_write], n, 0);
+    if (got == n && read(scratch[pipe_read], buf, n) == n) {
+        for (; from < n; from += w) {
+            w = write(out, buf + from, n - from);
+            if (w == -1 && errno != EINTR) {
+                break;
+            }
+            w = w == -1 ? 0 : w;
+        }
+    }
+    free(buf);
+    xclose(scratch[pipe_read]);
+    xclose(scratch[pipe_write]);
+}
+
+static void discard(int in, long n)
+{
+    char buf[4096];
+    long r;
+
+    while (n > 0) {
+        r = read(in, buf, n < sizeof(buf) ? n : sizeof(buf));
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return;
+        }
+        n -= r;
+    }
+}
+
+static void drop_branch(int *outs, int i)
+{
+    xclose(outs[i]);
+    outs[i] = -1;
+}
+
+/* Copies the source pipe into every branch pipe in the kernel: tee()
+ * gives all but the last live branch a copy without consuming it and
+ * splice() moves the data into the last one. A full branch pipe blocks
+ * the copy, so the slowest branch sets the pace of the source. Branches
+ * that exit are dropped; once all are gone the source gets SIGPIPE. */
+static void distribute(int in, int *outs, int count)
+{
+    int first, last, i;
+    long n, r, moved;
+
+    signal(SIGPIPE, SIG_IGN);
+    for (;;) {
+        for (first = 0; first < count && outs[first] == -1; first++)
+            {}
+        for (last = count - 1; last >= 0 && outs[last] == -1; last--)
+            {}
+        if (first == count) {
+            return;
+        }
+        if (first < last) {
+            n = syscall(SYS_tee, in, outs[first], fanout_chunk, 0);
+        } else {
+            n = syscall(SYS_splice, in, NULL, outs[last], NULL,
+                        fanout_chunk, splice_move);
+        }
+        if (n == 0) {
+            return;
+        }
+        if (n == -1) {
+            if (errno != EINTR) {
+                drop_branch(outs, first);
+            }
+            continue;
+        }
+        if (first == last) {
+            continue;
+        }
+        for (i = first + 1; i < last; i++) {
+            if (outs[i] == -1) {
+                continue;
+            }
+            r = syscall(SYS_tee, in, outs[i], n, 0);
+            if (r == -1 && errno == EINTR) {
+                i--;
+            } else if (r == -1) {
+                drop_branch(outs, i);
+            } else if (r < n) {
+                copy_tail(in, outs[i], r, n);
+            }
+        }
+        for (moved = 0; moved < n; moved += r) {
+            r = syscall(SYS_splice, in, NULL, outs[last], NULL,
+                        n - moved, splice_move);
+            if (r == -1 && errno == EINTR) {
+                r = 0;
+            } else if (r <= 0) {
+                drop_branch(outs, last);
+                discard(in, n - moved);
+                break;
+            }
+        }
+    }
+}
+
+/* The source runs as the first stage of a pipeline whose remaining
+ * stages are the branches and a distributor in between. The status is
+ * that of the first failing branch; $FANOUT_STATUS lists them all. */
+static void execute_fanout(shell *sh, const ast_fanout *fan)
+{
+    const ast_list_node *branch;
+    pipeline_job job;
+    strbuf text;
+    char num[16];
+    int *outs, *pids, *statuses, count = 0, fd[2], pid, status, i, j;
+    long long started;
+
+    for (branch = fan->branches; branch != NULL; branch = branch->next) {
+        count++;
+    }
+    outs = malloc(sizeof(int) * count);
+    pids = malloc(sizeof(int) * count);
+    statuses = malloc(sizeof(int) * count);
+    METRICS_ADD(pipelines, 1);
+    started = metrics_clock_ns();
+    init_pipeline_job(sh, &job);
+    disable_zombie_cleanup();
+    pipeline_first(sh, &job, fan->source);
+    for (i = 0, branch = fan->branches; branch != NULL;
+         i++, branch = branch->next)
+    {
+        make_pipe(&job, fd);
+        pid = fork_stage(&job);
+        if (pid == 0) {
+            join_pgroup(job.pgid);
+            place_stage(&job);
+            xclose(job.next_read);
+            xclose(fd[pipe_write]);
+            for (j = 0; j < i; j++) {
+                xclose(outs[j]);
+            }
+            redirect_and_exec(sh, branch->node, fd[pipe_read], 1);
+        }
+        lead_job(sh, &job, pid);
+        job.stage++;
+        xclose(fd[pipe_read]);
+        outs[i] = fd[pipe_write];
+        pids[i] = pid;
+        statuses[i] = 0;
+        append_pid(&job.pids, pid);
+    }
+    pid = fork_stage(&job);
+    if (pid == 0) {
+        join_pgroup(job.pgid);
+        distribute(job.next_read, outs, count);
+        _exit(0);
+    }
+    append_pid(&job.pids, pid);
+    xclose(job.next_read);
+    for (i = 0; i < count; i++) {
+        xclose(outs[i]);
+    }
+
+    /* by pid, leaving other children to whoever started them */
+    for (i = 0; i < count; i++) {
+        status = 0;
+        wait_for_pid(pids[i], &status, 0);
+        statuses[i] = get_exit_status(status);
+        remove_pid(&job.pids, pids[i]);
+    }
+    if (job.pids != NULL) {
+        wait_pids(job.pids);
+    }
+    join_stage_threads(&job);
+    metrics_record_wait(metrics_clock_ns() - started);
+    enable_zombie_cleanup();
+    restore_fg_pgroup(sh);
+
+    strbuf_init(&text, 64);
+    strbuf_clear(&text);
+    sh->last_status = 0;
+    for (i = 0; i < count; i++) {
+        snprintf(num, sizeof(num), i > 0 ? " %d" : "%d", statuses[i]);
+        strbuf_join(&text, num);
+        if (sh->last_status == 0) {
+            sh->last_status = statuses[i];
+        }
+    }
+    var_set(&sh->vars, "FANOUT_STATUS", text.chars);
+    strbuf_free(&text);
+    free(statuses);
+    free(pids);
+    free(outs);
+}
+
+static void execute_background(shell *sh, const ast_node *child)
+{
+    int pid;
+
+    pid = xfork();
+    if (pid == 0) {
+        reset_signals();
+        xsetpgid(0, 0);
+        sh->pgid = getpgid(0);
+        sh->in_background = 1;
+        execute_ast_node(sh, child);
+        _exit(sh->last_status);
+    }
+    sh->last_status = 0;
+}
+
+static void set_coproc_var(shell *sh, const char *name, const char *suffix,
+                           int value)
+{
+    char var[256], num[16];
+
+    snprintf(var, sizeof(var), "%s_%s", name, suffix);
+    snprintf(num, sizeof(num), "%d", value);
+    var_set(&sh->vars, var, num);
+}
+
+/* Starts the command once as a background job on two pipes and keeps
+ * the other ends: NAME_IN writes to the command, NAME_OUT reads what it
+ * prints and NAME_PID is its process. A coprocess of the same name is
+ * let go first, which closes its stdin. */
+static void execute_coproc(shell *sh, const ast_coproc *co)
+{
+    coproc_item *item, **pprev;
+    int to[2], from[2], pid;
+
+    for (pprev = &sh->coprocs; *pprev != NULL; pprev = &(*pprev)->next) {
+        if (strcmp((*pprev)->name, co->name) == 0) {
+            item = *pprev;
+            *pprev = item->next;
+            item->next = NULL;
+            xclose(item->in_fd);
+            xclose(item->out_fd);
+            free(item->name);
+            free(item);
+            break;
+        }
+    }
+    xpipe(to);
+    xpipe(from);
+    pid = xfork();
+    if (pid == 0) {
+        reset_signals();
+        xsetpgid(0, 0);
+        sh->pgid = getpgid(0);
+        sh->in_background = 1;
+        drop_coprocs(sh);
+        xclose(to[pipe_write]);
+        xclose(from[pipe_read]);
+        replace_fd(to[pipe_read], 0);
+        replace_fd(from[pipe_write], 1);
+        execute_ast_node(sh, co->child);
+        _exit(sh->last_status);
+    }
+    xclose(to[pipe_read]);
+    xclose(from[pipe_write]);
+    item = malloc(sizeof(coproc_item));
+    item->name = strdup(co->name);
+    item->pid = pid;
+    item->in_fd = move_internal_fd(to[pipe_write]);
+    item->out_fd = move_internal_fd(from[pipe_read]);
+    item->next = sh->coprocs;
+    sh->coprocs = item;
+    set_coproc_var(sh, co->name, "PID", pid);
+    set_coproc_var(sh, co->name, "IN", item->in_fd);
+    set_coproc_var(sh, co->name, "OUT", item->out_fd);
+    METRICS_ADD(coprocs, 1);
+    sh->last_status = 0;
+}
+
+/* (( expr )) succeeds when the expression is non-zero. */
+static void execute_arith(shell *sh, const ast_arith *arith)
+{
+    enum arith_error err;
+    long long result;
+
+    err = arith_eval(&sh->vars, sh->params, arith->expr, &result);
+    if (err != arith_ok) {
+        log_error("%s: %s", arith->text, arith_error_msg(err));
+        sh->last_status = 1;
+    } else {
+        sh->last_status = result != 0 ? 0 : 1;
+    }
+    if (sh->in_pipeline) {
+        _exit(sh->last_status);
+    }
+}
+
+static void define_function(shell *sh, const ast_function *func)
+{
+    func_define(&sh->funcs, func->name, func->body);
+    sh->last_status = 0;
+}
+
+typedef struct {
+    int active, status, index;
+    redir_entry *redir;
+    int *saved_fds;
+    arg_list values;
+    procsub_item *procsubs;
+} vm_slot;
+
+/* Leaves the constructs still open when return cuts a program short. */
+static void unwind_slots(shell *sh, vm_slot *slots, int count)
+{
+    while (--count >= 0) {
+        if (!slots[count].active) {
+            continue;
+        }
+        if (slots[count].redir != NULL) {
+            restore_redirections(slots[count].redir,
+                                 slots[count].saved_fds);
+        } else {
+            arg_list_free(&slots[count].values);
+        }
+        finish_procsubs(sh, slots[count].procsubs);
+        slots[count].active = 0;
+    }
+}
+
+#define VM_DISPATCH() __extension__ ({ goto *labels[ip->op]; })
+#define VM_NEXT() do { ip++; VM_DISPATCH(); } while (0)
+#define VM_JUMP() do { ip = code + ip->target; VM_DISPATCH(); } while (0)
+
+static void run_program(shell *sh, const vm_program *prog)
+{
+    static void *const labels[] = {
+        __extension__ &&do_command,     __extension__ &&do_arith,
+        __extension__ &&do_subshell,    __extension__ &&do_background,
+        __extension__ &&do_coproc,      __extension__ &&do_define,
+        __extension__ &&do_redirect,    __extension__ &&do_restore,
+        __extension__ &&do_keep,        __extension__ &&do_pipe_first,
+        __extension__ &&do_pipe_middle, __extension__ &&do_pipe_last,
+        __extension__ &&do_wait,        __extension__ &&do_fanout,
+        __extension__ &&do_jump,        __extension__ &&do_jump_ok,
+        __extension__ &&do_jump_fail,   __extension__ &&do_set_status,
+        __extension__ &&do_loop_begin,  __extension__ &&do_loop_record,
+        __extension__ &&do_loop_end,    __extension__ &&do_for_begin,
+        __extension__ &&do_for_next,    __extension__ &&do_for_end,
+        __extension__ &&do_end
+    };
+    const vm_instr *code = prog->code, *ip = code;
+    vm_slot slots[prog->slot_count + 1], *slot;
+    pipeline_job job;
+    int i;
+
+    for (i = 0; i < prog->slot_count; i++) {
+        slots[i].active = 0;
+    }
+    VM_DISPATCH();
+
+do_command:
+    execute_command(sh, ip->command);
+    if (sh->returning) {
+        goto do_end;
+    }
+    VM_NEXT();
+do_arith:
+    execute_arith(sh, ip->arith);
+    VM_NEXT();
+do_subshell:
+    execute_subshell(sh, ip->subshell);
+    VM_NEXT();
+do_background:
+    execute_background(sh, ip->node);
+    VM_NEXT();
+do_coproc:
+    execute_coproc(sh, ip->coproc);
+    VM_NEXT();
+do_define:
+    define_function(sh, ip->function);
+    VM_NEXT();
+do_redirect:
+    slot = &slots[ip->slot];
+    slot->procsubs = sh->procsubs;
+    if (apply_redirections(sh, ip->redir, &slot->saved_fds) == -1) {
+        finish_procsubs(sh, slot->procsubs);
+        VM_JUMP();
+    }
+    slot->redir = ip->redir;
+    slot->active = 1;
+    VM_NEXT();
+do_restore:
+    slot = &slots[ip->slot];
+    restore_redirections(ip->redir, slot->saved_fds);
+    finish_procsubs(sh, slot->procsubs);
+    slot->active = 0;
+    VM_NEXT();
+do_keep:
+    slot = &slots[ip->slot];
+    keep_redirections(ip->redir, slot->saved_fds);
+    finish_procsubs(sh, slot->procsubs);
+    slot->active = 0;
+    sh->last_status = 0;
+    VM_NEXT();
+do_pipe_first:
+    METRICS_ADD(pipelines, 1);
+    init_pipeline_job(sh, &job);
+    disable_zombie_cleanup();
+    pipeline_first(sh, &job, ip->node);
+    VM_NEXT();
+do_pipe_middle:
+    pipeline_middle(sh, &job, ip->node);
+    VM_NEXT();
+do_pipe_last:
+    pipeline_last(sh, &job, ip->node);
+    VM_NEXT();
+do_wait:
+    if (job.pids == NULL) {
+        sh->last_status = 0;
+    } else if (job.timer.deadline == 0) {
+        sh->last_status = wait_pids(job.pids);
+    } else {
+        job.timer.pgid = job.pgid;
+        sh->last_status = get_exit_status(wait_pids_until(job.pids,
+                                                          &job.timer));
+        if (job.timer.timed_out) {
+            log_error("pipeline: timed out");
+            sh->last_status = timeout_status;
+        }
+    }
+    i = join_stage_threads(&job);
+    if (i != -1) {
+        sh->last_status = i;
+    }
+    metrics_record_wait(metrics_clock_ns() - job.started);
+    if (job.shell_status != -1) {
+        sh->last_status = job.shell_status;
+        release_zombie_cleanup();
+    } else {
+        enable_zombie_cleanup();
+    }
+    restore_fg_pgroup(sh);
+    if (sh->returning) {
+        goto do_end;
+    }
+    VM_NEXT();
+do_fanout:
+    execute_fanout(sh, ip->fanout);
+    VM_NEXT();
+do_jump:
+    VM_JUMP();
+do_jump_ok:
+    if (sh->last_status == 0) {
+        VM_JUMP();
+    }
+    VM_NEXT();
+do_jump_fail:
+    if (sh->last_status != 0) {
+        VM_JUMP();
+    }
+    VM_NEXT();
+do_set_status:
+    sh->last_status = ip->status;
+    VM_NEXT();
+do_loop_begin:
+    slots[ip->slot].status = 0;
+    VM_NEXT();
+do_loop_record:
+    slots[ip->slot].status = sh->last_status;
+    VM_NEXT();
+do_loop_end:
+    sh->last_status = slots[ip->slot].status;
+    VM_NEXT();
+do_for_begin:
+    slot = &slots[ip->slot];
+    arg_list_init(&slot->values);
+    slot->procsubs = sh->procsubs;
+    if (ip->for_clause->words != NULL) {
+        expand_words(sh, &slot->values,
+                     ip->for_clause->words, ip->for_clause->word_count);
+    } else {
+        /* copied, as mapfile in the body may replace the parameters */
+        for (i = 0; i < sh->params->argc; i++) {
+            arg_list_push(&slot->values,
+                          arg_list_copy(&slot->values, sh->params->argv[i],
+                                        strlen(sh->params->argv[i])));
+        }
+    }
+    slot->index = slot->status = 0;
+    slot->redir = NULL;
+    slot->active = 1;
+    VM_NEXT();
+do_for_next:
+    slot = &slots[ip->slot];
+    if (slot->index == slot->values.argc) {
+        VM_JUMP();
+    }
+    var_set(&sh->vars, ip->for_clause->name, slot->values.argv[slot->index++]);
+    VM_NEXT();
+do_for_end:
+    slot = &slots[ip->slot];
+    arg_list_free(&slot->values);
+    finish_procsubs(sh, slot->procsubs);
+    slot->active = 0;
+    sh->last_status = slot->status;
+    VM_NEXT();
+do_end:
+    unwind_slots(sh, slots, prog->slot_count);
+}
+
+/* Runs a single node in place. A command may replace the forked child
+ * it runs in; everything else goes through the compiler. */
+static void execute_ast_node(shell *sh, const ast_node *node)
+{
+    vm_program *prog;
+    int in_pipeline;
+
+    switch (node->type) {
+    case ast_type_command:
+        execute_command(sh, &node->command);
+        return;
+    case ast_type_arith:
+        execute_arith(sh, &node->arith);
+        return;
+    case ast_type_subshell:
+        execute_subshell(sh, &node->subshell);
+        return;
     case ast_type_redirection:
-        execute_redirection(sh, &node->redirection);
-        break;
-    case ast_type_pipeline:
-        execute_pipeline(sh, &node->pipeline);
-        break;
-    case ast_type_logical:   
-        execute_logical(sh, &node->logical);
+        if (is_simple_command(node)) {
+            execute_redirection(sh, &node->redirection);
+            return;
+        }
         break;
-    case ast_type_background:
-        execute_background(sh, &node->background);
+    default:
         break;
     }
+    in_pipeline = enter_compound(sh);
+    prog = compile_node(node);
+    run_program(sh, prog);
+    program_free(prog);
+    leave_compound(sh, in_pipeline);
 }
 
 void execute(shell *sh, const ast_list_node *stmts)
 {
-    sh->last_status = 0;
-    while (stmts != NULL) {
-        execute_ast_node(sh, stmts->node);
-        stmts = stmts->next;
-    }
+    vm_program *prog;
+
+    prog = compile_list(stmts);
+    run_program(sh, prog);
+    program_free(prog);
+}
+
+void execute_program(shell *sh, const vm_program *prog)
+{
+    run_program(sh, prog);
 }
@@ -2,8 +2,14 @@
 #define EXECUTOR_SENTRY
 #include "parser.h"
 #include "shell.h"
+#include "strbuf.h"
 
 
 void execute(shell *sh, const ast_list_node *stmts);
+void execute_program(shell *sh, const vm_program *prog);
+void execute_substitution(shell *sh, const ast_list_node *stmts, strbuf *out);
+void execute_procsub(shell *sh, const ast_list_node *stmts, int output,
+                     strbuf *out);
+int is_prefix(const char *name);
 
 #endif 
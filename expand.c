@@ -0,0 +1,756 @@
+#include "expand.h"
+#include "executor.h"
+#include "wrappers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+
+enum {
+    dents_buf_size = 256 * 1024,
+    dir_cache_buckets = 64,
+    arg_block_size = 4096
+};
+
+struct arg_block {
+    char *mem;
+    int size, used;
+    arg_block *next;
+};
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct {
+    int name_off, name_len;
+    unsigned char type;
+} dir_entry;
+
+typedef struct dir_listing_tag {
+    char *path;
+    strbuf names;
+    dir_entry *entries;
+    int count, capacity;
+    struct dir_listing_tag *next;
+} dir_listing;
+
+/* Listings are read once per command and shared by all its words. */
+typedef struct {
+    dir_listing *buckets[dir_cache_buckets];
+    char *dents;
+} dir_cache;
+
+typedef struct {
+    dir_cache *cache;
+    const glob_pattern *pat;
+    strbuf path, found;
+    int *offsets;
+    int count, capacity;
+} glob_state;
+
+/* A field is built from the parts of a word until an unquoted blank in an
+ * expansion result splits it. The pattern keeps quoted metacharacters
+ * escaped in case the field turns out to need pathname expansion. */
+typedef struct {
+    shell *sh;
+    arg_list *args;
+    dir_cache *cache;
+    strbuf field, pattern;
+    int have_field, have_glob;
+} field_state;
+
+
+void arg_list_init(arg_list *args)
+{
+    args->argc = 0;
+    args->capacity = 16;
+    args->argv = malloc(sizeof(char *) * args->capacity);
+    args->argv[0] = NULL;
+    args->blocks = NULL;
+}
+
+void arg_list_free(arg_list *args)
+{
+    while (args->blocks != NULL) {
+        arg_block *tmp = args->blocks;
+
+        args->blocks = tmp->next;
+        free(tmp->mem);
+        free(tmp);
+    }
+    free(args->argv);
+}
+
+void arg_list_push(arg_list *args, char *arg)
+{
+    if (args->argc + 1 >= args->capacity) {
+        args->capacity *= 2;
+        args->argv = realloc(args->argv, sizeof(char *) * args->capacity);
+    }
+    args->argv[args->argc++] = arg;
+    args->argv[args->argc] = NULL;
+}
+
+char *arg_list_copy(arg_list *args, const char *str, int len)
+{
+    arg_block *block = args->blocks;
+    char *dst;
+
+    if (block == NULL || block->size - block->used < len + 1) {
+        block = malloc(sizeof(arg_block));
+        block->size = len + 1 > arg_block_size ? len + 1 : arg_block_size;
+        block->used = 0;
+        block->mem = malloc(block->size);
+        block->next = args->blocks;
+        args->blocks = block;
+    }
+    dst = block->mem + block->used;
+    memcpy(dst, str, len);
+    dst[len] = '\0';
+    block->used += len + 1;
+    return dst;
+}
+
+/* Takes ownership of a filled buffer without giving up the free space
+ * left in the current block. */
+static void arg_list_keep(arg_list *args, char *mem)
+{
+    arg_block *block, **pos;
+
+    block = malloc(sizeof(arg_block));
+    block->mem = mem;
+    block->size = block->used = 0;
+    pos = args->blocks != NULL ? &args->blocks->next : &args->blocks;
+    block->next = *pos;
+    *pos = block;
+}
+
+static unsigned hash_path(const char *path)
+{
+    unsigned h = 2166136261u;
+
+    while (*path != '\0') {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h;
+}
+
+static dir_cache *dir_cache_new()
+{
+    dir_cache *cache;
+
+    cache = calloc(1, sizeof(dir_cache));
+    return cache;
+}
+
+static void dir_cache_free(dir_cache *cache)
+{
+    int i;
+
+    if (cache == NULL) {
+        return;
+    }
+    for (i = 0; i < dir_cache_buckets; i++) {
+        while (cache->buckets[i] != NULL) {
+            dir_listing *tmp = cache->buckets[i];
+
+            cache->buckets[i] = tmp->next;
+            free(tmp->path);
+            strbuf_free(&tmp->names);
+            free(tmp->entries);
+            free(tmp);
+        }
+    }
+    free(cache->dents);
+    free(cache);
+}
+
+static void listing_add(dir_listing *dir, const char *name, unsigned char type)
+{
+    dir_entry *e;
+
+    if (dir->count == dir->capacity) {
+        dir->capacity = dir->capacity == 0 ? 64 : dir->capacity * 2;
+        dir->entries = realloc(dir->entries, sizeof(dir_entry) * dir->capacity);
+    }
+    e = &dir->entries[dir->count++];
+    e->name_off = dir->names.len;
+    e->name_len = strlen(name);
+    e->type = type;
+    strbuf_append_mem(&dir->names, name, e->name_len + 1);
+}
+
+static void read_listing(dir_cache *cache, dir_listing *dir)
+{
+    int fd, n, pos;
+
+    fd = open(dir->path[0] == '\0' ? "." : dir->path,
+              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (cache->dents == NULL) {
+        cache->dents = malloc(dents_buf_size);
+    }
+    while ((n = syscall(SYS_getdents64, fd, cache->dents,
+                        dents_buf_size)) > 0)
+    {
+        for (pos = 0; pos < n;) {
+            struct linux_dirent64 *d = (void *)(cache->dents + pos);
+            const char *name = d->d_name;
+
+            pos += d->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' ||
+                (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+            listing_add(dir, name, d->d_type);
+        }
+    }
+    close(fd);
+}
+
+static dir_listing *dir_cache_get(dir_cache *cache, const char *path)
+{
+    dir_listing **bucket, *dir;
+
+    bucket = &cache->buckets[hash_path(path) % dir_cache_buckets];
+    for (dir = *bucket; dir != NULL; dir = dir->next) {
+        if (strcmp(dir->path, path) == 0) {
+            return dir;
+        }
+    }
+    dir = calloc(1, sizeof(dir_listing));
+    dir->path = strdup(path);
+    strbuf_init(&dir->names, 4096);
+    read_listing(cache, dir);
+    dir->next = *bucket;
+    *bucket = dir;
+    return dir;
+}
+
+static int entry_is_dir(
+    glob_state *st, const dir_entry *e, const char *name, int follow)
+{
+    struct stat sb;
+    int len, status;
+
+    if (e->type == DT_DIR) {
+        return 1;
+    }
+    if (e->type != DT_UNKNOWN && (e->type != DT_LNK || !follow)) {
+        return 0;
+    }
+    len = st->path.len;
+    strbuf_append_mem(&st->path, name, e->name_len);
+    status = follow ? stat(st->path.chars, &sb) : lstat(st->path.chars, &sb);
+    strbuf_truncate(&st->path, len);
+    return status == 0 && S_ISDIR(sb.st_mode);
+}
+
+static void add_match(glob_state *st)
+{
+    if (st->count == st->capacity) {
+        st->capacity = st->capacity == 0 ? 64 : st->capacity * 2;
+        st->offsets = realloc(st->offsets, sizeof(int) * st->capacity);
+    }
+    st->offsets[st->count++] = st->found.len;
+    strbuf_append_mem(&st->found, st->path.chars, st->path.len + 1);
+}
+
+static void glob_segments(glob_state *st, int idx);
+
+/* Appends a matched entry to the path and either records it or descends
+ * into it for the remaining segments. */
+static void glob_entry(
+    glob_state *st, int idx, const dir_entry *e, const char *name)
+{
+    int len = st->path.len, last = idx + 1 == st->pat->seg_count;
+
+    if (!last || st->pat->trailing_slash) {
+        if (!entry_is_dir(st, e, name, 1)) {
+            return;
+        }
+    }
+    strbuf_append_mem(&st->path, name, e->name_len);
+    if (last) {
+        if (st->pat->trailing_slash) {
+            strbuf_append(&st->path, '/');
+        }
+        add_match(st);
+    } else {
+        strbuf_append(&st->path, '/');
+        glob_segments(st, idx + 1);
+    }
+    strbuf_truncate(&st->path, len);
+}
+
+static void glob_literal(glob_state *st, int idx)
+{
+    const glob_segment *seg = &st->pat->segs[idx];
+    struct stat sb;
+    int len = st->path.len;
+
+    strbuf_join(&st->path, seg->text);
+    if (idx + 1 < st->pat->seg_count) {
+        strbuf_append(&st->path, '/');
+        glob_segments(st, idx + 1);
+    } else if (st->pat->trailing_slash) {
+        if (stat(st->path.chars, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            strbuf_append(&st->path, '/');
+            add_match(st);
+        }
+    } else if (lstat(st->path.chars, &sb) == 0) {
+        add_match(st);
+    }
+    strbuf_truncate(&st->path, len);
+}
+
+/* ** matches zero or more directories; symlinked directories are not
+ * descended into so that loops cannot occur. */
+static void glob_globstar(glob_state *st, int idx)
+{
+    const dir_listing *dir;
+    int i, len = st->path.len, last = idx + 1 == st->pat->seg_count;
+
+    if (!last) {
+        glob_segments(st, idx + 1);
+    }
+    dir = dir_cache_get(st->cache, st->path.chars);
+    for (i = 0; i < dir->count; i++) {
+        const dir_entry *e = &dir->entries[i];
+        const char *name = dir->names.chars + e->name_off;
+        int is_dir;
+
+        if (name[0] == '.') {
+            continue;
+        }
+        is_dir = entry_is_dir(st, e, name, 0);
+        strbuf_append_mem(&st->path, name, e->name_len);
+        if (last && (is_dir || !st->pat->trailing_slash)) {
+            if (st->pat->trailing_slash) {
+                strbuf_append(&st->path, '/');
+            }
+            add_match(st);
+            strbuf_truncate(&st->path, len + e->name_len);
+        }
+        if (is_dir) {
+            strbuf_append(&st->path, '/');
+            glob_segments(st, idx);
+        }
+        strbuf_truncate(&st->path, len);
+    }
+}
+
+static void glob_segments(glob_state *st, int idx)
+{
+    const glob_segment *seg;
+    const dir_listing *dir;
+    int i;
+
+    seg = &st->pat->segs[idx];
+    switch (seg->type) {
+    case segment_literal:
+        glob_literal(st, idx);
+        return;
+    case segment_globstar:
+        glob_globstar(st, idx);
+        return;
+    case segment_match:
+        break;
+    }
+    dir = dir_cache_get(st->cache, st->path.chars);
+    for (i = 0; i < dir->count; i++) {
+        const dir_entry *e = &dir->entries[i];
+        const char *name = dir->names.chars + e->name_off;
+
+        if (pattern_match(seg, name, e->name_len)) {
+            glob_entry(st, idx, e, name);
+        }
+    }
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int expand_glob(arg_list *args, dir_cache *cache,
+                       const glob_pattern *pat)
+{
+    glob_state st;
+    char **sorted;
+    int i;
+
+    st.cache = cache;
+    st.pat = pat;
+    st.offsets = NULL;
+    st.count = st.capacity = 0;
+    strbuf_init(&st.path, 256);
+    strbuf_init(&st.found, 4096);
+    strbuf_clear(&st.path);
+    if (pat->absolute) {
+        strbuf_append(&st.path, '/');
+    }
+    glob_segments(&st, 0);
+    strbuf_free(&st.path);
+    if (st.count == 0) {
+        strbuf_free(&st.found);
+        return 0;
+    }
+
+    sorted = malloc(sizeof(char *) * st.count);
+    for (i = 0; i < st.count; i++) {
+        sorted[i] = st.found.chars + st.offsets[i];
+    }
+    qsort(sorted, st.count, sizeof(char *), &compare_paths);
+    for (i = 0; i < st.count; i++) {
+        arg_list_push(args, sorted[i]);
+    }
+    arg_list_keep(args, st.found.chars);
+    free(sorted);
+    free(st.offsets);
+    return st.count;
+}
+
+static int is_ifs(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n';
+}
+
+static int is_pattern_char(char ch)
+{
+    return ch == '*' || ch == '?' || ch == '[' || ch == ']' || ch == '\\';
+}
+
+static void field_add(field_state *fs, const char *str, int len, int quoted)
+{
+    int i;
+
+    fs->have_field = 1;
+    strbuf_append_mem(&fs->field, str, len);
+    for (i = 0; i < len && !is_pattern_char(str[i]); i++)
+        {}
+    if (i == len) {
+        strbuf_append_mem(&fs->pattern, str, len);
+        return;
+    }
+    for (i = 0; i < len; i++) {
+        if (quoted && is_pattern_char(str[i])) {
+            strbuf_append(&fs->pattern, '\\');
+        } else if (str[i] == '*' || str[i] == '?' || str[i] == '[') {
+            fs->have_glob = 1;
+        }
+        strbuf_append(&fs->pattern, str[i]);
+    }
+}
+
+static void field_emit(field_state *fs)
+{
+    glob_pattern *pat;
+    int count;
+
+    if (fs->have_glob && (pat = pattern_compile(fs->pattern.chars)) != NULL) {
+        if (fs->cache == NULL) {
+            fs->cache = dir_cache_new();
+        }
+        count = expand_glob(fs->args, fs->cache, pat);
+        pattern_free(pat);
+        if (count > 0) {
+            goto reset;
+        }
+    }
+    arg_list_push(fs->args,
+                  arg_list_copy(fs->args, fs->field.chars, fs->field.len));
+reset:
+    fs->have_field = fs->have_glob = 0;
+    strbuf_clear(&fs->field);
+    strbuf_clear(&fs->pattern);
+}
+
+static void field_split(field_state *fs, const char *str, int len)
+{
+    int i, start = 0;
+
+    for (i = 0; i <= len; i++) {
+        if (i < len && !is_ifs(str[i])) {
+            continue;
+        }
+        if (i > start) {
+            field_add(fs, str + start, i - start, 0);
+        }
+        if (i < len && fs->have_field) {
+            field_emit(fs);
+        }
+        start = i + 1;
+    }
+}
+
+static const char *param_value(shell *sh, const char *name, char *numbuf)
+{
+    const char *value;
+    int n;
+
+    if (name[1] == '\0') {
+        switch (name[0]) {
+        case '?':
+            sprintf(numbuf, "%d", sh->last_status);
+            return numbuf;
+        case '$':
+            sprintf(numbuf, "%d", sh->pid);
+            return numbuf;
+        case '#':
+            sprintf(numbuf, "%d", sh->params->argc);
+            return numbuf;
+        case '0':
+            return "shellma";
+        }
+    }
+    if (isdigit(name[0])) {
+        n = atoi(name);
+        return n <= sh->params->argc ? sh->params->argv[n-1] : "";
+    }
+    value = var_get(&sh->vars, name);
+    return value != NULL ? value : "";
+}
+
+static const char *arith_value(
+    shell *sh, const ast_word_part *part, char *numbuf)
+{
+    enum arith_error err;
+    long long result;
+
+    err = arith_eval(&sh->vars, sh->params, part->expr, &result);
+    if (err != arith_ok) {
+        log_error("%s: %s", part->text, arith_error_msg(err));
+        sh->last_status = 1;
+        sh->expand_failed = 1;
+        return "";
+    }
+    sprintf(numbuf, "%lld", result);
+    return numbuf;
+}
+
+static int is_param_list(const char *name)
+{
+    return (name[0] == '@' || name[0] == '*') && name[1] == '\0';
+}
+
+static void join_params(shell *sh, strbuf *out)
+{
+    int i;
+
+    for (i = 0; i < sh->params->argc; i++) {
+        if (i > 0) {
+            strbuf_append(out, ' ');
+        }
+        strbuf_join(out, sh->params->argv[i]);
+    }
+}
+
+/* "$@" gives one field per parameter, joined to the text around it. */
+static void add_param_fields(field_state *fs)
+{
+    const param_frame *params = fs->sh->params;
+    int i;
+
+    for (i = 0; i < params->argc; i++) {
+        if (i > 0) {
+            field_emit(fs);
+        }
+        field_add(fs, params->argv[i], strlen(params->argv[i]), 1);
+    }
+}
+
+/* The commands a substitution runs clear expand_failed for their own
+ * words, which must not hide an error earlier in the outer word. */
+static void substitute(shell *sh, const ast_word_part *part, strbuf *out)
+{
+    int start = out->len, failed = sh->expand_failed;
+
+    execute_substitution(sh, part->statements, out);
+    sh->expand_failed = failed;
+    while (out->len > start && out->chars[out->len-1] == '\n') {
+        out->len--;
+    }
+    out->chars[out->len] = '\0';
+}
+
+static void start_procsub(shell *sh, const ast_word_part *part, strbuf *out)
+{
+    int failed = sh->expand_failed;
+
+    execute_procsub(sh, part->statements, part->type == part_procsub_out,
+                    out);
+    sh->expand_failed = failed;
+}
+
+static void expand_parts(field_state *fs, const ast_word *word)
+{
+    const ast_word_part *part;
+    char numbuf[32];
+    strbuf out;
+
+    for (part = word->parts; part != NULL; part = part->next) {
+        const char *value = "";
+        int len = 0;
+
+        switch (part->type) {
+        case part_literal:
+            field_add(fs, part->text, strlen(part->text), part->quoted);
+            continue;
+        case part_param:
+            if (!is_param_list(part->text)) {
+                value = param_value(fs->sh, part->text, numbuf);
+                len = strlen(value);
+                break;
+            }
+            if (part->quoted && part->text[0] == '@') {
+                add_param_fields(fs);
+                continue;
+            }
+            strbuf_init(&out, 256);
+            strbuf_clear(&out);
+            join_params(fs->sh, &out);
+            value = out.chars;
+            len = out.len;
+            break;
+        case part_arith:
+            value = arith_value(fs->sh, part, numbuf);
+            len = strlen(value);
+            break;
+        case part_command:
+            strbuf_init(&out, 256);
+            strbuf_clear(&out);
+            substitute(fs->sh, part, &out);
+            value = out.chars;
+            len = out.len;
+            break;
+        case part_procsub_in:
+        case part_procsub_out:
+            strbuf_init(&out, 32);
+            strbuf_clear(&out);
+            start_procsub(fs->sh, part, &out);
+            field_add(fs, out.chars, out.len, 1);
+            strbuf_free(&out);
+            continue;
+        }
+        if (part->quoted) {
+            field_add(fs, value, len, 1);
+        } else {
+            field_split(fs, value, len);
+        }
+        if (part->type == part_command ||
+            (part->type == part_param && is_param_list(part->text)))
+        {
+            strbuf_free(&out);
+        }
+    }
+    if (fs->have_field) {
+        field_emit(fs);
+    }
+}
+
+void expand_words(
+    shell *sh, arg_list *args, const ast_word *words, int count)
+{
+    field_state fs;
+    int i;
+
+    fs.sh = sh;
+    fs.args = args;
+    fs.cache = NULL;
+    fs.have_field = fs.have_glob = 0;
+    strbuf_init(&fs.field, 64);
+    strbuf_init(&fs.pattern, 64);
+    strbuf_clear(&fs.field);
+    strbuf_clear(&fs.pattern);
+    for (i = 0; i < count; i++) {
+        const ast_word *word = &words[i];
+
+        if (word->parts != NULL) {
+            expand_parts(&fs, word);
+            continue;
+        }
+        if (word->glob != NULL) {
+            if (fs.cache == NULL) {
+                fs.cache = dir_cache_new();
+            }
+            if (expand_glob(args, fs.cache, word->glob) > 0) {
+                continue;
+            }
+        }
+        arg_list_push(args, word->text);
+    }
+    strbuf_free(&fs.field);
+    strbuf_free(&fs.pattern);
+    dir_cache_free(fs.cache);
+}
+
+void expand_command(shell *sh, arg_list *args, const ast_command *cmd)
+{
+    expand_words(sh, args, cmd->words, cmd->argc);
+}
+
+void expand_word_string(shell *sh, const ast_word *word, strbuf *out)
+{
+    const ast_word_part *part;
+    char numbuf[32];
+
+    if (word->parts == NULL) {
+        strbuf_join(out, word->text);
+        return;
+    }
+    for (part = word->parts; part != NULL; part = part->next) {
+        switch (part->type) {
+        case part_literal:
+            strbuf_join(out, part->text);
+            break;
+        case part_param:
+            if (is_param_list(part->text)) {
+                join_params(sh, out);
+            } else {
+                strbuf_join(out, param_value(sh, part->text, numbuf));
+            }
+            break;
+        case part_arith:
+            strbuf_join(out, arith_value(sh, part, numbuf));
+            break;
+        case part_command:
+            substitute(sh, part, out);
+            break;
+        case part_procsub_in:
+        case part_procsub_out:
+            start_procsub(sh, part, out);
+            break;
+        }
+    }
+}
+
+void expand_assignments(shell *sh, arg_list *env, const ast_command *cmd)
+{
+    strbuf assign;
+    int i;
+
+    strbuf_init(&assign, 64);
+    for (i = 0; i < cmd->assign_count; i++) {
+        strbuf_clear(&assign);
+        strbuf_join(&assign, cmd->assigns[i].name);
+        strbuf_append(&assign, '=');
+        expand_word_string(sh, &cmd->assigns[i].value, &assign);
+        arg_list_push(env, arg_list_copy(env, assign.chars, assign.len));
+    }
+    strbuf_free(&assign);
+}
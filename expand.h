@@ -0,0 +1,26 @@
+#ifndef EXPAND_SENTRY
+#define EXPAND_SENTRY
+#include "parser.h"
+#include "shell.h"
+#include "strbuf.h"
+
+
+typedef struct arg_block arg_block;
+
+typedef struct {
+    char **argv;
+    int argc, capacity;
+    arg_block *blocks;
+} arg_list;
+
+void arg_list_init(arg_list *args);
+void arg_list_free(arg_list *args);
+void arg_list_push(arg_list *args, char *arg);
+char *arg_list_copy(arg_list *args, const char *str, int len);
+void expand_command(shell *sh, arg_list *args, const ast_command *cmd);
+void expand_words(
+    shell *sh, arg_list *args, const ast_word *words, int count);
+void expand_assignments(shell *sh, arg_list *env, const ast_command *cmd);
+void expand_word_string(shell *sh, const ast_word *word, strbuf *out);
+
+#endif
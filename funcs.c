@@ -0,0 +1,117 @@
+#include "funcs.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+static unsigned hash_name(const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while (*name != '\0') {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+static func_entry **find_slot(const func_table *funcs, const char *name)
+{
+    func_entry **slot;
+
+    slot = &funcs->buckets[hash_name(name) & (funcs->bucket_count - 1)];
+    while (*slot != NULL && strcmp((*slot)->name, name) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void grow_table(func_table *funcs)
+{
+    func_entry **old = funcs->buckets;
+    int i, old_count = funcs->bucket_count;
+
+    funcs->bucket_count *= 2;
+    funcs->buckets = calloc(funcs->bucket_count, sizeof(func_entry *));
+    for (i = 0; i < old_count; i++) {
+        while (old[i] != NULL) {
+            func_entry *tmp = old[i];
+            unsigned h = hash_name(tmp->name) & (funcs->bucket_count - 1);
+
+            old[i] = tmp->next;
+            tmp->next = funcs->buckets[h];
+            funcs->buckets[h] = tmp;
+        }
+    }
+    free(old);
+}
+
+void funcs_init(func_table *funcs)
+{
+    funcs->bucket_count = 64;
+    funcs->count = 0;
+    funcs->buckets = calloc(funcs->bucket_count, sizeof(func_entry *));
+}
+
+void funcs_free(func_table *funcs)
+{
+    int i;
+
+    for (i = 0; i < funcs->bucket_count; i++) {
+        while (funcs->buckets[i] != NULL) {
+            func_entry *tmp = funcs->buckets[i];
+
+            funcs->buckets[i] = tmp->next;
+            func_body_release(tmp->body);
+            free(tmp->name);
+            free(tmp);
+        }
+    }
+    free(funcs->buckets);
+}
+
+func_body *func_find(const func_table *funcs, const char *name)
+{
+    func_entry *func;
+
+    func = *find_slot(funcs, name);
+    return func != NULL ? func->body : NULL;
+}
+
+/* The table shares the body with the definition node; the body of a
+ * replaced function is freed once nothing runs it any more. */
+void func_define(func_table *funcs, const char *name, func_body *body)
+{
+    func_entry **slot;
+
+    body->refs++;
+    slot = find_slot(funcs, name);
+    if (*slot != NULL) {
+        func_body_release((*slot)->body);
+        (*slot)->body = body;
+        return;
+    }
+    if (funcs->count >= funcs->bucket_count) {
+        grow_table(funcs);
+        slot = find_slot(funcs, name);
+    }
+    *slot = malloc(sizeof(func_entry));
+    (*slot)->name = strdup(name);
+    (*slot)->body = body;
+    (*slot)->next = NULL;
+    funcs->count++;
+}
+
+void func_unset(func_table *funcs, const char *name)
+{
+    func_entry **slot, *func;
+
+    slot = find_slot(funcs, name);
+    func = *slot;
+    if (func == NULL) {
+        return;
+    }
+    *slot = func->next;
+    func_body_release(func->body);
+    free(func->name);
+    free(func);
+    funcs->count--;
+}
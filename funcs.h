@@ -0,0 +1,23 @@
+#ifndef FUNCS_SENTRY
+#define FUNCS_SENTRY
+#include "parser.h"
+
+
+typedef struct func_entry_tag {
+    char *name;
+    func_body *body;
+    struct func_entry_tag *next;
+} func_entry;
+
+typedef struct {
+    func_entry **buckets;
+    int bucket_count, count;
+} func_table;
+
+void funcs_init(func_table *funcs);
+void funcs_free(func_table *funcs);
+func_body *func_find(const func_table *funcs, const char *name);
+void func_define(func_table *funcs, const char *name, func_body *body);
+void func_unset(func_table *funcs, const char *name);
+
+#endif
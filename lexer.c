@@ -1,4 +1,5 @@
 #include "lexer.h"
+#include "metrics.h"
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -39,14 +40,27 @@ static int str_to_int(const char *str, int *res)
     return 0;
 }
 
+void word_parts_free(word_part *head)
+{
+    while (head != NULL) {
+        word_part *tmp = head;
+
+        head = head->next;
+        free(tmp->text);
+        free(tmp);
+    }
+}
+
 void tokens_free(token_item *head)
 {
     while (head != NULL) {
         token_item *tmp = head;
 
         head = head->next;
-        if (tmp->type == token_word) {
+        if (tmp->type & (token_word | token_arith)) {
             free(tmp->str_val);
+            free(tmp->glob_val);
+            word_parts_free(tmp->parts);
         }
         free(tmp);
     }
@@ -72,19 +86,24 @@ static void append_int_token(
     token = malloc(sizeof(token_item));
     token->type = type;
     token->int_val = int_val;
+    token->glob_val = NULL;
+    token->parts = NULL;
     token->next = NULL;
     append_token(phead, ptail, token);
 }
 
 static void append_str_token(
-    token_item **phead, token_item **ptail,
-    enum token_type type, const char *str_val)
+    token_item **phead, token_item **ptail, enum token_type type,
+    const char *str_val, const char *glob_val, word_part *parts)
 {
     token_item *token;
 
     token = malloc(sizeof(token_item));
     token->type = type;
     token->str_val = strdup(str_val);
+    token->glob_val = glob_val != NULL ? strdup(glob_val) : NULL;
+    token->parts = parts;
+    token->assign_len = token->quoted = 0;
     token->next = NULL;
     append_token(phead, ptail, token);
 }
@@ -100,11 +119,65 @@ static void append_empty_token(
     append_token(phead, ptail, token);
 }
 
+static int is_glob_char(char ch)
+{
+    return ch == '*' || ch == '?' || ch == '[' || ch == ']' || ch == '\\';
+}
+
+static void push_part(
+    lexer *l, enum word_part_type type, int quoted, int start, int len)
+{
+    lexer_part *part;
+
+    if (l->part_count == l->part_capacity) {
+        l->part_capacity *= 2;
+        l->parts = realloc(l->parts, sizeof(lexer_part) * l->part_capacity);
+    }
+    part = &l->parts[l->part_count++];
+    part->type = type;
+    part->quoted = quoted;
+    part->start = start;
+    part->len = len;
+}
+
+/* Literal characters are grouped into runs of the same quoting so that
+ * words with expansions can be rebuilt part by part. */
+static void extend_literal_part(lexer *l, int quoted)
+{
+    lexer_part *last;
+
+    last = l->part_count > 0 ? &l->parts[l->part_count-1] : NULL;
+    if (last != NULL && last->type == part_literal && last->quoted == quoted) {
+        last->len++;
+        return;
+    }
+    push_part(l, part_literal, quoted, l->str_val.len - 1, 1);
+}
+
 static void append_in_str_token(lexer *l, enum token_type type, char ch)
 {
     l->have_token = 1;
     l->type = token_word;
     strbuf_append(&l->str_val, ch);
+    strbuf_append(&l->glob_val, ch);
+    extend_literal_part(l, 0);
+    if (ch == '*' || ch == '?' || ch == '[') {
+        l->have_glob = 1;
+    }
+}
+
+/* Quoted characters never act as pattern metacharacters, so they are
+ * escaped in the glob form of the word. */
+static void append_quoted(lexer *l, char ch)
+{
+    l->have_token = 1;
+    l->type = token_word;
+    strbuf_append(&l->str_val, ch);
+    extend_literal_part(l, 1);
+    if (is_glob_char(ch)) {
+        strbuf_append(&l->glob_val, '\\');
+    }
+    strbuf_append(&l->glob_val, ch);
 }
 
 static void set_empty_token(lexer *l, enum token_type type)
@@ -120,51 +193,356 @@ static void set_int_token(lexer *l, enum token_type type, int int_val)
     l->int_val = int_val;
 }
 
+static word_part *make_word_parts(lexer *l)
+{
+    word_part *head = NULL, **ptail = &head;
+    int i;
+
+    for (i = 0; i < l->part_count; i++) {
+        const lexer_part *lp = &l->parts[i];
+        const char *src;
+        word_part *part;
+
+        src = lp->type == part_literal ? l->str_val.chars : l->subst_text.chars;
+        part = malloc(sizeof(word_part));
+        part->type = lp->type;
+        part->quoted = lp->quoted;
+        part->text = strndup(src + lp->start, lp->len);
+        part->next = NULL;
+        *ptail = part;
+        ptail = &part->next;
+    }
+    return head;
+}
+
+static int has_quoted_part(const lexer *l)
+{
+    int i;
+
+    for (i = 0; i < l->part_count; i++) {
+        if (l->parts[i].quoted) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Length of a leading unquoted "name=" prefix, or 0. */
+static int assignment_len(const lexer *l)
+{
+    const char *str = l->str_val.chars;
+    int i, len;
+
+    if (l->part_count == 0 || l->parts[0].type != part_literal ||
+        l->parts[0].quoted || !(isalpha(str[0]) || str[0] == '_'))
+    {
+        return 0;
+    }
+    len = l->parts[0].len;
+    for (i = 1; i < len && (isalnum(str[i]) || str[i] == '_'); i++)
+        {}
+    return i < len && str[i] == '=' ? i + 1 : 0;
+}
+
 static void save_cur_token(lexer *l)
 {
     switch (l->type) {
     case token_word:
-        append_str_token(&l->head, &l->tail, l->type, l->str_val.chars);
+        append_str_token(
+            &l->head, &l->tail, l->type, l->str_val.chars,
+            l->have_glob && !l->have_expansion ? l->glob_val.chars : NULL,
+            l->have_expansion ? make_word_parts(l) : NULL
+        );
+        l->tail->assign_len = assignment_len(l);
+        l->tail->quoted = has_quoted_part(l);
+        break;
+    case token_arith:
+        append_str_token(&l->head, &l->tail, l->type, l->str_val.chars,
+                         NULL, NULL);
         break;
     case token_bg:              case token_and:       
     case token_pipe:            case token_or:       
     case token_semicolon:       case token_lparen:
-    case token_rparen:
+    case token_rparen:          case token_newline:
+    case token_fanout:          case token_comma:
+    case token_fanout_end:
         append_empty_token(&l->head, &l->tail, l->type);
         break;
     case token_redir_in:        case token_redir_out:
-    case token_redir_append:
+    case token_redir_append:    case token_redir_dup:
         append_int_token(&l->head, &l->tail, l->type, l->int_val);
         break;
     }
-    l->have_token = 0;
+    if (l->start_char == 0) {
+        l->start_line = l->line_num;
+        l->start_char = l->char_num;
+    }
+    l->tail->line_num = l->start_line;
+    l->tail->char_num = l->start_char;
+    l->start_char = 0;
+    l->have_token = l->have_glob = l->have_expansion = 0;
+    l->part_count = 0;
     strbuf_clear(&l->str_val);
+    strbuf_clear(&l->glob_val);
+    strbuf_clear(&l->subst_text);
 }
 
 void lexer_init(lexer *l)
 {
     strbuf_init(&l->str_val, 64);
-    l->line_num = 0;
+    strbuf_init(&l->glob_val, 64);
+    strbuf_init(&l->subst_text, 64);
+    l->part_capacity = 8;
+    l->parts = malloc(sizeof(lexer_part) * l->part_capacity);
+    l->line_num = 1;
+    l->char_num = 0;
 }
 
 void lexer_free(lexer *l)
 {
     strbuf_free(&l->str_val);
+    strbuf_free(&l->glob_val);
+    strbuf_free(&l->subst_text);
+    free(l->parts);
 }
 
 void lexer_start(lexer *l)
 {
     l->head = l->tail = NULL;
     strbuf_clear(&l->str_val);
-    l->have_token = l->eol = 0;
+    strbuf_clear(&l->glob_val);
+    strbuf_clear(&l->subst_text);
+    l->have_token = l->have_glob = l->have_expansion = l->eol = 0;
     l->in_squote = l->in_dquote = l->in_escape = 0;
-    l->line_num++;
-    l->char_num = 0;
+    l->part_count = 0;
+    l->subst = subst_none;
+    l->arith_command = 0;
+    l->fanout_depth = 0;
+    l->start_char = 0;
+    l->bytes_fed = 0;
+}
+
+/* Keeps the tokens read so far when a statement goes on to the next line. */
+void lexer_continue(lexer *l)
+{
+    l->eol = 0;
+}
+
+static void start_word(lexer *l)
+{
+    if (l->have_token && l->type != token_word) {
+        save_cur_token(l);
+    }
+    l->have_token = 1;
+    l->type = token_word;
+}
+
+static void start_substitution(lexer *l, char ch, int quoted)
+{
+    start_word(l);
+    l->subst = ch == '`' ? subst_backquote : subst_dollar;
+    l->subst_part = part_command;
+    l->subst_quoted = quoted;
+    l->subst_start = l->subst_text.len;
+    l->subst_depth = 0;
+    l->subst_squote = l->subst_dquote = l->subst_escape = 0;
+    l->subst_closing = 0;
+}
+
+/* <(list) and >(list) are read like $(list); the redirection operator
+ * that was pending turns into the start of a word. */
+static void start_process_substitution(lexer *l, enum word_part_type type)
+{
+    l->have_token = 0;
+    start_word(l);
+    l->subst = subst_command;
+    l->subst_part = type;
+    l->subst_quoted = 0;
+    l->subst_start = l->subst_text.len;
+    l->subst_depth = 1;
+    l->subst_squote = l->subst_dquote = l->subst_escape = 0;
+    l->subst_closing = 0;
+}
+
+/* ((expr)) as a command becomes a single token holding the expression. */
+static void start_arith_command(lexer *l)
+{
+    l->have_token = 0;
+    l->subst = subst_arith;
+    l->subst_quoted = 0;
+    l->subst_start = l->subst_text.len;
+    l->subst_depth = 0;
+    l->subst_closing = 0;
+    l->arith_command = 1;
+}
+
+static void finish_substitution(lexer *l, enum word_part_type type)
+{
+    push_part(l, type, l->subst_quoted, l->subst_start,
+              l->subst_text.len - l->subst_start);
+    l->have_expansion = 1;
+    l->subst = subst_none;
+}
+
+static void finish_arith(lexer *l)
+{
+    if (!l->arith_command) {
+        finish_substitution(l, part_arith);
+        return;
+    }
+    l->arith_command = 0;
+    l->subst = subst_none;
+    strbuf_join(&l->str_val, l->subst_text.chars + l->subst_start);
+    set_empty_token(l, token_arith);
+    save_cur_token(l);
+}
+
+static void lone_dollar(lexer *l)
+{
+    l->subst = subst_none;
+    if (l->subst_quoted) {
+        append_quoted(l, '$');
+    } else {
+        append_in_str_token(l, token_word, '$');
+    }
+}
+
+/* Collects the source of $(...) up to the matching parenthesis, skipping
+ * parentheses that are quoted or escaped inside it. */
+static void command_substitution(lexer *l, char ch)
+{
+    if (l->subst_escape) {
+        l->subst_escape = 0;
+    } else if (l->subst_squote) {
+        l->subst_squote = ch != '\'';
+    } else if (ch == '\\') {
+        l->subst_escape = 1;
+    } else if (l->subst_dquote) {
+        l->subst_dquote = ch != '"';
+    } else if (ch == '\'') {
+        l->subst_squote = 1;
+    } else if (ch == '"') {
+        l->subst_dquote = 1;
+    } else if (ch == '(') {
+        l->subst_depth++;
+    } else if (ch == ')' && --l->subst_depth == 0) {
+        finish_substitution(l, l->subst_part);
+        return;
+    }
+    strbuf_append(&l->subst_text, ch);
+}
+
+static void backquote_substitution(lexer *l, char ch)
+{
+    if (l->subst_escape) {
+        if (ch != '$' && ch != '`' && ch != '\\') {
+            strbuf_append(&l->subst_text, '\\');
+        }
+        strbuf_append(&l->subst_text, ch);
+        l->subst_escape = 0;
+    } else if (ch == '\\') {
+        l->subst_escape = 1;
+    } else if (ch == '`') {
+        finish_substitution(l, part_command);
+    } else {
+        strbuf_append(&l->subst_text, ch);
+    }
+}
+
+/* The expression ends at the first "))" outside nested parentheses. */
+static void arith_substitution(lexer *l, char ch)
+{
+    if (l->subst_closing) {
+        l->subst_closing = 0;
+        if (ch == ')') {
+            finish_arith(l);
+            return;
+        }
+        strbuf_append(&l->subst_text, ')');
+    }
+    if (ch == '(') {
+        l->subst_depth++;
+    } else if (ch == ')') {
+        if (l->subst_depth == 0) {
+            l->subst_closing = 1;
+            return;
+        }
+        l->subst_depth--;
+    }
+    strbuf_append(&l->subst_text, ch);
+}
+
+/* Returns 0 when ch ends a substitution without being part of it and
+ * has to be lexed as usual. */
+static int substitution(lexer *l, char ch)
+{
+    switch (l->subst) {
+    case subst_none:
+        return 0;
+    case subst_dollar:
+        if (ch == '(') {
+            l->subst = subst_command;
+            l->subst_depth = 1;
+        } else if (ch == '{') {
+            l->subst = subst_brace;
+        } else if (isalpha(ch) || ch == '_') {
+            l->subst = subst_name;
+            strbuf_append(&l->subst_text, ch);
+        } else if (ch != '\0' && strchr("?$#!@*-0123456789", ch) != NULL) {
+            strbuf_append(&l->subst_text, ch);
+            finish_substitution(l, part_param);
+        } else {
+            lone_dollar(l);
+            return 0;
+        }
+        return 1;
+    case subst_name:
+        if (isalnum(ch) || ch == '_') {
+            strbuf_append(&l->subst_text, ch);
+            return 1;
+        }
+        finish_substitution(l, part_param);
+        return 0;
+    case subst_brace:
+        if (ch == '}') {
+            finish_substitution(l, part_param);
+        } else {
+            strbuf_append(&l->subst_text, ch);
+        }
+        return 1;
+    case subst_command:
+        if (ch == '(' && l->subst_part == part_command &&
+            l->subst_text.len == l->subst_start)
+        {
+            l->subst = subst_arith;
+            l->subst_depth = 0;
+            return 1;
+        }
+        command_substitution(l, ch);
+        return 1;
+    case subst_arith:
+        arith_substitution(l, ch);
+        return 1;
+    case subst_backquote:
+        backquote_substitution(l, ch);
+        return 1;
+    }
+    return 0;
 }
 
 enum lexer_error lexer_end(lexer *l, token_item **phead)
 {
+    /* a statement going on to the next line ends here once per line */
+    METRICS_ADD(bytes_lexed, l->bytes_fed);
+    l->bytes_fed = 0;
     *phead = l->head;
+    if (l->subst == subst_name) {
+        finish_substitution(l, part_param);
+    } else if (l->subst == subst_dollar) {
+        lone_dollar(l);
+    } else if (l->subst != subst_none) {
+        return lexer_unclosed_substitution;
+    }
     if (l->in_squote || l->in_dquote) {
         return lexer_unclosed_quote;
     }
@@ -181,9 +559,11 @@ enum lexer_error lexer_end(lexer *l, token_item **phead)
 static void escaping(lexer *l, char ch)
 {
     if (ch == '\n') {
+        l->in_escape = 0;
         return;
     }
-    append_in_str_token(l, token_word, ch);
+    start_word(l);
+    append_quoted(l, ch);
     l->in_escape = 0;
 }
 
@@ -192,13 +572,16 @@ static void in_quote(lexer *l, int *quote_flag, char quote, char ch)
     l->have_token = 1;
     if (ch == quote) {
         *quote_flag = 0;
+    } else if (quote == '"' && (ch == '$' || ch == '`')) {
+        start_substitution(l, ch, 1);
     } else {
-        append_in_str_token(l, token_word, ch);
+        append_quoted(l, ch);
     }
 }
 
 static void greater_operator(lexer *l)
 {
+    l->redir_bare = 1;
     if (!l->have_token) {
         set_int_token(l, token_redir_out, 1);
         return;
@@ -208,12 +591,13 @@ static void greater_operator(lexer *l)
         save_cur_token(l);
         return;
     }
-    if (l->type == token_word) {
+    if (l->type == token_word && !l->have_expansion) {
         int status, int_val;
 
         status = str_to_int(l->str_val.chars, &int_val);
         if (status == 0 && int_val >= 0) {
             set_int_token(l, token_redir_out, int_val);
+            l->redir_bare = 0;
             return;
         }
     }
@@ -223,16 +607,18 @@ static void greater_operator(lexer *l)
 
 static void less_operator(lexer *l)
 {
+    l->redir_bare = 1;
     if (!l->have_token) {
         set_int_token(l, token_redir_in, 0);
         return;
     }
-    if (l->type == token_word) {
+    if (l->type == token_word && !l->have_expansion) {
         int status, int_val;
 
         status = str_to_int(l->str_val.chars, &int_val);
         if (status == 0 && int_val >= 0) {
             set_int_token(l, token_redir_in, int_val);
+            l->redir_bare = 0;
             return;
         }
     }
@@ -266,9 +652,7 @@ static void doubleable_operator(
 
 static void word(lexer *l, char ch)
 {
-    if (l->have_token && l->type != token_word) {
-        save_cur_token(l);
-    }
+    start_word(l);
     append_in_str_token(l, token_word, ch);
 }
 
@@ -279,23 +663,62 @@ static void space(lexer *l)
     }
 }
 
-void lexer_feed(lexer *l, char ch)
+static void newline(lexer *l)
 {
-    l->char_num++;
+    single_operator(l, token_newline);
+    l->eol = 1;
+}
+
+static void feed_char(lexer *l, char ch)
+{
+    if (substitution(l, ch)) {
+        return;
+    }
+    if (l->have_token && l->type == token_lparen) {
+        if (ch == '(') {
+            start_arith_command(l);
+            return;
+        }
+        save_cur_token(l);
+    }
+    if (l->have_token && l->type == token_pipe && ch == '{') {
+        set_empty_token(l, token_fanout);
+        save_cur_token(l);
+        l->fanout_depth++;
+        return;
+    }
+    if (l->have_token && ch == '&' && !l->in_escape &&
+        (l->type == token_redir_in || l->type == token_redir_out))
+    {
+        set_int_token(l, token_redir_dup, l->int_val);
+        l->redir_bare = 0;
+        return;
+    }
+    if (l->have_token && l->redir_bare && ch == '(' && !l->in_escape &&
+        (l->type == token_redir_in || l->type == token_redir_out))
+    {
+        start_process_substitution(l, l->type == token_redir_in
+                                   ? part_procsub_in : part_procsub_out);
+        return;
+    }
     if (l->in_escape) {
         escaping(l, ch);
+    } else if (l->in_squote) {
+        in_quote(l, &l->in_squote, '\'', ch);
     } else if (ch == '\\') {
         l->in_escape = 1;
-    } else if (ch == '\n') {
-        l->eol = 1;
     } else if (l->in_dquote) {
         in_quote(l, &l->in_dquote, '"', ch);
+    } else if (ch == '\n') {
+        newline(l);
     } else if (ch == '"') {
+        start_word(l);
         l->in_dquote = 1;
-    } else if (l->in_squote) {
-        in_quote(l, &l->in_squote, '\'', ch);
     } else if (ch == '\'') {
+        start_word(l);
         l->in_squote = 1;
+    } else if (ch == '$' || ch == '`') {
+        start_substitution(l, ch, 0);
     } else if (isspace(ch)) {
         space(l);
     } else if (ch == '&') {
@@ -309,14 +732,44 @@ void lexer_feed(lexer *l, char ch)
     } else if (ch == '<') {
         less_operator(l);
     } else if (ch == '(') {
-        single_operator(l, token_lparen);
+        if (l->have_token) {
+            save_cur_token(l);
+        }
+        set_empty_token(l, token_lparen);
     } else if (ch == ')') {
         single_operator(l, token_rparen);
+    } else if (l->fanout_depth > 0 && ch == ',' &&
+               !(l->have_token && l->type == token_word))
+    {
+        single_operator(l, token_comma);
+    } else if (l->fanout_depth > 0 && ch == '}' &&
+               !(l->have_token && l->type == token_word))
+    {
+        single_operator(l, token_fanout_end);
+        l->fanout_depth--;
     } else {
         word(l, ch);
     }
 }
 
+/* Positions count from 1 and follow every byte fed, newlines included,
+ * so they stay right across continued lines and whole files. A token
+ * starts at the byte that first made the lexer hold it. */
+void lexer_feed(lexer *l, char ch)
+{
+    l->char_num++;
+    l->bytes_fed++;
+    feed_char(l, ch);
+    if (l->have_token && l->start_char == 0) {
+        l->start_line = l->line_num;
+        l->start_char = l->char_num;
+    }
+    if (ch == '\n') {
+        l->line_num++;
+        l->char_num = 0;
+    }
+}
+
 const char* token_name(enum token_type type)
 {
     switch (type) {
@@ -342,6 +795,18 @@ const char* token_name(enum token_type type)
         return ">";
     case token_redir_append:  
         return ">>";
+    case token_arith:
+        return "((";
+    case token_newline:
+        return "newline";
+    case token_fanout:
+        return "|{";
+    case token_comma:
+        return ",";
+    case token_fanout_end:
+        return "}";
+    case token_redir_dup:
+        return ">&";
     }
     return NULL;
 }
@@ -355,6 +820,8 @@ const char* lexer_error_msg(enum lexer_error err)
         return "unclosed quote";
     case lexer_unfinished_escaping:
         return "unfinished escaping";
+    case lexer_unclosed_substitution:
+        return "unclosed substitution";
     }
     return NULL;
 }
@@ -368,6 +835,7 @@ int is_token_redir(const token_item *token)
 {
     return is_token_type(
         token,
-        token_redir_in | token_redir_out | token_redir_append
+        token_redir_in | token_redir_out | token_redir_append |
+        token_redir_dup
     );
 }
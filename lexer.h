@@ -15,7 +15,30 @@ enum token_type {
     token_rparen        = 1<<7, /* )  */
     token_redir_in      = 1<<8, /* <  */
     token_redir_out     = 1<<9, /* >  */
-    token_redir_append  = 1<<10 /* >> */
+    token_redir_append  = 1<<10,/* >> */
+    token_arith         = 1<<11,/* (( )) */
+    token_newline       = 1<<12,
+    token_fanout        = 1<<13,/* |{ */
+    token_comma         = 1<<14,/* , between fan-out branches */
+    token_fanout_end    = 1<<15,/* } closing a fan-out */
+    token_redir_dup     = 1<<16 /* >& <& */
+};
+
+enum word_part_type {
+    part_literal,
+    part_param,         /* $name, ${name} */
+    part_command,       /* $(...), `...` */
+    part_arith,         /* $((...)) */
+    part_procsub_in,    /* <(...) */
+    part_procsub_out    /* >(...) */
+};
+
+typedef struct word_part word_part;
+struct word_part {
+    enum word_part_type type;
+    int quoted;
+    char *text;
+    word_part *next;
 };
 
 typedef struct token_item token_item;
@@ -24,29 +47,60 @@ struct token_item {
         char *str_val;
         int int_val;
     };
+    char *glob_val;
+    word_part *parts;
+    int assign_len, quoted;
+    int line_num, char_num;     /* where the token starts */
     enum token_type type;
     token_item *next;
 };
 enum lexer_error {
     lexer_ok = 0,
     lexer_unclosed_quote = -1,
-    lexer_unfinished_escaping = -2
+    lexer_unfinished_escaping = -2,
+    lexer_unclosed_substitution = -3
 };
 
+enum subst_state {
+    subst_none,
+    subst_dollar,
+    subst_name,
+    subst_brace,
+    subst_command,
+    subst_backquote,
+    subst_arith
+};
+
+typedef struct {
+    enum word_part_type type;
+    int quoted, start, len;
+} lexer_part;
+
 typedef struct {
     token_item *head, *tail;
-    strbuf str_val;
-    int int_val;
+    strbuf str_val, glob_val, subst_text;
+    int int_val, have_glob, redir_bare;
     enum token_type type;
     int have_token, eol;
     int in_squote, in_dquote, in_escape;
-    int line_num, char_num;
+    lexer_part *parts;
+    int part_count, part_capacity, have_expansion;
+    enum subst_state subst;
+    enum word_part_type subst_part;
+    int subst_quoted, subst_start, subst_depth;
+    int subst_squote, subst_dquote, subst_escape;
+    int subst_closing, arith_command;
+    int fanout_depth;
+    int line_num, char_num, start_line, start_char;
+    long bytes_fed;
 } lexer;
 
+void word_parts_free(word_part *head);
 void tokens_free(token_item *tokens);
 void lexer_init(lexer *l);
 void lexer_free(lexer *l);
 void lexer_start(lexer *l);
+void lexer_continue(lexer *l);
 enum lexer_error lexer_end(lexer *l, token_item **phead);
 void lexer_feed(lexer *l, char ch);
 const char* token_name(enum token_type type);
@@ -0,0 +1,147 @@
+#include "libshellma.h"
+#include "shell.h"
+#include "parser.h"
+#include "compile.h"
+#include "executor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+
+enum { lowest_free_fd = 3 };
+
+struct shellma {
+    shell sh;
+};
+
+struct shellma_script {
+    ast_list_node *stmts;
+    vm_program *prog;
+};
+
+extern char **environ;
+
+shellma *shellma_new()
+{
+    shellma *ctx = malloc(sizeof(shellma));
+
+    init_shell_state(&ctx->sh);
+    return ctx;
+}
+
+void shellma_free(shellma *ctx)
+{
+    free_shell(&ctx->sh);
+    free(ctx);
+}
+
+/* On a syntax error *error, if asked for, gets a message the caller
+ * frees, as LINE:CHAR: followed by the error. */
+shellma_script *shellma_parse(const char *src, char **error)
+{
+    shellma_script *script;
+    ast_list_node *stmts;
+    char *message;
+
+    if (parse_text(&stmts, src, strlen(src), &message) != 0) {
+        if (error != NULL) {
+            *error = message;
+        } else {
+            free(message);
+        }
+        return NULL;
+    }
+    script = malloc(sizeof(shellma_script));
+    script->stmts = stmts;
+    script->prog = compile_list(stmts);
+    return script;
+}
+
+void shellma_script_free(shellma_script *script)
+{
+    if (script == NULL) {
+        return;
+    }
+    program_free(script->prog);
+    ast_list_free(script->stmts);
+    free(script);
+}
+
+/* The descriptors are moved out of the way first, so that they may be
+ * given in any order, the standard ones included. */
+static void adopt_stdio(const int fds[3])
+{
+    int moved[3], i;
+
+    for (i = 0; i < 3; i++) {
+        moved[i] = fcntl(fds[i], F_DUPFD, lowest_free_fd);
+        if (moved[i] == -1) {
+            _exit(126);
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        dup2(moved[i], i);
+        close(moved[i]);
+    }
+}
+
+static void run_child(shell *sh, const shellma_script *script,
+                      const int fds[3], char **env, const sigset_t *mask)
+{
+    /* sh->pid stays the host's, so the run leaves with _exit and never
+     * flushes the host's stdio buffers or runs its atexit handlers */
+    reset_signals();
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    enable_zombie_cleanup();
+    if (fds != NULL) {
+        adopt_stdio(fds);
+    }
+    if (env != NULL) {
+        environ = env;
+        vars_free(&sh->vars);
+        vars_init(&sh->vars);
+    }
+    sh->pgid = getpgid(0);
+    execute_program(sh, script->prog);
+    exit_shell(sh, sh->last_status);
+}
+
+/* Runs the script on fds (stdin, stdout and stderr, or the host's own
+ * if NULL) with env as the environment (or the host's if NULL). Returns
+ * 0 once res holds the exit status and the resources the run used, and
+ * -1 if it could not be started. */
+int shellma_run(shellma *ctx, const shellma_script *script, const int fds[3],
+                char **env, shellma_result *res)
+{
+    sigset_t chld, saved;
+    int pid, status, got;
+
+    /* the host could otherwise reap the child before we do */
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld, &saved);
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        run_child(&ctx->sh, script, fds, env, &saved);
+    }
+    if (pid == -1) {
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        return -1;
+    }
+    do {
+        got = wait4(pid, &status, 0, &res->usage);
+    } while (got == -1 && errno == EINTR);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (got == -1) {
+        return -1;
+    }
+    res->status = WIFEXITED(status) ? WEXITSTATUS(status)
+        : 128 + WTERMSIG(status);
+    return 0;
+}
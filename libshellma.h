@@ -0,0 +1,29 @@
+#ifndef LIBSHELLMA_SENTRY
+#define LIBSHELLMA_SENTRY
+#include <sys/resource.h>
+
+#define SHELLMA_API __attribute__((visibility("default")))
+
+
+/* The shell as a library. A context holds the shell state scripts start
+ * from; a script is parsed and compiled once and can be run any number
+ * of times. Each run takes place in a forked child, like a subshell of
+ * the host, so nothing it does reaches the host process, and the host
+ * keeps its signal handlers and terminal. */
+typedef struct shellma shellma;
+typedef struct shellma_script shellma_script;
+
+typedef struct {
+    int status;
+    struct rusage usage;
+} shellma_result;
+
+SHELLMA_API shellma *shellma_new();
+SHELLMA_API void shellma_free(shellma *sh);
+SHELLMA_API shellma_script *shellma_parse(const char *src, char **error);
+SHELLMA_API void shellma_script_free(shellma_script *script);
+SHELLMA_API int shellma_run(shellma *sh, const shellma_script *script,
+                            const int fds[3], char **env,
+                            shellma_result *res);
+
+#endif
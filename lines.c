@@ -0,0 +1,163 @@
+#include "lines.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+
+static int retry_read(int fd, char *buf, int len)
+{
+    int n;
+
+    do {
+        n = read(fd, buf, len);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+/* A regular file is read a block at a time and the offset put back to
+ * just past the line, so whoever reads the file next starts there. */
+static int read_line_seekable(int fd, strbuf *line)
+{
+    char buf[line_block];
+    const char *nl;
+    int n;
+
+    for (;;) {
+        n = retry_read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            return n == 0 ? 0 : -1;
+        }
+        nl = memchr(buf, '\n', n);
+        if (nl != NULL) {
+            strbuf_append_mem(line, buf, nl - buf);
+            return lseek(fd, nl - buf + 1 - n, SEEK_CUR) == -1 ? -1 : 1;
+        }
+        strbuf_append_mem(line, buf, n);
+    }
+}
+
+/* Data peeked at on a socket stays queued, so only the line is taken. */
+static int read_line_socket(int fd, strbuf *line)
+{
+    char buf[line_block];
+    const char *nl;
+    int n, len;
+
+    for (;;) {
+        do {
+            n = recv(fd, buf, sizeof(buf), MSG_PEEK);
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0) {
+            return n == 0 ? 0 : -1;
+        }
+        nl = memchr(buf, '\n', n);
+        len = nl != NULL ? nl - buf + 1 : n;
+        if (retry_read(fd, buf, len) != len) {
+            return -1;
+        }
+        strbuf_append_mem(line, buf, nl != NULL ? len - 1 : len);
+        if (nl != NULL) {
+            return 1;
+        }
+    }
+}
+
+/* Nothing read from a pipe or a terminal can be given back, so there
+ * the line is read a byte at a time. */
+static int read_line_bytes(int fd, strbuf *line)
+{
+    char ch;
+    int n;
+
+    for (;;) {
+        n = retry_read(fd, &ch, 1);
+        if (n <= 0) {
+            return n == 0 ? 0 : -1;
+        }
+        if (ch == '\n') {
+            return 1;
+        }
+        strbuf_append(line, ch);
+    }
+}
+
+/* Appends the next line of fd to line without its newline. Returns 1
+ * for a whole line, 0 at the end of input and -1 on an error; nothing
+ * past the newline is consumed. */
+int read_line(int fd, strbuf *line)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == 0) {
+        if (S_ISREG(st.st_mode)) {
+            return read_line_seekable(fd, line);
+        }
+        if (S_ISSOCK(st.st_mode)) {
+            return read_line_socket(fd, line);
+        }
+    }
+    return read_line_bytes(fd, line);
+}
+
+/* Appends everything left in fd, sized up front for a regular file. */
+int read_rest(int fd, strbuf *text)
+{
+    struct stat st;
+    off_t offset;
+    int n;
+
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > offset)
+    {
+        strbuf_reserve(text, st.st_size - offset + 1);
+    }
+    for (;;) {
+        strbuf_reserve(text, line_block);
+        n = retry_read(fd, text->chars + text->len,
+                       text->capacity - text->len - 1);
+        if (n <= 0) {
+            text->chars[text->len] = '\0';
+            return n == 0 ? 0 : -1;
+        }
+        text->len += n;
+    }
+}
+
+/* Cuts text into lines with one scan for newlines. The result is a
+ * single block: the NULL-terminated pointers, then the lines. */
+char **split_lines(const char *text, int len, int keep_newline, int *count)
+{
+    const char *p, *end = text + len, *nl;
+    char **lines, *dst;
+    int n = 0, i;
+
+    for (p = text; p < end; p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        n++;
+        if (nl == NULL) {
+            break;
+        }
+    }
+    lines = malloc(sizeof(char *) * (n + 1) + len + n);
+    dst = (char *)(lines + n + 1);
+    for (i = 0, p = text; i < n; i++, p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            nl = end;
+        }
+        lines[i] = dst;
+        memcpy(dst, p, nl - p);
+        dst += nl - p;
+        if (keep_newline && nl < end) {
+            *dst++ = '\n';
+        }
+        *dst++ = '\0';
+    }
+    lines[n] = NULL;
+    *count = n;
+    return lines;
+}
@@ -0,0 +1,12 @@
+#ifndef LINES_SENTRY
+#define LINES_SENTRY
+#include "strbuf.h"
+
+
+enum { line_block = 4096 };
+
+int read_line(int fd, strbuf *line);
+int read_rest(int fd, strbuf *text);
+char **split_lines(const char *text, int len, int keep_newline, int *count);
+
+#endif
@@ -1,23 +1,31 @@
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include "wrappers.h"
 #include "lexer.h"
 #include "parser.h"
 #include "executor.h"
+#include "server.h"
+#include "check.h"
+#include "optimize.h"
+#include "capture.h"
 #ifdef DEBUG
 #include "debug.h"
 #endif
 
 
-int read_tokens(lexer *lex, token_item **ptoks, int *ch)
+int read_tokens(lexer *lex, token_item **ptoks, int *ch, capture *cap)
 {
     printf("> ");
-    lexer_start(lex);
     for (;;) {
         errno = 0;
         *ch = fgetc(stdin);
         if (*ch != EOF) {
             lexer_feed(lex, *ch);
+            if (cap != NULL) {
+                capture_char(cap, *ch);
+            }
             if (lex->eol) {
                 break;
             }
@@ -33,35 +41,100 @@ int read_tokens(lexer *lex, token_item **ptoks, int *ch)
     return lexer_end(lex, ptoks);
 }
 
+/* Reads lines until they make up complete statements, so compound
+ * commands and trailing operators can continue on the next line. */
+int read_statements(lexer *lex, token_item **ptoks, ast_list_node **pstmts,
+                    int *ch, capture *cap)
+{
+    token_item *err_pos;
+    int status;
+
+    *pstmts = NULL;
+    lexer_start(lex);
+    for (;;) {
+        status = read_tokens(lex, ptoks, ch, cap);
+        if (status != 0) {
+            fprintf(stderr, "lexer error: %s\n", lexer_error_msg(status));
+            return status;
+        }
+        status = parse(pstmts, *ptoks, &err_pos);
+        if (status == 0) {
+            return 0;
+        }
+        if (err_pos != NULL || *ch == EOF) {
+            fprintf(stderr, "syntax error near %s\n", err_pos == NULL
+                    ? "end of file" : token_name(err_pos->type));
+            return status;
+        }
+        lexer_continue(lex);
+    }
+}
+
 int main(int argc, const char **argv)
 {
     lexer lex;
     ast_list_node *statements;
     shell sh;
-    token_item *err_pos, *tokens;
+    token_item *tokens;
+    capture cap, *pcap = NULL;
+    const char *path;
     int status, last_char = 0;
+#ifdef DEBUG
+    vm_program *program;
+#endif
 
+    if (argc > 1 && strcmp(argv[1], "--client") == 0) {
+        return client_main(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+        return check_main(argc - 2, argv + 2);
+    }
     init_shell(&sh);
+    if (argc > 2 && strcmp(argv[1], "--server") == 0) {
+        status = server_main(&sh, argv[2]);
+        free_shell(&sh);
+        return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0) {
+        status = replay_main(&sh, argc - 2, argv + 2);
+        free_shell(&sh);
+        return status;
+    }
+    /* $SHELLMA_CAPTURE records every statement read at the prompt */
+    path = var_get(&sh.vars, "SHELLMA_CAPTURE");
+    if (path != NULL && *path != '\0' && capture_open(&cap, path) == 0) {
+        pcap = &cap;
+    }
     lexer_init(&lex);
     for (;;) {
-        status = read_tokens(&lex, &tokens, &last_char);
+        status = read_statements(&lex, &tokens, &statements, &last_char,
+                                 pcap);
         if (status != 0) {
-            fprintf(stderr, "lexer error: %s\n", lexer_error_msg(status));
+            if (pcap != NULL) {
+                capture_statement(pcap, 2);
+            }
             goto cleanup;
         }
-
-        status = parse(&statements, tokens, &err_pos);
-        if (status != 0) {
-            fprintf(stderr, "syntax error near %s\n",
-                    err_pos == NULL ? "end of line" : token_name(err_pos->type));
-            goto cleanup;
+        if (optimize_wanted(&sh.vars)) {
+            optimize_ast(statements, &sh.funcs, isatty(1));
         }
+        if (pcap != NULL) {
+            capture_begin_run(pcap);
+        }
+        /* before a redirection of the statement moves stdout elsewhere */
+        fflush(stdout);
         execute(&sh, statements); 
+        if (pcap != NULL) {
+            capture_statement(pcap, sh.last_status);
+        }
         printf("Status=%d\n", sh.last_status);
 #ifdef DEBUG
         putchar('\n');
         log_tokens(stdout, tokens);
         log_ast(stdout, statements);
+        program = compile_list(statements);
+        log_program(stdout, program);
+        program_free(program);
 #endif
 cleanup:
         tokens_free(tokens);
@@ -71,6 +144,11 @@ cleanup:
         }
     }
     putchar('\n');
+    save_metrics(&sh);
+    if (pcap != NULL) {
+        capture_close(pcap);
+    }
     lexer_free(&lex);
+    free_shell(&sh);
     return 0;
 }
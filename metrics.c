@@ -0,0 +1,193 @@
+#include "metrics.h"
+#include "wrappers.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+
+static shell_metrics local_metrics;
+shell_metrics *metrics = &local_metrics;
+
+/* Upper bounds of the wait latency buckets, in nanoseconds; the last
+ * bucket takes the rest. */
+static const long long wait_bounds[wait_bucket_count - 1] = {
+    1000000LL, 10000000LL, 100000000LL, 1000000000LL,
+    10000000000LL, 60000000000LL
+};
+
+static const struct {
+    const char *name, *help;
+    int offset;
+} counters[] = {
+    { "forks", "Processes forked",
+      offsetof(shell_metrics, forks) },
+    { "execs", "External commands executed",
+      offsetof(shell_metrics, execs) },
+    { "scripts", "Scripts run in the forked child instead of exec",
+      offsetof(shell_metrics, scripts) },
+    { "builtins", "Builtins run",
+      offsetof(shell_metrics, builtins) },
+    { "functions", "Shell function calls",
+      offsetof(shell_metrics, functions) },
+    { "pipelines", "Pipelines started",
+      offsetof(shell_metrics, pipelines) },
+    { "coprocs", "Coprocesses started",
+      offsetof(shell_metrics, coprocs) },
+    { "redirections", "Files opened for redirections",
+      offsetof(shell_metrics, redirections) },
+    { "lexed_bytes", "Bytes of input lexed",
+      offsetof(shell_metrics, bytes_lexed) },
+    { "parses", "Parser runs",
+      offsetof(shell_metrics, parses) }
+};
+
+void metrics_init()
+{
+    void *page;
+
+    page = mmap(NULL, sizeof(shell_metrics), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (page != MAP_FAILED) {
+        memcpy(page, &local_metrics, sizeof(shell_metrics));
+        metrics = page;
+    }
+}
+
+long long metrics_clock_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void metrics_record_wait(long long ns)
+{
+    int i;
+
+    for (i = 0; i < wait_bucket_count - 1 && ns > wait_bounds[i]; i++)
+        {}
+    METRICS_ADD(wait_buckets[i], 1);
+    METRICS_ADD(waits, 1);
+    METRICS_ADD(wait_ns, ns);
+}
+
+static void append_format(strbuf *out, const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    strbuf_append_mem(out, buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+static unsigned long long counter_value(int i)
+{
+    return *(unsigned long long *)((char *)metrics + counters[i].offset);
+}
+
+static void format_plain(strbuf *out)
+{
+    unsigned long long cumulative = 0;
+    int i;
+
+    for (i = 0; i < sizeof(counters) / sizeof(*counters); i++) {
+        append_format(out, "%-14s%llu\n", counters[i].name, counter_value(i));
+    }
+    append_format(out, "%-14s%.6fs\n", "parse_time", metrics->parse_ns / 1e9);
+    append_format(out, "%-14s%llu, %.6fs\n", "waits",
+                  metrics->waits, metrics->wait_ns / 1e9);
+    for (i = 0; i < wait_bucket_count; i++) {
+        cumulative += metrics->wait_buckets[i];
+        if (i < wait_bucket_count - 1) {
+            append_format(out, "  <= %-8g%llu\n",
+                          wait_bounds[i] / 1e9, cumulative);
+        } else {
+            append_format(out, "  <= %-8s%llu\n", "inf", cumulative);
+        }
+    }
+}
+
+static void format_prometheus(strbuf *out)
+{
+    unsigned long long cumulative = 0;
+    int i;
+
+    for (i = 0; i < sizeof(counters) / sizeof(*counters); i++) {
+        append_format(out, "# HELP shellma_%s_total %s.\n"
+                      "# TYPE shellma_%s_total counter\n"
+                      "shellma_%s_total %llu\n",
+                      counters[i].name, counters[i].help, counters[i].name,
+                      counters[i].name, counter_value(i));
+    }
+    append_format(out, "# HELP shellma_parse_seconds_total "
+                  "Time spent parsing.\n"
+                  "# TYPE shellma_parse_seconds_total counter\n"
+                  "shellma_parse_seconds_total %.9f\n",
+                  metrics->parse_ns / 1e9);
+    append_format(out, "# HELP shellma_wait_seconds "
+                  "Foreground job wait latency.\n"
+                  "# TYPE shellma_wait_seconds histogram\n");
+    for (i = 0; i < wait_bucket_count; i++) {
+        cumulative += metrics->wait_buckets[i];
+        if (i < wait_bucket_count - 1) {
+            append_format(out, "shellma_wait_seconds_bucket{le=\"%g\"} %llu\n",
+                          wait_bounds[i] / 1e9, cumulative);
+        } else {
+            append_format(out, "shellma_wait_seconds_bucket{le=\"+Inf\"} "
+                          "%llu\n", cumulative);
+        }
+    }
+    append_format(out, "shellma_wait_seconds_sum %.9f\n"
+                  "shellma_wait_seconds_count %llu\n",
+                  metrics->wait_ns / 1e9, metrics->waits);
+}
+
+void metrics_format(strbuf *out, int prometheus)
+{
+    if (prometheus) {
+        format_prometheus(out);
+    } else {
+        format_plain(out);
+    }
+}
+
+/* Writes a temporary file next to path and renames it over, so that a
+ * scraper never sees a half written file. */
+int metrics_save(const char *path)
+{
+    strbuf text, tmp;
+    FILE *f;
+    int ok;
+
+    strbuf_init(&text, 4096);
+    strbuf_clear(&text);
+    format_prometheus(&text);
+    strbuf_init(&tmp, 256);
+    strbuf_clear(&tmp);
+    strbuf_join(&tmp, path);
+    strbuf_join(&tmp, ".tmp");
+    f = fopen(tmp.chars, "w");
+    ok = f != NULL;
+    if (ok) {
+        ok = fwrite(text.chars, 1, text.len, f) == text.len;
+        ok = fclose(f) == 0 && ok;
+    }
+    if (ok) {
+        ok = rename(tmp.chars, path) == 0;
+    }
+    if (!ok) {
+        log_error("%s: %s", path, strerror(errno));
+        remove(tmp.chars);
+    }
+    strbuf_free(&tmp);
+    strbuf_free(&text);
+    return ok ? 0 : -1;
+}
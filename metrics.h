@@ -0,0 +1,28 @@
+#ifndef METRICS_SENTRY
+#define METRICS_SENTRY
+#include "strbuf.h"
+
+
+enum { wait_bucket_count = 7 };
+
+/* Counters live in a page shared with every child the shell forks, so
+ * work done in pipeline stages and subshells is counted as well. */
+typedef struct {
+    unsigned long long forks, execs, scripts, builtins, functions, pipelines;
+    unsigned long long coprocs;
+    unsigned long long redirections, bytes_lexed, parses, parse_ns;
+    unsigned long long waits, wait_ns, wait_buckets[wait_bucket_count];
+} shell_metrics;
+
+extern shell_metrics *metrics;
+
+#define METRICS_ADD(field, n) \
+    __atomic_fetch_add(&metrics->field, (n), __ATOMIC_RELAXED)
+
+void metrics_init();
+long long metrics_clock_ns();
+void metrics_record_wait(long long ns);
+void metrics_format(strbuf *out, int prometheus);
+int metrics_save(const char *path);
+
+#endif
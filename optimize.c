@@ -0,0 +1,476 @@
+#include "optimize.h"
+#include "builtins.h"
+#include "executor.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/* The functions a command name may stand for when the statements run:
+ * those defined already and those the statements define anywhere, as a
+ * body may run at any later point. */
+typedef struct {
+    const func_table *funcs;
+    const char **names;
+    int count, capacity;
+} opt_context;
+
+static void optimize_list(const opt_context *ctx, ast_list_node *head,
+                          int tty_out);
+static void optimize_node(const opt_context *ctx, ast_node **pnode,
+                          int tty_out);
+static void collect_list(opt_context *ctx, const ast_list_node *head);
+
+static void collect_node(opt_context *ctx, const ast_node *node)
+{
+    switch (node->type) {
+    case ast_type_function:
+        if (ctx->count == ctx->capacity) {
+            ctx->capacity = ctx->capacity * 2 + 8;
+            ctx->names = realloc(ctx->names,
+                                 sizeof(char *) * ctx->capacity);
+        }
+        ctx->names[ctx->count++] = node->function.name;
+        collect_node(ctx, node->function.body->node);
+        break;
+    case ast_type_redirection:
+        collect_node(ctx, node->redirection.child);
+        break;
+    case ast_type_pipeline:
+        collect_list(ctx, node->pipeline.chain);
+        break;
+    case ast_type_logical:
+        collect_node(ctx, node->logical.left);
+        collect_node(ctx, node->logical.right);
+        break;
+    case ast_type_background:
+        collect_node(ctx, node->background.child);
+        break;
+    case ast_type_if:
+        collect_list(ctx, node->if_clause.cond);
+        collect_list(ctx, node->if_clause.then_body);
+        collect_list(ctx, node->if_clause.else_body);
+        break;
+    case ast_type_loop:
+        collect_list(ctx, node->loop.cond);
+        collect_list(ctx, node->loop.body);
+        break;
+    case ast_type_for:
+        collect_list(ctx, node->for_clause.body);
+        break;
+    case ast_type_group:
+        collect_list(ctx, node->group.statements);
+        break;
+    default:
+        /* subshells, coprocesses and fan-out stages run in a child,
+         * whose definitions the shell never sees */
+        break;
+    }
+}
+
+static void collect_list(opt_context *ctx, const ast_list_node *head)
+{
+    for (; head != NULL; head = head->next) {
+        collect_node(ctx, head->node);
+    }
+}
+
+static int is_function(const opt_context *ctx, const char *name)
+{
+    int i;
+
+    if (func_find(ctx->funcs, name) != NULL) {
+        return 1;
+    }
+    for (i = 0; i < ctx->count; i++) {
+        if (strcmp(ctx->names[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_literal(const ast_word *word)
+{
+    return word->parts == NULL && word->glob == NULL;
+}
+
+/* A command without assignments whose words are all known now, so
+ * running it has no effect beyond what the command itself does. */
+static int is_plain_command(const opt_context *ctx, const ast_node *node,
+                            const char *name)
+{
+    const ast_command *cmd;
+    int i;
+
+    if (node->type != ast_type_command) {
+        return 0;
+    }
+    cmd = &node->command;
+    if (cmd->assign_count > 0 || cmd->argc == 0 ||
+        strcmp(cmd->argv[0], name) != 0 || is_function(ctx, name))
+    {
+        return 0;
+    }
+    for (i = 0; i < cmd->argc; i++) {
+        if (!is_literal(&cmd->words[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int word_may_assign(const ast_word *word)
+{
+    const ast_word_part *part;
+
+    for (part = word->parts; part != NULL; part = part->next) {
+        if (part->type == part_arith) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* A command that runs in a process of its own wherever it stands, so
+ * taking it out of a pipeline leaves the shell as it would have been:
+ * no builtin, function or prefix, and no $((...)) that could assign. */
+static int is_external_command(const opt_context *ctx, const ast_node *node)
+{
+    const ast_command *cmd;
+    int i;
+
+    if (node->type == ast_type_redirection) {
+        node = node->redirection.child;
+    }
+    if (node->type != ast_type_command) {
+        return 0;
+    }
+    cmd = &node->command;
+    if (cmd->argc == 0 || !is_literal(&cmd->words[0]) ||
+        find_builtin(cmd->argv[0]) != NULL || is_prefix(cmd->argv[0]) ||
+        is_function(ctx, cmd->argv[0]))
+    {
+        return 0;
+    }
+    for (i = 0; i < cmd->assign_count; i++) {
+        if (word_may_assign(&cmd->assigns[i].value)) {
+            return 0;
+        }
+    }
+    for (i = 0; i < cmd->argc; i++) {
+        if (word_may_assign(&cmd->words[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* 0 or 1 for true, : and false, -1 for anything else. */
+static int known_status(const opt_context *ctx, const ast_node *node)
+{
+    if (is_plain_command(ctx, node, "true") ||
+        is_plain_command(ctx, node, ":"))
+    {
+        return 0;
+    }
+    return is_plain_command(ctx, node, "false") ? 1 : -1;
+}
+
+static void optimize_word(const opt_context *ctx, ast_word *word,
+                          int tty_out)
+{
+    ast_word_part *part;
+
+    for (part = word->parts; part != NULL; part = part->next) {
+        if (part->statements != NULL) {
+            /* only >(...) writes where the command does */
+            optimize_list(ctx, part->statements,
+                          part->type == part_procsub_out && tty_out);
+        }
+    }
+}
+
+static void optimize_command(const opt_context *ctx, ast_command *cmd,
+                             int tty_out)
+{
+    int i;
+
+    for (i = 0; i < cmd->assign_count; i++) {
+        optimize_word(ctx, &cmd->assigns[i].value, tty_out);
+    }
+    for (i = 0; i < cmd->argc; i++) {
+        optimize_word(ctx, &cmd->words[i], tty_out);
+    }
+}
+
+/* Of several redirections of one fd only the last one counts. Earlier
+ * ones naming a plain file still create, truncate or fail as they
+ * would, but only open their file and leave the fd alone; a process
+ * substitution is left as it is, and a >&N in between may copy the fd
+ * first. */
+static void fuse_redirections(ast_redirection *redir)
+{
+    redir_entry *entry, *later;
+
+    for (entry = redir->entries; entry != NULL; entry = entry->next) {
+        for (later = entry->next; later != NULL; later = later->next) {
+            if (later->target_fd == entry->target_fd) {
+                break;
+            }
+            if (later->type == redir_dup) {
+                later = NULL;
+                break;
+            }
+        }
+        if (later != NULL && entry->type != redir_dup &&
+            is_literal(&entry->filename))
+        {
+            entry->flags |= redir_open_only;
+        }
+    }
+}
+
+static int redirects_stdout(const ast_redirection *redir)
+{
+    const redir_entry *entry;
+
+    for (entry = redir->entries; entry != NULL; entry = entry->next) {
+        if (entry->target_fd == 1 && entry->type != redir_in) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* true && x is x, false || x is x, true || x is true and false && x is
+ * false; unless a function takes the name of the builtin. */
+static void fold_logical(const opt_context *ctx, ast_node **pnode)
+{
+    ast_node *node = *pnode, *keep, *drop;
+    int left = known_status(ctx, node->logical.left);
+    int and = node->logical.type == token_and;
+
+    if (left == -1) {
+        return;
+    }
+    if ((left == 0) == and) {
+        keep = node->logical.right;
+        drop = node->logical.left;
+    } else {
+        keep = node->logical.left;
+        drop = node->logical.right;
+    }
+    ast_node_free(drop);
+    free(node);
+    *pnode = keep;
+}
+
+/* Puts < file in front of the other redirections of the stage, so that
+ * its own redirection of stdin still wins as it did over the pipe. A
+ * file cat could not read is reported and the stage reads nothing, as
+ * it did from cat. */
+static void redirect_input(ast_node **pstage, ast_word *file)
+{
+    redir_entry *entry;
+    ast_node *node;
+
+    entry = calloc(1, sizeof(redir_entry));
+    entry->type = redir_in;
+    entry->target_fd = 0;
+    entry->flags = redir_empty_on_error;
+    entry->filename = *file;
+    file->text = NULL;
+    file->glob = NULL;
+    file->parts = NULL;
+    if ((*pstage)->type != ast_type_redirection) {
+        node = malloc(sizeof(ast_node));
+        node->type = ast_type_redirection;
+        node->redirection.entries = NULL;
+        node->redirection.child = *pstage;
+        *pstage = node;
+    }
+    entry->next = (*pstage)->redirection.entries;
+    (*pstage)->redirection.entries = entry;
+    fuse_redirections(&(*pstage)->redirection);
+}
+
+static int is_cat_of_file(const opt_context *ctx, const ast_node *node)
+{
+    return is_plain_command(ctx, node, "cat") && node->command.argc == 2 &&
+        node->command.argv[1][0] != '-';
+}
+
+/* A pipeline left with one stage runs it in the shell, which only an
+ * external command cannot tell; so does cd / | cat. */
+static int may_collapse(const opt_context *ctx, const ast_list_node *rest,
+                        const ast_node *last)
+{
+    return rest->next != NULL || is_external_command(ctx, last);
+}
+
+/* cmd | cat becomes cmd || :, which keeps the status of cat, when
+ * nothing could tell a terminal from a pipe. The cat node turns into
+ * the : . */
+static void drop_trailing_cat(ast_node **pnode,
+                              ast_list_node **pitem)
+{
+    ast_command *colon = &(*pitem)->node->command;
+    ast_node *node;
+
+    free(colon->words[0].text);
+    colon->words[0].text = strdup(":");
+    colon->argv[0] = colon->words[0].text;
+    node = malloc(sizeof(ast_node));
+    node->type = ast_type_logical;
+    node->logical.type = token_or;
+    node->logical.right = (*pitem)->node;
+    free(*pitem);
+    *pitem = NULL;
+    node->logical.left = *pnode;
+    if ((*pnode)->pipeline.chain->next == NULL) {
+        node->logical.left = (*pnode)->pipeline.chain->node;
+        free((*pnode)->pipeline.chain);
+        free(*pnode);
+    }
+    *pnode = node;
+}
+
+/* cat file | cmd becomes cmd < file; the status was that of cmd. */
+static void optimize_pipeline(const opt_context *ctx, ast_node **pnode,
+                              int tty_out)
+{
+    ast_list_node **pitem, *item, *chain;
+
+    for (item = (*pnode)->pipeline.chain; item != NULL; item = item->next) {
+        optimize_node(ctx, &item->node, item->next != NULL ? 0 : tty_out);
+    }
+    chain = (*pnode)->pipeline.chain;
+    if (chain->next != NULL && is_cat_of_file(ctx, chain->node) &&
+        may_collapse(ctx, chain->next, chain->next->node))
+    {
+        redirect_input(&chain->next->node, &chain->node->command.words[1]);
+        ast_node_free(chain->node);
+        (*pnode)->pipeline.chain = chain->next;
+        free(chain);
+        chain = (*pnode)->pipeline.chain;
+        if (chain->next == NULL) {
+            free(*pnode);
+            *pnode = chain->node;
+            free(chain);
+            return;
+        }
+    }
+    if (tty_out || is_function(ctx, ":")) {
+        return;
+    }
+    for (pitem = &chain->next; (*pitem)->next != NULL;
+         pitem = &(*pitem)->next)
+        {}
+    if (is_plain_command(ctx, (*pitem)->node, "cat") &&
+        (*pitem)->node->command.argc == 1 &&
+        may_collapse(ctx, chain->next, chain->node))
+    {
+        drop_trailing_cat(pnode, pitem);
+    }
+}
+
+static void optimize_node(const opt_context *ctx, ast_node **pnode,
+                          int tty_out)
+{
+    ast_node *node = *pnode;
+    redir_entry *entry;
+    int i;
+
+    switch (node->type) {
+    case ast_type_command:
+        optimize_command(ctx, &node->command, tty_out);
+        break;
+    case ast_type_subshell:
+        optimize_list(ctx, node->subshell.statements, tty_out);
+        break;
+    case ast_type_redirection:
+        fuse_redirections(&node->redirection);
+        for (entry = node->redirection.entries; entry != NULL;
+             entry = entry->next)
+        {
+            optimize_word(ctx, &entry->filename, tty_out);
+        }
+        optimize_node(ctx, &node->redirection.child,
+                      tty_out && !redirects_stdout(&node->redirection));
+        break;
+    case ast_type_pipeline:
+        optimize_pipeline(ctx, pnode, tty_out);
+        break;
+    case ast_type_logical:
+        optimize_node(ctx, &node->logical.left, tty_out);
+        optimize_node(ctx, &node->logical.right, tty_out);
+        fold_logical(ctx, pnode);
+        break;
+    case ast_type_background:
+        optimize_node(ctx, &node->background.child, tty_out);
+        break;
+    case ast_type_coproc:
+        optimize_node(ctx, &node->coproc.child, 0);
+        break;
+    case ast_type_arith:
+        break;
+    case ast_type_if:
+        optimize_list(ctx, node->if_clause.cond, tty_out);
+        optimize_list(ctx, node->if_clause.then_body, tty_out);
+        optimize_list(ctx, node->if_clause.else_body, tty_out);
+        break;
+    case ast_type_loop:
+        optimize_list(ctx, node->loop.cond, tty_out);
+        optimize_list(ctx, node->loop.body, tty_out);
+        break;
+    case ast_type_for:
+        for (i = 0; i < node->for_clause.word_count; i++) {
+            optimize_word(ctx, &node->for_clause.words[i], tty_out);
+        }
+        optimize_list(ctx, node->for_clause.body, tty_out);
+        break;
+    case ast_type_group:
+        optimize_list(ctx, node->group.statements, tty_out);
+        break;
+    case ast_type_function:
+        /* the function may be called with its output anywhere */
+        optimize_node(ctx, &node->function.body->node, 1);
+        break;
+    case ast_type_fanout:
+        optimize_node(ctx, &node->fanout.source, 0);
+        optimize_list(ctx, node->fanout.branches, tty_out);
+        break;
+    }
+}
+
+static void optimize_list(const opt_context *ctx, ast_list_node *head,
+                          int tty_out)
+{
+    for (; head != NULL; head = head->next) {
+        optimize_node(ctx, &head->node, tty_out);
+    }
+}
+
+/* Rewrites the statements in place before they run, against the
+ * functions defined by then. tty_out says whether their output may go
+ * to a terminal, where commands like ls behave differently than on a
+ * pipe. */
+void optimize_ast(ast_list_node *stmts, const func_table *funcs,
+                  int tty_out)
+{
+    opt_context ctx;
+
+    ctx.funcs = funcs;
+    ctx.names = NULL;
+    ctx.count = ctx.capacity = 0;
+    collect_list(&ctx, stmts);
+    optimize_list(&ctx, stmts, tty_out);
+    free(ctx.names);
+}
+
+int optimize_wanted(const var_table *vars)
+{
+    const char *value = var_get(vars, "SHELLMA_OPTIMIZE");
+
+    return value != NULL && *value != '\0' && strcmp(value, "0") != 0;
+}
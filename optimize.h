@@ -0,0 +1,12 @@
+#ifndef OPTIMIZE_SENTRY
+#define OPTIMIZE_SENTRY
+#include "parser.h"
+#include "funcs.h"
+#include "vars.h"
+
+
+void optimize_ast(ast_list_node *stmts, const func_table *funcs,
+                  int tty_out);
+int optimize_wanted(const var_table *vars);
+
+#endif
@@ -1,10 +1,16 @@
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stdio.h>
 #include "parser.h"
+#include "vars.h"
+#include "compile.h"
+#include "metrics.h"
 
 
-static void ast_node_free(ast_node *node);
+static void ast_word_free(ast_word *word);
 static int parse_statements(ast_list_node **phead, token_item **pcur);
+static int parse_compound_list(ast_list_node **phead, token_item **pcur);
 
 static void ast_list_append(
     ast_list_node **phead, ast_list_node **ptail, ast_node *node)
@@ -28,10 +34,18 @@ static void init_ast(ast_node **pnode, enum ast_type type)
     (*pnode)->type = type;
 }
 
-static void init_ast_command(ast_node **pnode, char **argv)
+static void init_ast_command(ast_node **pnode, int assign_count, int argc)
 {
+    ast_command *cmd;
+
     init_ast(pnode, ast_type_command);
-    (*pnode)->command.argv = argv;
+    cmd = &(*pnode)->command;
+    cmd->assign_count = assign_count;
+    cmd->argc = argc;
+    cmd->assigns = calloc(assign_count, sizeof(ast_assign));
+    cmd->words = calloc(argc, sizeof(ast_word));
+    cmd->argv = calloc(argc + 1, sizeof(char *));
+    cmd->need_expand = assign_count > 0;
 }
 
 static void init_ast_subshell(ast_node **pnode, ast_list_node *stmts)
@@ -73,37 +87,470 @@ static void init_ast_pipeline(ast_node **pnode, ast_list_node *chain)
     (*pnode)->pipeline.chain = chain;
 }
 
-static void parse_command(ast_node **pnode, token_item **pcur)
+static void init_ast_fanout(
+    ast_node **pnode, ast_node *source, ast_list_node *branches)
+{
+    init_ast(pnode, ast_type_fanout);
+    (*pnode)->fanout.source = source;
+    (*pnode)->fanout.branches = branches;
+}
+
+static int init_ast_arith(ast_node **pnode, const char *text)
+{
+    init_ast(pnode, ast_type_arith);
+    (*pnode)->arith.text = strdup(text);
+    return arith_parse(text, &(*pnode)->arith.expr) == arith_ok ? 0 : -1;
+}
+
+/* Reserved words are only recognized unquoted and in command position. */
+static int is_keyword(const token_item *token, const char *word)
+{
+    return is_token_type(token, token_word) && !token->quoted &&
+        token->parts == NULL && strcmp(token->str_val, word) == 0;
+}
+
+static int is_list_end(const token_item *token)
+{
+    static const char *const words[] = {
+        "then", "elif", "else", "fi", "do", "done", "}"
+    };
+    int i;
+
+    if (token == NULL || is_token_type(token, token_rparen)) {
+        return 1;
+    }
+    for (i = 0; i < sizeof(words) / sizeof(*words); i++) {
+        if (is_keyword(token, words[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void skip_newlines(token_item **pcur)
+{
+    while (is_token_type(*pcur, token_newline)) {
+        *pcur = (*pcur)->next;
+    }
+}
+
+static int expect_keyword(token_item **pcur, const char *word)
+{
+    if (!is_keyword(*pcur, word)) {
+        return -1;
+    }
+    *pcur = (*pcur)->next;
+    return 0;
+}
+
+int parse_string(ast_list_node **plist, const char *src)
+{
+    lexer lex;
+    token_item *tokens, *err_pos;
+    int status;
+
+    *plist = NULL;
+    lexer_init(&lex);
+    lexer_start(&lex);
+    while (*src != '\0') {
+        lexer_feed(&lex, *src++);
+    }
+    status = lexer_end(&lex, &tokens);
+    if (status == lexer_ok) {
+        status = parse(plist, tokens, &err_pos);
+    }
+    tokens_free(tokens);
+    lexer_free(&lex);
+    return status == 0 ? 0 : -1;
+}
+
+static char *format_error(int line, int col, const char *what,
+                          const char *near)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "%d:%d: %s%s%s", line, col, what,
+             near != NULL ? " near " : "", near != NULL ? near : "");
+    return strdup(buf);
+}
+
+/* Parses a whole script of len bytes at once, the way a script file is
+ * run; the text need not end in NUL. On failure *message says what is
+ * wrong and where, as LINE:CHAR: followed by the error. */
+int parse_text(ast_list_node **plist, const char *text, long len,
+               char **message)
 {
-    char **argv;
+    lexer lex;
+    token_item *tokens, *err_pos;
+    enum lexer_error err;
+    long i;
+
+    *plist = NULL;
+    *message = NULL;
+    lexer_init(&lex);
+    lexer_start(&lex);
+    for (i = 0; i < len; i++) {
+        lexer_feed(&lex, text[i]);
+    }
+    err = lexer_end(&lex, &tokens);
+    if (err != lexer_ok) {
+        /* the word left open is where the quote or substitution began */
+        if (lex.start_char == 0) {
+            lex.start_line = lex.line_num;
+            lex.start_char = lex.char_num;
+        }
+        *message = format_error(lex.start_line, lex.start_char,
+                                lexer_error_msg(err), NULL);
+    } else if (parse(plist, tokens, &err_pos) != 0) {
+        if (err_pos != NULL) {
+            *message = format_error(err_pos->line_num, err_pos->char_num,
+                                    "syntax error", token_name(err_pos->type));
+        } else {
+            *message = format_error(lex.tail->line_num, lex.tail->char_num,
+                                    "syntax error", "end of file");
+        }
+    }
+    tokens_free(tokens);
+    lexer_free(&lex);
+    return *message == NULL ? 0 : -1;
+}
+
+/* The first skip bytes belong to an assignment prefix, which always lies
+ * in the leading unquoted literal. */
+static int init_word_parts(ast_word *word, const word_part *src, int skip)
+{
+    ast_word_part **ptail = &word->parts;
+
+    for (; src != NULL; src = src->next) {
+        const char *text = src->text + skip;
+        ast_word_part *part;
+
+        skip = 0;
+        if (src->type == part_literal && *text == '\0') {
+            continue;
+        }
+        part = calloc(1, sizeof(ast_word_part));
+        part->type = src->type;
+        part->quoted = src->quoted;
+        part->text = strdup(text);
+        *ptail = part;
+        ptail = &part->next;
+        if ((part->type == part_command || part->type == part_procsub_in ||
+             part->type == part_procsub_out) &&
+            parse_string(&part->statements, text) != 0)
+        {
+            return -1;
+        }
+        if (part->type == part_arith &&
+            arith_parse(text, &part->expr) != arith_ok)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int init_word(ast_word *word, const token_item *token, int skip)
+{
+    word->text = strdup(token->str_val + skip);
+    word->glob = token->glob_val != NULL && skip == 0
+        ? pattern_compile(token->glob_val)
+        : NULL;
+    word->parts = NULL;
+    return init_word_parts(word, token->parts, skip);
+}
+
+static int parse_command(ast_node **pnode, token_item **pcur)
+{
+    ast_command *cmd;
     token_item *tmp;
-    int argc = 0, i;
+    int assign_count = 0, argc = 0, status, i;
 
     tmp = *pcur;
+    while (is_token_type(tmp, token_word) && tmp->assign_len > 0) {
+        assign_count++;
+        tmp = tmp->next;
+    }
     while (is_token_type(tmp, token_word)) {
         argc++;
         tmp = tmp->next;
     }
-    argv = malloc(sizeof(char *) * (argc + 1));
+    init_ast_command(pnode, assign_count, argc);
+    cmd = &(*pnode)->command;
+    for (i = 0; i < assign_count; i++) {
+        ast_assign *assign = &cmd->assigns[i];
+        int len = (*pcur)->assign_len;
+
+        assign->name = strndup((*pcur)->str_val, len - 1);
+        status = init_word(&assign->value, *pcur, len);
+        if (status != 0) {
+            ast_node_free(*pnode);
+            return status;
+        }
+        *pcur = (*pcur)->next;
+    }
     for (i = 0; i < argc; i++) {
-        argv[i] = (*pcur)->str_val;
+        ast_word *word = &cmd->words[i];
+
+        status = init_word(word, *pcur, 0);
+        if (status != 0) {
+            ast_node_free(*pnode);
+            return status;
+        }
+        if (word->glob != NULL || word->parts != NULL) {
+            cmd->need_expand = 1;
+        }
+        cmd->argv[i] = word->text;
         *pcur = (*pcur)->next;
     }
-    argv[argc] = NULL;
-    init_ast_command(pnode, argv);
+    return 0;
 }
 
-static int parse_factor(ast_node **pnode, token_item **pcur)
+static int parse_if(ast_node **pnode, token_item **pcur)
+{
+    ast_if *clause;
+    int status;
+
+    init_ast(pnode, ast_type_if);
+    clause = &(*pnode)->if_clause;
+    *pcur = (*pcur)->next;
+    status = parse_compound_list(&clause->cond, pcur);
+    if (status == 0) {
+        status = expect_keyword(pcur, "then");
+    }
+    if (status == 0) {
+        status = parse_compound_list(&clause->then_body, pcur);
+    }
+    if (status == 0 && is_keyword(*pcur, "elif")) {
+        ast_list_node *tail = NULL;
+        ast_node *elif;
+
+        status = parse_if(&elif, pcur);
+        if (status == 0) {
+            ast_list_append(&clause->else_body, &tail, elif);
+        }
+    } else if (status == 0) {
+        if (is_keyword(*pcur, "else")) {
+            *pcur = (*pcur)->next;
+            status = parse_compound_list(&clause->else_body, pcur);
+        }
+        if (status == 0) {
+            status = expect_keyword(pcur, "fi");
+        }
+    }
+    if (status != 0) {
+        ast_node_free(*pnode);
+    }
+    return status;
+}
+
+static int parse_do_group(ast_list_node **pbody, token_item **pcur)
+{
+    int status;
+
+    status = expect_keyword(pcur, "do");
+    if (status == 0) {
+        status = parse_compound_list(pbody, pcur);
+    }
+    if (status == 0) {
+        status = expect_keyword(pcur, "done");
+    }
+    return status;
+}
+
+static int parse_loop(ast_node **pnode, token_item **pcur)
 {
-    if (is_token_type(*pcur, token_word)) {
-        parse_command(pnode, pcur);
+    ast_loop *loop;
+    int status;
+
+    init_ast(pnode, ast_type_loop);
+    loop = &(*pnode)->loop;
+    loop->until = is_keyword(*pcur, "until");
+    *pcur = (*pcur)->next;
+    status = parse_compound_list(&loop->cond, pcur);
+    if (status == 0) {
+        status = parse_do_group(&loop->body, pcur);
+    }
+    if (status != 0) {
+        ast_node_free(*pnode);
+    }
+    return status;
+}
+
+/* Without an "in" list the loop goes over the positional parameters,
+ * which is marked by a NULL words array. */
+static int parse_for_words(ast_for *clause, token_item **pcur)
+{
+    token_item *tmp;
+    int status, i;
+
+    if (!is_keyword(*pcur, "in")) {
+        if (is_token_type(*pcur, token_semicolon)) {
+            *pcur = (*pcur)->next;
+        }
         return 0;
+    }
+    *pcur = (*pcur)->next;
+    for (tmp = *pcur; is_token_type(tmp, token_word); tmp = tmp->next) {
+        clause->word_count++;
+    }
+    clause->words = calloc(clause->word_count + 1, sizeof(ast_word));
+    for (i = 0; i < clause->word_count; i++) {
+        status = init_word(&clause->words[i], *pcur, 0);
+        *pcur = (*pcur)->next;
+        if (status != 0) {
+            return status;
+        }
+    }
+    if (!is_token_type(*pcur, token_semicolon | token_newline)) {
+        return -1;
+    }
+    *pcur = (*pcur)->next;
+    return 0;
+}
+
+static int parse_for(ast_node **pnode, token_item **pcur)
+{
+    ast_for *clause;
+    const token_item *name;
+    int status;
+
+    init_ast(pnode, ast_type_for);
+    clause = &(*pnode)->for_clause;
+    *pcur = (*pcur)->next;
+    name = *pcur;
+    if (!is_token_type(name, token_word) || name->parts != NULL ||
+        name->quoted || !is_var_name(name->str_val, strlen(name->str_val)))
+    {
+        ast_node_free(*pnode);
+        return -1;
+    }
+    clause->name = strdup(name->str_val);
+    *pcur = (*pcur)->next;
+    skip_newlines(pcur);
+    status = parse_for_words(clause, pcur);
+    if (status == 0) {
+        skip_newlines(pcur);
+        status = parse_do_group(&clause->body, pcur);
+    }
+    if (status != 0) {
+        ast_node_free(*pnode);
+    }
+    return status;
+}
+
+static int parse_group(ast_node **pnode, token_item **pcur)
+{
+    int status;
+
+    init_ast(pnode, ast_type_group);
+    *pcur = (*pcur)->next;
+    status = parse_compound_list(&(*pnode)->group.statements, pcur);
+    if (status == 0) {
+        status = expect_keyword(pcur, "}");
+    }
+    if (status != 0) {
+        ast_node_free(*pnode);
+    }
+    return status;
+}
+
+static int is_function_def(const token_item *token)
+{
+    return is_token_type(token, token_word) && token->parts == NULL &&
+        !token->quoted && token->glob_val == NULL &&
+        is_token_type(token->next, token_lparen) &&
+        is_token_type(token->next->next, token_rparen);
+}
+
+static int parse_factor(ast_node **pnode, token_item **pcur);
+
+/* name() followed by a compound command; the body is parsed here once
+ * and shared with the function table when the definition runs. */
+static int parse_function(ast_node **pnode, token_item **pcur)
+{
+    ast_function *func;
+    ast_node *body;
+    int status;
+
+    init_ast(pnode, ast_type_function);
+    func = &(*pnode)->function;
+    func->name = strdup((*pcur)->str_val);
+    *pcur = (*pcur)->next->next->next;
+    skip_newlines(pcur);
+    if (is_token_type(*pcur, token_word) && !is_keyword(*pcur, "{") &&
+        !is_keyword(*pcur, "if") && !is_keyword(*pcur, "while") &&
+        !is_keyword(*pcur, "until") && !is_keyword(*pcur, "for"))
+    {
+        ast_node_free(*pnode);
+        return -1;
+    }
+    status = parse_factor(&body, pcur);
+    if (status != 0) {
+        ast_node_free(*pnode);
+        return status;
+    }
+    func->body = malloc(sizeof(func_body));
+    func->body->node = body;
+    func->body->code = NULL;
+    func->body->refs = 1;
+    return 0;
+}
+
+static int parse_redirection(ast_node **pnode, token_item **pcur);
+
+/* A name is only taken when a compound command follows it, as in bash;
+ * otherwise the words after coproc are the command. */
+static int parse_coproc(ast_node **pnode, token_item **pcur)
+{
+    token_item *name = (*pcur)->next;
+    ast_node *child;
+    int status;
+
+    if (is_token_type(name, token_word) && name->parts == NULL &&
+        !name->quoted && name->glob_val == NULL &&
+        (is_keyword(name->next, "{") ||
+         is_token_type(name->next, token_lparen)))
+    {
+        *pcur = name->next;
+    } else {
+        name = NULL;
+        *pcur = (*pcur)->next;
+    }
+    status = parse_redirection(&child, pcur);
+    if (status != 0) {
+        return status;
+    }
+    init_ast(pnode, ast_type_coproc);
+    (*pnode)->coproc.name = strdup(name != NULL ? name->str_val : "COPROC");
+    (*pnode)->coproc.child = child;
+    return 0;
+}
+
+static int parse_factor(ast_node **pnode, token_item **pcur)
+{
+    if (is_keyword(*pcur, "{")) {
+        return parse_group(pnode, pcur);
+    } else if (is_function_def(*pcur)) {
+        return parse_function(pnode, pcur);
+    } else if (is_keyword(*pcur, "if")) {
+        return parse_if(pnode, pcur);
+    } else if (is_keyword(*pcur, "while") || is_keyword(*pcur, "until")) {
+        return parse_loop(pnode, pcur);
+    } else if (is_keyword(*pcur, "for")) {
+        return parse_for(pnode, pcur);
+    } else if (is_keyword(*pcur, "coproc")) {
+        return parse_coproc(pnode, pcur);
+    } else if (is_list_end(*pcur)) {
+        return -1;
+    } else if (is_token_type(*pcur, token_word)) {
+        return parse_command(pnode, pcur);
     } else if (is_token_type(*pcur, token_lparen)) {
         ast_list_node *stmts;
         int status;
 
         *pcur = (*pcur)->next;
-        status = parse_statements(&stmts, pcur);
+        status = parse_compound_list(&stmts, pcur);
         if (status != 0) {
             return status;
         }
@@ -114,20 +561,29 @@ static int parse_factor(ast_node **pnode, token_item **pcur)
         *pcur = (*pcur)->next;
         init_ast_subshell(pnode, stmts);
         return 0;
+    } else if (is_token_type(*pcur, token_arith)) {
+        int status;
+
+        status = init_ast_arith(pnode, (*pcur)->str_val);
+        if (status != 0) {
+            ast_node_free(*pnode);
+            return status;
+        }
+        *pcur = (*pcur)->next;
+        return 0;
     } else {
         return -1; 
     }
 }
 
-static void redir_list_append(
+static redir_entry *redir_list_append(
     redir_entry **phead, redir_entry **ptail,
-    enum redir_type type, const char *filename, int target_fd)
+    enum redir_type type, int target_fd)
 {
     redir_entry *item;
 
-    item = malloc(sizeof(redir_entry));
+    item = calloc(1, sizeof(redir_entry));
     item->type = type;
-    item->filename = filename;
     item->target_fd = target_fd;
     item->next = NULL;
     if (*ptail != NULL) {
@@ -136,12 +592,14 @@ static void redir_list_append(
         *phead = item;
     }
     *ptail = item;
+    return item;
 }
 
-static void redir_list_free(redir_entry *head) {
+void redir_list_free(redir_entry *head) {
     while (head != NULL) {
         redir_entry *tmp = head;
         head = head->next;
+        ast_word_free(&tmp->filename);
         free(tmp);
     }
 }
@@ -156,7 +614,7 @@ static int parse_redirection(ast_node **pnode, token_item **pcur)
         return status;
     }
     while (is_token_redir(*pcur)) {
-        const char *filename;
+        redir_entry *entry;
         enum redir_type type = (*pcur)->type;
         int target_fd = (*pcur)->int_val;
 
@@ -166,34 +624,76 @@ static int parse_redirection(ast_node **pnode, token_item **pcur)
             redir_list_free(head);
             return -1;
         }
-        filename = (*pcur)->str_val;
+        entry = redir_list_append(&head, &tail, type, target_fd);
+        status = init_word(&entry->filename, *pcur, 0);
+        pattern_free(entry->filename.glob);
+        entry->filename.glob = NULL;
+        if (status != 0) {
+            ast_node_free(*pnode);
+            redir_list_free(head);
+            return status;
+        }
         *pcur = (*pcur)->next;
-        redir_list_append(&head, &tail, type, filename, target_fd);
     }
     init_ast_redirection(pnode, head, *pnode);
     return 0;
 }
 
+static int parse_pipeline(ast_node **pnode, token_item **pcur);
+
+/* Branches are pipelines separated by commas; newlines may surround
+ * them. */
+static int parse_fanout(ast_node **pnode, token_item **pcur)
+{
+    ast_list_node *head = NULL, *tail = NULL;
+    ast_node *branch;
+    int status;
+
+    do {
+        *pcur = (*pcur)->next;
+        skip_newlines(pcur);
+        status = parse_pipeline(&branch, pcur);
+        if (status == 0) {
+            ast_list_append(&head, &tail, branch);
+            skip_newlines(pcur);
+        }
+    } while (status == 0 && is_token_type(*pcur, token_comma));
+    if (status != 0 || !is_token_type(*pcur, token_fanout_end)) {
+        ast_list_free(head);
+        ast_node_free(*pnode);
+        return -1;
+    }
+    *pcur = (*pcur)->next;
+    init_ast_fanout(pnode, *pnode, head);
+    return 0;
+}
+
 static int parse_pipeline(ast_node **pnode, token_item **pcur)
 {
     ast_list_node *head = NULL, *tail = NULL;
     int status;
 
     status = parse_redirection(pnode, pcur);
-    if (status != 0 || !is_token_type(*pcur, token_pipe)) {
+    if (status != 0) {
         return status;
     }
-    ast_list_append(&head, &tail, *pnode);
-    while (is_token_type(*pcur, token_pipe)) {
-        *pcur = (*pcur)->next;
-        status = parse_redirection(pnode, pcur);
-        if (status != 0) {
-            ast_list_free(head);
-            return status;
-        }
+    if (is_token_type(*pcur, token_pipe)) {
         ast_list_append(&head, &tail, *pnode);
+        while (is_token_type(*pcur, token_pipe)) {
+            *pcur = (*pcur)->next;
+            skip_newlines(pcur);
+            status = parse_redirection(pnode, pcur);
+            if (status != 0) {
+                ast_list_free(head);
+                return status;
+            }
+            ast_list_append(&head, &tail, *pnode);
+        }
+        init_ast_pipeline(pnode, head);
+    }
+    if (is_token_type(*pcur, token_fanout)) {
+        return parse_fanout(pnode, pcur);
     }
-    init_ast_pipeline(pnode, head);
     return 0;
 }
 
@@ -210,6 +710,7 @@ static int parse_logical(ast_node **pleft, token_item **pcur)
         enum token_type type = (*pcur)->type;
 
         *pcur = (*pcur)->next;
+        skip_newlines(pcur);
         status = parse_pipeline(&right, pcur);
         if (status != 0) {
             ast_node_free(*pleft);
@@ -220,6 +721,9 @@ static int parse_logical(ast_node **pleft, token_item **pcur)
     return 0;
 }
 
+/* Statements are separated by ";", "&" or newlines and run up to the
+ * end of input, a closing parenthesis or a reserved word ending a
+ * compound command. */
 static int parse_statements(ast_list_node **phead, token_item **pcur)
 {
     ast_list_node *tail = NULL;
@@ -227,33 +731,53 @@ static int parse_statements(ast_list_node **phead, token_item **pcur)
     int status;
 
     *phead = NULL;
-    do {
+    skip_newlines(pcur);
+    while (!is_list_end(*pcur)) {
         status = parse_logical(&node, pcur);
         if (status != 0) {
             ast_list_free(*phead);
+            *phead = NULL;
             return status;
         }
 
         if (is_token_type(*pcur, token_bg)) {
             init_ast_background(&node, node);
         }
-        if (is_token_type(*pcur, token_bg | token_semicolon)) {
-            *pcur = (*pcur)->next;
-        }
         ast_list_append(phead, &tail, node);
-    } while (is_token_type(*pcur, token_word));
+        if (!is_token_type(*pcur, token_bg|token_semicolon|token_newline)) {
+            break;
+        }
+        *pcur = (*pcur)->next;
+        skip_newlines(pcur);
+    }
     return 0;
 }
 
+/* Bodies of subshells and compound commands must not be empty. */
+static int parse_compound_list(ast_list_node **phead, token_item **pcur)
+{
+    int status;
+
+    status = parse_statements(phead, pcur);
+    if (status == 0 && *phead == NULL) {
+        return -1;
+    }
+    return status;
+}
+
 int parse(ast_list_node **result, token_item *tokens, token_item **err_pos)
 {
+    long long start;
     int status;
 
     *result = NULL;
     if (tokens == NULL) {
         return 0;
     }
+    start = metrics_clock_ns();
     status = parse_statements(result, &tokens);
+    METRICS_ADD(parses, 1);
+    METRICS_ADD(parse_ns, metrics_clock_ns() - start);
     if (status == 0 && tokens == NULL) {
         return 0;
     }
@@ -265,11 +789,54 @@ int parse(ast_list_node **result, token_item *tokens, token_item **err_pos)
     return -1;
 }
 
-static void ast_node_free(ast_node *node)
+static void ast_word_free(ast_word *word)
+{
+    while (word->parts != NULL) {
+        ast_word_part *tmp = word->parts;
+
+        word->parts = tmp->next;
+        free(tmp->text);
+        ast_list_free(tmp->statements);
+        arith_free(tmp->expr);
+        free(tmp);
+    }
+    free(word->text);
+    pattern_free(word->glob);
+}
+
+static void ast_command_free(ast_command *cmd)
+{
+    int i;
+
+    for (i = 0; i < cmd->assign_count; i++) {
+        free(cmd->assigns[i].name);
+        ast_word_free(&cmd->assigns[i].value);
+    }
+    for (i = 0; i < cmd->argc; i++) {
+        ast_word_free(&cmd->words[i]);
+    }
+    free(cmd->assigns);
+    free(cmd->words);
+    free(cmd->argv);
+}
+
+static void ast_for_free(ast_for *clause)
+{
+    int i;
+
+    for (i = 0; i < clause->word_count; i++) {
+        ast_word_free(&clause->words[i]);
+    }
+    free(clause->words);
+    free(clause->name);
+    ast_list_free(clause->body);
+}
+
+void ast_node_free(ast_node *node)
 {
     switch (node->type) {
     case ast_type_command:
-        free(node->command.argv);
+        ast_command_free(&node->command);
         break;
     case ast_type_subshell:
         ast_list_free(node->subshell.statements);
@@ -288,6 +855,37 @@ static void ast_node_free(ast_node *node)
     case ast_type_background:
         ast_node_free(node->background.child);
         break;
+    case ast_type_arith:
+        free(node->arith.text);
+        arith_free(node->arith.expr);
+        break;
+    case ast_type_if:
+        ast_list_free(node->if_clause.cond);
+        ast_list_free(node->if_clause.then_body);
+        ast_list_free(node->if_clause.else_body);
+        break;
+    case ast_type_loop:
+        ast_list_free(node->loop.cond);
+        ast_list_free(node->loop.body);
+        break;
+    case ast_type_for:
+        ast_for_free(&node->for_clause);
+        break;
+    case ast_type_group:
+        ast_list_free(node->group.statements);
+        break;
+    case ast_type_function:
+        free(node->function.name);
+        func_body_release(node->function.body);
+        break;
+    case ast_type_fanout:
+        ast_node_free(node->fanout.source);
+        ast_list_free(node->fanout.branches);
+        break;
+    case ast_type_coproc:
+        free(node->coproc.name);
+        ast_node_free(node->coproc.child);
+        break;
     }
     free(node);
 }
@@ -302,3 +900,12 @@ void ast_list_free(ast_list_node *head)
     }
 }
 
+void func_body_release(func_body *body)
+{
+    if (body == NULL || --body->refs > 0) {
+        return;
+    }
+    ast_node_free(body->node);
+    program_free(body->code);
+    free(body);
+}
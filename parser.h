@@ -1,6 +1,8 @@
 #ifndef PARSER_SENTRY
 #define PARSER_SENTRY
 #include "lexer.h"
+#include "pattern.h"
+#include "arith.h"
 
 
 enum ast_type {
@@ -9,20 +11,53 @@ enum ast_type {
     ast_type_redirection,
     ast_type_pipeline,
     ast_type_logical,   
-    ast_type_background
+    ast_type_background,
+    ast_type_arith,
+    ast_type_if,
+    ast_type_loop,
+    ast_type_for,
+    ast_type_group,
+    ast_type_function,
+    ast_type_fanout,
+    ast_type_coproc
 };
 
 typedef struct ast_node ast_node;
-
-typedef struct {
-    char **argv;
-} ast_command;
+typedef struct vm_program vm_program;
 
 typedef struct child_item_tag {
     ast_node *node;
     struct child_item_tag *next;
 } ast_list_node;
 
+typedef struct ast_word_part ast_word_part;
+struct ast_word_part {
+    enum word_part_type type;
+    int quoted;
+    char *text;
+    ast_list_node *statements;  /* parsed body of $(...), <(...) */
+    arith_node *expr;           /* compiled $((...)) */
+    ast_word_part *next;
+};
+
+typedef struct {
+    char *text;
+    glob_pattern *glob;
+    ast_word_part *parts;
+} ast_word;
+
+typedef struct {
+    char *name;
+    ast_word value;
+} ast_assign;
+
+typedef struct {
+    char **argv;
+    ast_word *words;
+    ast_assign *assigns;
+    int argc, assign_count, need_expand;
+} ast_command;
+
 typedef struct {
     ast_list_node *statements;
 } ast_subshell;
@@ -30,13 +65,26 @@ typedef struct {
 enum redir_type {
     redir_in = token_redir_in,
     redir_out = token_redir_out,
-    redir_append = token_redir_append
+    redir_append = token_redir_append,
+    redir_dup = token_redir_dup     /* the word is an fd, or - to close */
 };
 
+/* Set by the optimizer: an open_only entry opens its file for the side
+ * effects and the errors but leaves the target alone, as a later entry
+ * replaces it anyway; an empty_on_error one reads /dev/null after
+ * reporting a file it cannot read, as cat FILE | ... would. */
+enum redir_flags {
+    redir_open_only = 1,
+    redir_empty_on_error = 2
+};
+
+/* src_fd only holds state while the redirection applies; the fds it
+ * replaces are saved per call by apply_redirections, as a redirection
+ * may apply again while it does. */
 typedef struct redir_item_tag {
     enum redir_type type;
-    int src_fd, target_fd;
-    const char *filename;
+    int src_fd, target_fd, flags;
+    ast_word filename;
     struct redir_item_tag *next;
 } redir_entry;
 
@@ -54,10 +102,64 @@ typedef struct {
     ast_list_node *chain;
 } ast_pipeline;
 
+/* producer |{ branch, branch... }: every branch reads a copy of what
+ * the source writes. */
+typedef struct {
+    ast_node *source;
+    ast_list_node *branches;
+} ast_fanout;
+
 typedef struct {
     ast_node *child;
 } ast_background;
 
+/* coproc [NAME] command: the command runs in the background on two
+ * pipes the shell keeps; NAME defaults to COPROC. */
+typedef struct {
+    char *name;
+    ast_node *child;
+} ast_coproc;
+
+typedef struct {
+    char *text;
+    arith_node *expr;
+} ast_arith;
+
+/* elif is kept as a nested if in the else branch. */
+typedef struct {
+    ast_list_node *cond, *then_body, *else_body;
+} ast_if;
+
+typedef struct {
+    int until;
+    ast_list_node *cond, *body;
+} ast_loop;
+
+typedef struct {
+    char *name;
+    ast_word *words;
+    int word_count;
+    ast_list_node *body;
+} ast_for;
+
+typedef struct {
+    ast_list_node *statements;
+} ast_group;
+
+/* Function bodies outlive the line they were defined on, so they are
+ * shared between the definition node and the function table. The body
+ * is compiled on the first call and the code is kept with it. */
+typedef struct {
+    ast_node *node;
+    vm_program *code;
+    int refs;
+} func_body;
+
+typedef struct {
+    char *name;
+    func_body *body;
+} ast_function;
+
 struct ast_node {
     enum ast_type type;
     union {
@@ -67,10 +169,24 @@ struct ast_node {
         ast_logical logical;
         ast_pipeline pipeline;
         ast_background background;
+        ast_arith arith;
+        ast_if if_clause;
+        ast_loop loop;
+        ast_for for_clause;
+        ast_group group;
+        ast_function function;
+        ast_fanout fanout;
+        ast_coproc coproc;
     };
 };
 
 int parse(ast_list_node **plist, token_item *tokens, token_item **invalid);
+int parse_string(ast_list_node **plist, const char *src);
+int parse_text(ast_list_node **plist, const char *text, long len,
+               char **message);
 void ast_list_free(ast_list_node *head);
+void ast_node_free(ast_node *node);
+void redir_list_free(redir_entry *head);
+void func_body_release(func_body *body);
 
 #endif
@@ -0,0 +1,322 @@
+#include "pattern.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+
+static int is_meta(char ch)
+{
+    return ch == '*' || ch == '?' || ch == '[';
+}
+
+static void set_add(unsigned char *set, unsigned char ch)
+{
+    set[ch >> 3] |= 1 << (ch & 7);
+}
+
+static int set_has(const unsigned char *set, unsigned char ch)
+{
+    return set[ch >> 3] & (1 << (ch & 7));
+}
+
+static int add_char_class(unsigned char *set, const char *name, int len)
+{
+    static const struct {
+        const char *name;
+        int (*fn)(int);
+    } classes[] = {
+        { "alnum", &isalnum }, { "alpha", &isalpha }, { "blank", &isblank },
+        { "cntrl", &iscntrl }, { "digit", &isdigit }, { "graph", &isgraph },
+        { "lower", &islower }, { "print", &isprint }, { "punct", &ispunct },
+        { "space", &isspace }, { "upper", &isupper }, { "xdigit", &isxdigit }
+    };
+    int i, ch;
+
+    for (i = 0; i < sizeof(classes) / sizeof(*classes); i++) {
+        if (strlen(classes[i].name) == len &&
+            memcmp(classes[i].name, name, len) == 0)
+        {
+            for (ch = 1; ch < 256; ch++) {
+                if (classes[i].fn(ch)) {
+                    set_add(set, ch);
+                }
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Parses a bracket expression starting right after '['. Returns the
+ * number of consumed bytes including the closing ']', or 0 when the
+ * bracket is not closed and must be taken literally. */
+static int parse_set(const char *p, const char *end, unsigned char *set)
+{
+    const char *start = p;
+    int negate = 0, first = 1, i;
+    unsigned char lo, hi;
+
+    memset(set, 0, 32);
+    if (p < end && (*p == '!' || *p == '^')) {
+        negate = 1;
+        p++;
+    }
+    for (;;) {
+        if (p >= end) {
+            return 0;
+        }
+        if (*p == ']' && !first) {
+            p++;
+            break;
+        }
+        first = 0;
+        if (*p == '[' && p+1 < end && p[1] == ':') {
+            const char *name = p+2, *close = name;
+
+            while (close+1 < end && !(close[0] == ':' && close[1] == ']')) {
+                close++;
+            }
+            if (close+1 < end && add_char_class(set, name, close-name) == 0) {
+                p = close+2;
+                continue;
+            }
+        }
+        if (*p == '\\' && p+1 < end) {
+            p++;
+        }
+        lo = *p++;
+        hi = lo;
+        if (p+1 < end && *p == '-' && p[1] != ']') {
+            p++;
+            if (*p == '\\' && p+1 < end) {
+                p++;
+            }
+            hi = *p++;
+        }
+        for (i = lo; i <= hi; i++) {
+            set_add(set, i);
+        }
+    }
+    if (negate) {
+        for (i = 0; i < 32; i++) {
+            set[i] = ~set[i];
+        }
+    }
+    set[0] &= ~1;
+    return p - start;
+}
+
+static void add_lit(match_op *ops, int *count, char *dst, int len)
+{
+    if (*count > 0 && ops[*count-1].type == match_lit &&
+        ops[*count-1].lit + ops[*count-1].len == dst)
+    {
+        ops[*count-1].len += len;
+        return;
+    }
+    ops[*count].type = match_lit;
+    ops[*count].lit = dst;
+    ops[*count].len = len;
+    (*count)++;
+}
+
+/* Compiles one path component. The unescaped literal bytes go to *plits,
+ * which is advanced past them and a terminating NUL. */
+static void compile_segment(
+    glob_segment *seg, const char *p, const char *end, char **plits)
+{
+    char *lits = *plits;
+    int count = 0, have_meta = 0, used;
+
+    seg->text = lits;
+    seg->ops = malloc(sizeof(match_op) * (end - p + 1));
+    while (p < end) {
+        match_op *op = &seg->ops[count];
+
+        if (*p == '\\' && p+1 < end) {
+            *lits = p[1];
+            add_lit(seg->ops, &count, lits++, 1);
+            p += 2;
+        } else if (*p == '*') {
+            if (count == 0 || seg->ops[count-1].type != match_star) {
+                op->type = match_star;
+                count++;
+            }
+            have_meta = 1;
+            p++;
+        } else if (*p == '?') {
+            op->type = match_any;
+            count++;
+            have_meta = 1;
+            p++;
+        } else if (*p == '[' && (used = parse_set(p+1, end, op->set)) > 0) {
+            op->type = match_set;
+            count++;
+            have_meta = 1;
+            p += used + 1;
+        } else {
+            *lits = *p++;
+            add_lit(seg->ops, &count, lits++, 1);
+        }
+    }
+    *lits++ = '\0';
+    *plits = lits;
+
+    seg->op_count = count;
+    seg->match_dot = count > 0 && seg->ops[0].type == match_lit &&
+        seg->ops[0].lit[0] == '.';
+    seg->suffix_len = count > 1 && seg->ops[count-1].type == match_lit
+        ? seg->ops[count-1].len
+        : 0;
+    if (!have_meta) {
+        seg->type = segment_literal;
+        free(seg->ops);
+        seg->ops = NULL;
+        seg->op_count = 0;
+    } else {
+        seg->type = segment_match;
+    }
+}
+
+glob_pattern *pattern_compile(const char *pattern)
+{
+    glob_pattern *pat;
+    const char *p, *seg_end;
+    char *lits;
+    int len, has_meta = 0, count = 0;
+
+    for (p = pattern; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (is_meta(*p)) {
+            has_meta = 1;
+        }
+        if (*p == '/') {
+            count++;
+        }
+    }
+    if (!has_meta) {
+        return NULL;
+    }
+    len = p - pattern;
+
+    pat = malloc(sizeof(glob_pattern));
+    pat->segs = malloc(sizeof(glob_segment) * (count + 1));
+    pat->lits = lits = malloc(len + count + 2);
+    pat->absolute = pattern[0] == '/';
+    pat->trailing_slash = pattern[len-1] == '/';
+    pat->seg_count = 0;
+    has_meta = 0;
+    p = pattern;
+    while (*p != '\0') {
+        glob_segment *seg;
+
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        for (seg_end = p; *seg_end != '\0' && *seg_end != '/'; seg_end++) {
+            if (*seg_end == '\\' && seg_end[1] != '\0') {
+                seg_end++;
+            }
+        }
+        seg = &pat->segs[pat->seg_count++];
+        if (seg_end - p == 2 && p[0] == '*' && p[1] == '*') {
+            seg->type = segment_globstar;
+            seg->text = NULL;
+            seg->ops = NULL;
+            seg->op_count = 0;
+            has_meta = 1;
+        } else {
+            compile_segment(seg, p, seg_end, &lits);
+            has_meta |= seg->type != segment_literal;
+        }
+        p = seg_end;
+    }
+    if (!has_meta) {
+        pattern_free(pat);
+        return NULL;
+    }
+    return pat;
+}
+
+void pattern_free(glob_pattern *pat)
+{
+    int i;
+
+    if (pat == NULL) {
+        return;
+    }
+    for (i = 0; i < pat->seg_count; i++) {
+        free(pat->segs[i].ops);
+    }
+    free(pat->segs);
+    free(pat->lits);
+    free(pat);
+}
+
+int pattern_match(const glob_segment *seg, const char *name, int len)
+{
+    const match_op *op = seg->ops, *end = seg->ops + seg->op_count;
+    const match_op *star = NULL;
+    int pos = 0, star_pos = 0;
+
+    if (name[0] == '.' && !seg->match_dot) {
+        return 0;
+    }
+    if (seg->suffix_len > 0 && (len < seg->suffix_len ||
+        memcmp(name + len - seg->suffix_len, end[-1].lit, seg->suffix_len)))
+    {
+        return 0;
+    }
+    for (;;) {
+        if (op == end) {
+            if (pos == len) {
+                return 1;
+            }
+        } else {
+            switch (op->type) {
+            case match_star:
+                if (op+1 == end) {
+                    return 1;
+                }
+                if (op+2 == end && seg->suffix_len > 0) {
+                    return len - pos >= seg->suffix_len;
+                }
+                star = op++;
+                star_pos = pos;
+                continue;
+            case match_lit:
+                if (len - pos >= op->len &&
+                    memcmp(name + pos, op->lit, op->len) == 0)
+                {
+                    pos += op->len;
+                    op++;
+                    continue;
+                }
+                break;
+            case match_any:
+                if (pos < len) {
+                    pos++;
+                    op++;
+                    continue;
+                }
+                break;
+            case match_set:
+                if (pos < len && set_has(op->set, name[pos])) {
+                    pos++;
+                    op++;
+                    continue;
+                }
+                break;
+            }
+        }
+        if (star == NULL || star_pos >= len) {
+            return 0;
+        }
+        pos = ++star_pos;
+        op = star + 1;
+    }
+}
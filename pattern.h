@@ -0,0 +1,45 @@
+#ifndef PATTERN_SENTRY
+#define PATTERN_SENTRY
+
+
+enum match_op_type {
+    match_lit,      /* run of literal bytes */
+    match_any,      /* ?      */
+    match_star,     /* *      */
+    match_set       /* [...]  */
+};
+
+typedef struct {
+    enum match_op_type type;
+    int len;
+    const char *lit;
+    unsigned char set[32];
+} match_op;
+
+enum glob_segment_type {
+    segment_literal,
+    segment_match,
+    segment_globstar    /* ** */
+};
+
+typedef struct {
+    enum glob_segment_type type;
+    char *text;
+    match_op *ops;
+    int op_count;
+    int suffix_len;
+    int match_dot;
+} glob_segment;
+
+typedef struct {
+    int absolute, trailing_slash;
+    int seg_count;
+    glob_segment *segs;
+    char *lits;
+} glob_pattern;
+
+glob_pattern *pattern_compile(const char *pattern);
+void pattern_free(glob_pattern *pat);
+int pattern_match(const glob_segment *seg, const char *name, int len);
+
+#endif
@@ -0,0 +1,249 @@
+#include "pin.h"
+#include "wrappers.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+
+/* The glibc wrappers need _GNU_SOURCE and libnuma, so the masks are
+ * plain bit arrays handed to the system calls directly. */
+enum { mpol_default = 0, mpol_bind = 2, mem_unchanged = -1 };
+
+enum { long_bits = 8 * sizeof(unsigned long) };
+
+typedef struct {
+    int package, cache, core, cpu;
+} cpu_key;
+
+static void set_bit(unsigned long *mask, int n)
+{
+    mask[n / long_bits] |= 1UL << n % long_bits;
+}
+
+static int test_bit(const unsigned long *mask, int n)
+{
+    return (mask[n / long_bits] >> n % long_bits) & 1;
+}
+
+/* Parses lists like 0-3,8,10-11 as used by taskset and sysfs. */
+static int parse_list(const char *str, unsigned long *mask, int max)
+{
+    char *end;
+    long from, to;
+
+    memset(mask, 0, max / 8);
+    do {
+        if (!isdigit((unsigned char)*str)) {
+            return -1;
+        }
+        from = to = strtol(str, &end, 10);
+        if (*end == '-') {
+            if (!isdigit((unsigned char)end[1])) {
+                return -1;
+            }
+            to = strtol(end + 1, &end, 10);
+        }
+        if (from > to || to >= max) {
+            return -1;
+        }
+        for (; from <= to; from++) {
+            set_bit(mask, from);
+        }
+        str = end + 1;
+    } while (*end == ',');
+    return *end == '\0' ? 0 : -1;
+}
+
+static int get_affinity(unsigned long *mask)
+{
+    memset(mask, 0, max_cpus / 8);
+    return syscall(SYS_sched_getaffinity, 0, max_cpus / 8, mask) == -1
+        ? -1 : 0;
+}
+
+static int set_affinity(const unsigned long *mask)
+{
+    return syscall(SYS_sched_setaffinity, 0, max_cpus / 8, mask) == -1
+        ? -1 : 0;
+}
+
+static int set_mempolicy_mask(int mode, const unsigned long *nodes)
+{
+    /* The kernel drops the last bit of maxnode. */
+    return syscall(SYS_set_mempolicy, mode, nodes, max_nodes + 1) == -1
+        ? -1 : 0;
+}
+
+/* pin [-m NODES] CPUS COMMAND [ARG...]; returns the index of COMMAND. */
+int parse_pin_args(char **argv, placement *pl)
+{
+    int i = 1;
+
+    pl->mem_mode = mem_unchanged;
+    if (argv[i] != NULL && strcmp(argv[i], "-m") == 0) {
+        if (argv[i + 1] == NULL ||
+            parse_list(argv[i + 1], pl->nodes, max_nodes) == -1)
+        {
+            log_error("pin: invalid node list");
+            return -1;
+        }
+        pl->mem_mode = mpol_bind;
+        i += 2;
+    }
+    if (argv[i] == NULL || argv[i + 1] == NULL) {
+        log_error("pin: usage: pin [-m NODES] CPUS COMMAND [ARG...]");
+        return -1;
+    }
+    if (parse_list(argv[i], pl->cpus, max_cpus) == -1) {
+        log_error("pin: %s: invalid CPU list", argv[i]);
+        return -1;
+    }
+    return i + 1;
+}
+
+/* Both settings are inherited over fork and exec, so a command started
+ * between apply and restore runs with them. */
+int apply_placement(const placement *pl, placement *saved)
+{
+    saved->mem_mode = mem_unchanged;
+    if (get_affinity(saved->cpus) == -1 || set_affinity(pl->cpus) == -1) {
+        log_error("pin: %s", strerror(errno));
+        return -1;
+    }
+    if (pl->mem_mode == mem_unchanged) {
+        return 0;
+    }
+    memset(saved->nodes, 0, sizeof(saved->nodes));
+    if (syscall(SYS_get_mempolicy, &saved->mem_mode, saved->nodes,
+                max_nodes, NULL, 0) == -1)
+    {
+        saved->mem_mode = mpol_default;
+    }
+    if (set_mempolicy_mask(pl->mem_mode, pl->nodes) == -1) {
+        log_error("pin: %s", strerror(errno));
+        set_affinity(saved->cpus);
+        saved->mem_mode = mem_unchanged;
+        return -1;
+    }
+    return 0;
+}
+
+void restore_placement(const placement *saved)
+{
+    set_affinity(saved->cpus);
+    if (saved->mem_mode != mem_unchanged) {
+        set_mempolicy_mask(saved->mem_mode, saved->nodes);
+    }
+}
+
+static int read_topology(int cpu, const char *file)
+{
+    char path[128];
+    FILE *f;
+    int value;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s",
+             cpu, file);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    if (fscanf(f, "%d", &value) != 1) {
+        value = -1;
+    }
+    fclose(f);
+    return value;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    const cpu_key *x = a, *y = b;
+
+    if (x->package != y->package) {
+        return x->package - y->package;
+    }
+    if (x->cache != y->cache) {
+        return x->cache - y->cache;
+    }
+    if (x->core != y->core) {
+        return x->core - y->core;
+    }
+    return x->cpu - y->cpu;
+}
+
+/* Orders the CPUs the shell may run on so that neighbours share a
+ * package, then a last level cache, then a core. */
+static int topology_order(int *order)
+{
+    unsigned long mask[max_cpus / long_bits];
+    cpu_key keys[max_cpus];
+    int cpu, count = 0, i;
+
+    if (get_affinity(mask) == -1) {
+        return 0;
+    }
+    for (cpu = 0; cpu < max_cpus; cpu++) {
+        if (!test_bit(mask, cpu)) {
+            continue;
+        }
+        keys[count].package =
+            read_topology(cpu, "topology/physical_package_id");
+        keys[count].cache = read_topology(cpu, "cache/index3/id");
+        keys[count].core = read_topology(cpu, "topology/core_id");
+        keys[count].cpu = cpu;
+        count++;
+    }
+    qsort(keys, count, sizeof(cpu_key), &compare_keys);
+    for (i = 0; i < count; i++) {
+        order[i] = keys[i].cpu;
+    }
+    return count;
+}
+
+/* $SHELLMA_PIN_STAGES is either auto or a CPU list; stage n of a
+ * pipeline goes to the n-th CPU of the order, wrapping around. The
+ * order is kept until the policy changes. */
+const int *stage_cpus(const char *policy, int *count)
+{
+    static int order[max_cpus], order_count;
+    static char *order_policy = NULL;
+    unsigned long mask[max_cpus / long_bits];
+    int cpu;
+
+    if (policy == NULL || *policy == '\0') {
+        return NULL;
+    }
+    if (order_policy == NULL || strcmp(order_policy, policy) != 0) {
+        free(order_policy);
+        order_policy = strdup(policy);
+        order_count = 0;
+        if (strcmp(policy, "auto") == 0) {
+            order_count = topology_order(order);
+        } else if (parse_list(policy, mask, max_cpus) == 0) {
+            for (cpu = 0; cpu < max_cpus; cpu++) {
+                if (test_bit(mask, cpu)) {
+                    order[order_count++] = cpu;
+                }
+            }
+        } else {
+            log_error("SHELLMA_PIN_STAGES: %s: invalid policy", policy);
+        }
+    }
+    *count = order_count;
+    return order_count > 0 ? order : NULL;
+}
+
+void pin_to_cpu(int cpu)
+{
+    unsigned long mask[max_cpus / long_bits];
+
+    memset(mask, 0, sizeof(mask));
+    set_bit(mask, cpu);
+    if (set_affinity(mask) == -1) {
+        log_error("SHELLMA_PIN_STAGES: cpu %d: %s", cpu, strerror(errno));
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef PIN_SENTRY
+#define PIN_SENTRY
+
+
+enum { max_cpus = 1024, max_nodes = 1024 };
+
+typedef struct {
+    unsigned long cpus[max_cpus / (8 * sizeof(unsigned long))];
+    unsigned long nodes[max_nodes / (8 * sizeof(unsigned long))];
+    int mem_mode;
+} placement;
+
+int parse_pin_args(char **argv, placement *pl);
+int apply_placement(const placement *pl, placement *saved);
+void restore_placement(const placement *saved);
+const int *stage_cpus(const char *policy, int *count);
+void pin_to_cpu(int cpu);
+
+#endif
@@ -0,0 +1,411 @@
+#include "server.h"
+#include "parser.h"
+#include "executor.h"
+#include "strbuf.h"
+#include "wrappers.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+
+enum {
+    request_magic = 0x73686d61,
+    default_workers = 4,
+    passed_fds = 3
+};
+
+/* A request is this header with the client's stdin, stdout and stderr
+ * attached, followed by payload_len bytes of NUL-terminated strings:
+ * the working directory, the script, argc arguments and envc variables.
+ * The worker answers with the exit status as an int. */
+typedef struct {
+    unsigned magic;
+    int argc, envc, payload_len;
+} request_header;
+
+extern char **environ;
+
+static volatile sig_atomic_t stop_server = 0;
+
+static void stop_handler(int s)
+{
+    stop_server = 1;
+}
+
+static int read_full(int fd, void *buf, int len)
+{
+    char *p = buf;
+    int n;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, int len)
+{
+    const char *p = buf;
+    int n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int init_address(struct sockaddr_un *addr, const char *path)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_error("%s: socket path is too long", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int open_listener(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (init_address(&addr, path) == -1) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_error("socket: %s", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, SOMAXCONN) == -1)
+    {
+        log_error("%s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int receive_request(int conn, request_header *hdr, int *fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * passed_fds)];
+    struct iovec iov = { hdr, sizeof(*hdr) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    do {
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(*hdr) || hdr->magic != request_magic ||
+        cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * passed_fds))
+    {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * passed_fds);
+    return 0;
+}
+
+/* Splits the payload into the strings it is made of. */
+static char **split_payload(char *payload, int len, int count)
+{
+    char **strs, *end = payload + len;
+    int i;
+
+    strs = malloc(sizeof(char *) * (count + 1));
+    for (i = 0; i < count; i++) {
+        if (payload >= end) {
+            free(strs);
+            return NULL;
+        }
+        strs[i] = payload;
+        payload += strlen(payload) + 1;
+    }
+    strs[count] = NULL;
+    return strs;
+}
+
+/* The worker takes over the client's stdio, directory and environment,
+ * so the warm shell state is refreshed from the new environment. */
+static int adopt_request(shell *sh, const request_header *hdr, char **strs,
+                         const int *fds)
+{
+    int i;
+
+    for (i = 0; i < passed_fds; i++) {
+        xdup2(fds[i], i);
+        xclose(fds[i]);
+    }
+    if (chdir(strs[0]) == -1) {
+        log_error("cd: %s: %s", strs[0], strerror(errno));
+        return -1;
+    }
+    environ = strs + 2 + hdr->argc;
+    vars_free(&sh->vars);
+    vars_init(&sh->vars);
+    if (hdr->argc > 1) {
+        sh->top_params.argv = strs + 3;
+        sh->top_params.argc = hdr->argc - 1;
+    }
+    return 0;
+}
+
+static void run_request(shell *sh, int conn)
+{
+    request_header hdr;
+    ast_list_node *stmts;
+    char *payload, **strs;
+    int fds[passed_fds], status;
+
+    if (receive_request(conn, &hdr, fds) == -1 || hdr.payload_len <= 0) {
+        _exit(1);
+    }
+    payload = malloc(hdr.payload_len + 1);
+    payload[hdr.payload_len] = '\0';
+    if (read_full(conn, payload, hdr.payload_len) == -1) {
+        _exit(1);
+    }
+    strs = split_payload(payload, hdr.payload_len, 2 + hdr.argc + hdr.envc);
+    if (strs == NULL || adopt_request(sh, &hdr, strs, fds) == -1) {
+        write_full(conn, &(int){ 1 }, sizeof(int));
+        _exit(1);
+    }
+    sh->status_fd = conn;
+    status = parse_string(&stmts, strs[1]);
+    if (status != 0) {
+        log_error("syntax error");
+        exit_shell(sh, 2);
+    }
+    execute(sh, stmts);
+    exit_shell(sh, sh->last_status);
+}
+
+/* Idle workers wait in accept() on the shared socket; the one that gets
+ * a connection serves it and exits, and the parent forks a new one.
+ * Workers go away with the server even if it misses one of them.
+ * SIGTERM stays blocked until the child no longer has the server's
+ * handler, so a stop sent right after the fork is not lost. */
+static int spawn_worker(shell *sh, int listen_fd)
+{
+    sigset_t set, old;
+    int pid, conn;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    pid = xfork();
+    if (pid != 0) {
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return pid;
+    }
+    signal(SIGTERM, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    do {
+        conn = accept(listen_fd, NULL, NULL);
+    } while (conn == -1 && errno == EINTR);
+    if (conn == -1) {
+        _exit(1);
+    }
+    xclose(listen_fd);
+    fcntl(conn, F_SETFD, FD_CLOEXEC);
+    sh->pid = getpid();
+    sh->pgid = getpgid(0);
+    sh->tty_fd = -1;
+    enable_zombie_cleanup();
+    run_request(sh, conn);
+    _exit(1);
+}
+
+static int worker_count()
+{
+    const char *str = getenv("SHELLMA_WORKERS");
+    int n;
+
+    n = str != NULL ? atoi(str) : 0;
+    return n > 0 ? n : default_workers;
+}
+
+int server_main(shell *sh, const char *path)
+{
+    struct sigaction sa;
+    int listen_fd, count, *pids, pid, i;
+
+    listen_fd = open_listener(path);
+    if (listen_fd == -1) {
+        return 1;
+    }
+    sa.sa_handler = &stop_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    disable_zombie_cleanup();
+
+    count = worker_count();
+    pids = malloc(sizeof(int) * count);
+    for (i = 0; i < count; i++) {
+        pids[i] = spawn_worker(sh, listen_fd);
+    }
+    while (!stop_server) {
+        pid = waitpid(-1, NULL, 0);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (i = 0; i < count && pids[i] != pid; i++)
+            {}
+        if (i < count) {
+            pids[i] = stop_server ? 0 : spawn_worker(sh, listen_fd);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR)
+        {}
+    free(pids);
+    close(listen_fd);
+    unlink(path);
+    return 0;
+}
+
+static int send_request(int fd, const request_header *hdr)
+{
+    char control[CMSG_SPACE(sizeof(int) * passed_fds)];
+    struct iovec iov = { (void *)hdr, sizeof(*hdr) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int i, n;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * passed_fds);
+    for (i = 0; i < passed_fds; i++) {
+        ((int *)CMSG_DATA(cmsg))[i] = i;
+    }
+    do {
+        n = sendmsg(fd, &msg, 0);
+    } while (n == -1 && errno == EINTR);
+    return n == sizeof(*hdr) ? 0 : -1;
+}
+
+static int connect_server(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (init_address(&addr, path) == -1) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_error("%s: %s", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/* shellma --client [SOCKET] -c SCRIPT [NAME [ARG...]] runs the script on
+ * a server like sh -c would; the socket defaults to $SHELLMA_SOCKET. */
+int client_main(int argc, const char **argv)
+{
+    request_header hdr;
+    const char *path = NULL;
+    char cwd[4096], **env;
+    strbuf payload;
+    int fd, status, i;
+
+    if (argc > 0 && strcmp(argv[0], "-c") != 0) {
+        path = argv[0];
+        argc--;
+        argv++;
+    } else {
+        path = getenv("SHELLMA_SOCKET");
+    }
+    if (path == NULL || argc < 2 || strcmp(argv[0], "-c") != 0) {
+        log_error("usage: shellma --client [SOCKET] -c SCRIPT [NAME [ARG...]]");
+        return 2;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "/");
+    }
+    strbuf_init(&payload, 4096);
+    strbuf_clear(&payload);
+    strbuf_append_mem(&payload, cwd, strlen(cwd) + 1);
+    for (i = 1; i < argc; i++) {
+        strbuf_append_mem(&payload, argv[i], strlen(argv[i]) + 1);
+    }
+    hdr.magic = request_magic;
+    hdr.argc = argc - 2;
+    hdr.envc = 0;
+    for (env = environ; *env != NULL; env++) {
+        strbuf_append_mem(&payload, *env, strlen(*env) + 1);
+        hdr.envc++;
+    }
+    hdr.payload_len = payload.len;
+
+    status = 1;
+    fd = connect_server(path);
+    if (fd != -1) {
+        if (send_request(fd, &hdr) == -1 ||
+            write_full(fd, payload.chars, payload.len) == -1 ||
+            read_full(fd, &status, sizeof(status)) == -1)
+        {
+            log_error("%s: lost connection to the server", path);
+            status = 1;
+        }
+        close(fd);
+    }
+    strbuf_free(&payload);
+    return status;
+}
@@ -0,0 +1,9 @@
+#ifndef SERVER_SENTRY
+#define SERVER_SENTRY
+#include "shell.h"
+
+
+int server_main(shell *sh, const char *path);
+int client_main(int argc, const char **argv);
+
+#endif
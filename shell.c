@@ -1,5 +1,7 @@
 #include "shell.h"
 #include "wrappers.h"
+#include "deadline.h"
+#include "metrics.h"
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
@@ -10,6 +12,7 @@
 
 
 int have_sigint = 0;
+static int zombie_holds = 0;
 
 static void set_signal(int s, void (*handler)(int))
 {
@@ -35,9 +38,14 @@ static void sigint_handler(int s)
     have_sigint = 1; 
 }
 
+/* Children that ended while the handler was off are reaped right away. */
 void enable_zombie_cleanup()
 {
+    if (zombie_holds > 0) {
+        return;
+    }
     set_signal(SIGCHLD, &sigchld_handler);
+    sigchld_handler(SIGCHLD);
 }
 
 void disable_zombie_cleanup()
@@ -45,6 +53,22 @@ void disable_zombie_cleanup()
     set_signal(SIGCHLD, SIG_DFL);
 }
 
+/* Keeps the handler off until every hold is released, so that children
+ * the shell reaps later by pid are not taken by it. */
+void hold_zombie_cleanup()
+{
+    zombie_holds++;
+    disable_zombie_cleanup();
+}
+
+void release_zombie_cleanup()
+{
+    if (zombie_holds > 0) {
+        zombie_holds--;
+    }
+    enable_zombie_cleanup();
+}
+
 void set_fg_pgroup(shell *sh, int pgrp)
 {
     if (sh->tty_fd == -1 || sh->in_background) {
@@ -67,13 +91,86 @@ void reset_signals()
     set_signal(SIGINT, SIG_DFL);
 }
 
+/* Only the state of the shell; signals and the terminal are left alone,
+ * so a process embedding the shell keeps its own. */
+void init_shell_state(shell *sh)
+{
+    metrics_init();
+    sh->tty_fd = -1;
+    sh->pid = getpid();
+    sh->pgid = getpgid(0);
+    sh->last_status = 0;
+    sh->in_background = sh->in_pipeline = 0;
+    vars_init(&sh->vars);
+    funcs_init(&sh->funcs);
+    sh->top_params.argv = NULL;
+    sh->top_params.argc = 0;
+    sh->top_params.owned = NULL;
+    sh->top_params.prev = NULL;
+    sh->params = &sh->top_params;
+    sh->func_depth = sh->returning = 0;
+    sh->status_fd = -1;
+    sh->limits = NULL;
+    sh->deadline = 0;
+    sh->kill_after = default_kill_after;
+    sh->procsubs = NULL;
+    sh->coprocs = NULL;
+    sh->stub_exec = sh->expand_failed = 0;
+}
+
 void init_shell(shell *sh)
 {
     set_signal(SIGTTOU, SIG_IGN);
     set_signal(SIGINT, &sigint_handler);
     enable_zombie_cleanup();
+    init_shell_state(sh);
     sh->tty_fd = isatty(0) ? 0 : -1;
-    sh->pgid = getpgid(0);
-    sh->last_status = 0;
-    sh->in_background = sh->in_pipeline = 0;
+}
+
+/* Closing its pipes is what tells a coprocess to finish; it is reaped
+ * like any background job. */
+void drop_coprocs(shell *sh)
+{
+    coproc_item *item;
+
+    while (sh->coprocs != NULL) {
+        item = sh->coprocs;
+        sh->coprocs = item->next;
+        close(item->in_fd);
+        close(item->out_fd);
+        free(item->name);
+        free(item);
+    }
+}
+
+void free_shell(shell *sh)
+{
+    drop_coprocs(sh);
+    vars_free(&sh->vars);
+    funcs_free(&sh->funcs);
+    free(sh->top_params.owned);
+}
+
+void save_metrics(shell *sh)
+{
+    const char *path = var_get(&sh->vars, "SHELLMA_METRICS_FILE");
+
+    if (path != NULL && *path != '\0') {
+        metrics_save(path);
+    }
+}
+
+/* Forked children leave without flushing the parent's buffers. A shell
+ * serving a client also sends the status back before it goes. */
+void exit_shell(shell *sh, int status)
+{
+    if (getpid() != sh->pid) {
+        _exit(status);
+    }
+    save_metrics(sh);
+    if (sh->status_fd != -1) {
+        fflush(stdout);
+        write(sh->status_fd, &status, sizeof(status));
+    }
+    exit(status);
 }
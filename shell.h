@@ -1,21 +1,58 @@
 #ifndef SHELL_SENTRY
 #define SHELL_SENTRY
+#include "vars.h"
+#include "funcs.h"
+#include "spawn.h"
 
 
+/* A process substitution whose command has not finished yet. */
+typedef struct procsub_item_tag {
+    int pid, fd;
+    struct procsub_item_tag *next;
+} procsub_item;
+
+/* A running coprocess; in_fd writes to its stdin, out_fd reads its
+ * stdout. Both are close-on-exec, so commands only get them through
+ * redirections. */
+typedef struct coproc_item_tag {
+    char *name;
+    int pid, in_fd, out_fd;
+    struct coproc_item_tag *next;
+} coproc_item;
+
 typedef struct {
     int last_status;
-    int pgid;
+    int pid, pgid;
     int tty_fd;
     int in_background, in_pipeline;
+    var_table vars;
+    func_table funcs;
+    param_frame top_params, *params;
+    int func_depth, returning;
+    int status_fd;
+    const spawn_limits *limits;
+    long long deadline;
+    int kill_after;
+    procsub_item *procsubs;
+    coproc_item *coprocs;
+    int stub_exec;
+    int expand_failed;
 } shell;
 
 extern int have_sigint;
 
 void enable_zombie_cleanup();
 void disable_zombie_cleanup();
+void hold_zombie_cleanup();
+void release_zombie_cleanup();
 void set_fg_pgroup(shell *sh, int pgrp);
 void restore_fg_pgroup(shell *sh);
+void init_shell_state(shell *sh);
 void init_shell(shell *sh);
+void free_shell(shell *sh);
+void drop_coprocs(shell *sh);
+void save_metrics(shell *sh);
+void exit_shell(shell *sh, int status);
 void reset_signals();
 
 #endif
@@ -0,0 +1,221 @@
+#include "spawn.h"
+#include "wrappers.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+
+enum { ioprio_who_process = 1, ioprio_class_shift = 13 };
+
+static const rlimit_kind kinds[] = {
+    { 'c', RLIMIT_CORE,   1024, "core file size (kbytes)" },
+    { 'd', RLIMIT_DATA,   1024, "data seg size (kbytes)" },
+    { 'f', RLIMIT_FSIZE,  1024, "file size (kbytes)" },
+    { 'n', RLIMIT_NOFILE, 1,    "open files" },
+    { 's', RLIMIT_STACK,  1024, "stack size (kbytes)" },
+    { 't', RLIMIT_CPU,    1,    "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC,  1,    "max user processes" },
+    { 'v', RLIMIT_AS,     1024, "virtual memory (kbytes)" },
+    { 0 }
+};
+
+const rlimit_kind *rlimit_kinds()
+{
+    return kinds;
+}
+
+const rlimit_kind *find_rlimit_kind(char letter)
+{
+    const rlimit_kind *kind;
+
+    for (kind = kinds; kind->letter != 0; kind++) {
+        if (kind->letter == letter) {
+            return kind;
+        }
+    }
+    return NULL;
+}
+
+int parse_rlimit_value(const char *str, const rlimit_kind *kind, rlim_t *res)
+{
+    char *end;
+    unsigned long long value;
+
+    if (strcmp(str, "unlimited") == 0) {
+        *res = RLIM_INFINITY;
+        return 0;
+    }
+    if (!isdigit((unsigned char)*str)) {
+        return -1;
+    }
+    errno = 0;
+    value = strtoull(str, &end, 10);
+    if (*end != '\0' || errno != 0 || value > RLIM_INFINITY / kind->unit) {
+        return -1;
+    }
+    *res = value * kind->unit;
+    return 0;
+}
+
+static int parse_ioprio(const char *str, int *res)
+{
+    static const char *const classes[] = {
+        "none", "realtime", "best-effort", "idle"
+    };
+    const char *colon = strchr(str, ':');
+    int len = colon != NULL ? colon - str : strlen(str);
+    int class, level = 4;
+
+    for (class = 1; class < 4; class++) {
+        if (strncmp(str, classes[class], len) == 0 &&
+            classes[class][len] == '\0')
+        {
+            break;
+        }
+    }
+    if (class == 4 && len == 1 && str[0] >= '1' && str[0] <= '3') {
+        class = str[0] - '0';
+    }
+    if (class == 4) {
+        return -1;
+    }
+    if (colon != NULL) {
+        if (colon[1] < '0' || colon[1] > '7' || colon[2] != '\0') {
+            return -1;
+        }
+        level = colon[1] - '0';
+    }
+    *res = class << ioprio_class_shift | (class == 3 ? 0 : level);
+    return 0;
+}
+
+static void set_rlimit(spawn_limits *lim, int resource, rlim_t value)
+{
+    int i;
+
+    for (i = 0; i < lim->rlimit_count; i++) {
+        if (lim->rlimits[i].resource == resource) {
+            break;
+        }
+    }
+    lim->rlimits[i].resource = resource;
+    lim->rlimits[i].value = value;
+    if (i == lim->rlimit_count) {
+        lim->rlimit_count++;
+    }
+}
+
+/* limit [-cdfnstuv N] [-N NICE] [-I CLASS[:LEVEL]] [-g CGROUP] COMMAND;
+ * the options are added to what lim already holds, so limit prefixes
+ * nest. Returns the index of COMMAND. */
+int parse_limit_args(char **argv, spawn_limits *lim)
+{
+    const rlimit_kind *kind;
+    rlim_t value;
+    char *end;
+    int i;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i += 2) {
+        const char *opt = argv[i], *arg = argv[i + 1];
+
+        if (opt[1] == '\0' || opt[2] != '\0' || arg == NULL) {
+            break;
+        }
+        kind = find_rlimit_kind(opt[1]);
+        if (kind != NULL) {
+            if (parse_rlimit_value(arg, kind, &value) == -1) {
+                log_error("limit: %s: invalid limit", arg);
+                return -1;
+            }
+            set_rlimit(lim, kind->resource, value);
+        } else if (opt[1] == 'N') {
+            lim->nice = strtol(arg, &end, 10);
+            if (*arg == '\0' || *end != '\0') {
+                log_error("limit: %s: invalid nice value", arg);
+                return -1;
+            }
+            lim->has_nice = 1;
+        } else if (opt[1] == 'I') {
+            if (parse_ioprio(arg, &lim->ioprio) == -1) {
+                log_error("limit: %s: invalid I/O priority", arg);
+                return -1;
+            }
+            lim->has_ioprio = 1;
+        } else if (opt[1] == 'g') {
+            lim->cgroup = arg;
+        } else {
+            break;
+        }
+    }
+    if (argv[i] == NULL || argv[i][0] == '-') {
+        log_error("limit: usage: limit [-cdfnstuv N] [-N NICE] "
+                  "[-I CLASS[:LEVEL]] [-g CGROUP] COMMAND [ARG...]");
+        return -1;
+    }
+    return i;
+}
+
+static void join_cgroup(const char *dir)
+{
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, "0", 1) != 1) {
+        log_error("limit: %s: %s", path, strerror(errno));
+        _exit(13);
+    }
+    close(fd);
+}
+
+/* Runs in the child between fork and exec. A command that cannot get
+ * its limits does not run at all. */
+void apply_spawn_limits(const spawn_limits *lim)
+{
+    struct rlimit rl;
+    int i;
+
+    if (lim->cgroup != NULL) {
+        join_cgroup(lim->cgroup);
+    }
+    for (i = 0; i < lim->rlimit_count; i++) {
+        rl.rlim_cur = rl.rlim_max = lim->rlimits[i].value;
+        /* SIGXCPU at the soft limit names the cause, SIGKILL would not */
+        if (lim->rlimits[i].resource == RLIMIT_CPU &&
+            rl.rlim_max != RLIM_INFINITY)
+        {
+            rl.rlim_max++;
+        }
+        if (setrlimit(lim->rlimits[i].resource, &rl) == -1) {
+            log_error("limit: %s", strerror(errno));
+            _exit(13);
+        }
+    }
+    if (lim->has_ioprio &&
+        syscall(SYS_ioprio_set, ioprio_who_process, 0, lim->ioprio) == -1)
+    {
+        log_error("limit: ioprio: %s", strerror(errno));
+        _exit(13);
+    }
+    if (lim->has_nice && setpriority(PRIO_PROCESS, 0, lim->nice) == -1) {
+        log_error("limit: nice: %s", strerror(errno));
+        _exit(13);
+    }
+}
+
+/* Signals the kernel uses on a process that overran a limit. */
+void report_limit_signal(const char *name, int signal)
+{
+    if (signal == SIGXCPU || signal == SIGXFSZ || signal == SIGKILL ||
+        signal == SIGSEGV)
+    {
+        log_error("%s: %s", name, strsignal(signal));
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef SPAWN_SENTRY
+#define SPAWN_SENTRY
+#include <sys/resource.h>
+
+
+enum { max_spawn_rlimits = 8 };
+
+typedef struct {
+    char letter;
+    int resource, unit;
+    const char *description;
+} rlimit_kind;
+
+/* What the limit prefix records for the commands it starts. Nothing is
+ * applied to the shell; children apply it between fork and exec. */
+typedef struct {
+    struct {
+        int resource;
+        rlim_t value;
+    } rlimits[max_spawn_rlimits];
+    int rlimit_count;
+    int has_nice, nice;
+    int has_ioprio, ioprio;
+    const char *cgroup;
+} spawn_limits;
+
+const rlimit_kind *find_rlimit_kind(char letter);
+const rlimit_kind *rlimit_kinds();
+int parse_rlimit_value(const char *str, const rlimit_kind *kind, rlim_t *res);
+int parse_limit_args(char **argv, spawn_limits *lim);
+void apply_spawn_limits(const spawn_limits *lim);
+void report_limit_signal(const char *name, int signal);
+
+#endif
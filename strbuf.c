@@ -47,3 +47,34 @@ void strbuf_join(strbuf *str, const char *str2)
     strcpy(str->chars + str->len, str2);
     str->len += len;
 }
+
+void strbuf_append_mem(strbuf *str, const char *mem, int len)
+{
+    if (str->len + len >= str->capacity-1) {
+        while (str->len + len >= str->capacity-1) {
+            str->capacity *= 2;
+        }
+        str->chars = realloc(str->chars, str->capacity);
+    }
+    memcpy(str->chars + str->len, mem, len);
+    str->len += len;
+    str->chars[str->len] = '\0';
+}
+
+void strbuf_truncate(strbuf *str, int len)
+{
+    if (len < str->len) {
+        str->len = len;
+        str->chars[len] = '\0';
+    }
+}
+
+void strbuf_reserve(strbuf *str, int extra)
+{
+    if (str->len + extra >= str->capacity-1) {
+        while (str->len + extra >= str->capacity-1) {
+            str->capacity *= 2;
+        }
+        str->chars = realloc(str->chars, str->capacity);
+    }
+}
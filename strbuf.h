@@ -12,5 +12,8 @@ void strbuf_free(strbuf *str);
 void strbuf_clear(strbuf *str);
 void strbuf_append(strbuf *str, char ch);
 void strbuf_join(strbuf *str, const char *str2);
+void strbuf_append_mem(strbuf *str, const char *mem, int len);
+void strbuf_truncate(strbuf *str, int len);
+void strbuf_reserve(strbuf *str, int extra);
 
 #endif
@@ -0,0 +1,32 @@
+#!/bin/sh
+# batch splits an argument list too long for exec into runs that fit,
+# one after another or -P at a time, and keeps the first failing status.
+# The stack limit is lowered so that a few thousand arguments are enough.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf '%s\n' "/bin/echo \$(seq 1 30000) > /dev/null; echo \$? > $dir/plain" \
+    "batch -k 3 sh -c 'echo \$#' x \$(seq 1 30000) > $dir/serial" \
+    "batch -P 3 -k 3 sh -c 'echo \$#' x \$(seq 1 30000) > $dir/parallel" \
+    "batch sh -c 'echo \$#' x 1 2 3 > $dir/small" \
+    "batch -k 2 sh -c 'exit \$((\$0 > 20000 ? 3 : 0))' \$(seq 1 30000);" \
+    "echo \$? > $dir/status" |
+    (ulimit -s 256 && "$shell") > /dev/null 2>&1
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "batch: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+for f in serial parallel; do
+    awk '{ n += $1 } END { print (NR > 1 ? n : "one run") }' "$dir/$f" \
+        > "$dir/$f.sum"
+    check $f.sum 30000
+done
+check plain 13
+check small 3
+check status 3
+exit $fail
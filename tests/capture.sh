@@ -0,0 +1,50 @@
+#!/bin/sh
+# $SHELLMA_CAPTURE records the statements read at the prompt with their
+# directory and status, and --replay runs them again and reports both
+# statuses per statement; --stub lets external commands exit 0 unrun.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf '%s\n' "echo one > $dir/echo" "cd $dir" "sh -c 'exit 3'" \
+    "pwd > $dir/pwd" "if true" "then sh -c 'echo two' > $dir/multi; fi" |
+    SHELLMA_CAPTURE="$dir/cap" "$shell" > /dev/null 2>&1
+rm -f "$dir/echo" "$dir/pwd" "$dir/multi"
+
+"$shell" --replay "$dir/cap" 2> /dev/null |
+    awk -F '\t' '{ print $1, $6, $7 }' > "$dir/replay"
+cat "$dir/echo" "$dir/pwd" "$dir/multi" > "$dir/replayed" 2>&1
+rm -f "$dir/echo" "$dir/pwd" "$dir/multi"
+"$shell" --replay --stub "$dir/cap" 2> /dev/null |
+    awk -F '\t' '$1 != "total" { print $1, $6, $7 }' > "$dir/stub"
+cat "$dir/echo" "$dir/pwd" "$dir/multi" > "$dir/stubbed" 2>&1
+"$shell" --replay "$dir/replay" > /dev/null 2>&1
+echo $? > "$dir/not_capture"
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "capture: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+check replay "# status captured
+1 0 0
+2 0 0
+3 3 3
+4 0 0
+5 0 0
+total  "
+check replayed "one
+$dir
+two"
+check stub "# status captured
+1 0 0
+2 0 0
+3 0 3
+4 0 0
+5 0 0"
+check stubbed "one
+$dir"
+check not_capture 1
+exit $fail
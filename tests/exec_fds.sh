@@ -0,0 +1,32 @@
+#!/bin/sh
+# exec with only redirections opens and closes fds of the shell itself
+# for the commands after it; the fds the shell keeps for its own use
+# are not passed on to them.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf 'a\nb\n' > "$dir/in"
+printf '%s\n' "exec 3>>$dir/log" "for i in 1 2 3; do echo \$i >&3; done" \
+    "exec 3>&-" "echo x >&3; echo \$? > $dir/closed" \
+    "exec 4< $dir/in" "read a <&4; read b <&4; echo \$a\$b > $dir/read" \
+    "ls /proc/self/fd | tr '\n' ' ' > $dir/fds" \
+    "exec 5< /nonexistent; echo \$? > $dir/failed" |
+    "$shell" > /dev/null 2>&1
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "exec_fds: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+check log "1
+2
+3"
+check closed 1
+check read ab
+# 3 is the directory ls reads
+check fds "0 1 2 3 4 "
+check failed 1
+exit $fail
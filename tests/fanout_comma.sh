@@ -0,0 +1,24 @@
+#!/bin/sh
+# A comma inside a word of a fan-out branch is part of the argument;
+# only one starting a token separates branches.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf '%s\n' \
+    "echo a,b,c |{ cut -d, -f1 > $dir/first , cut -d, -f3 > $dir/last }" \
+    "echo x |{ printf 'p,q' > $dir/quoted ,cat > $dir/second }" \
+    | "$shell" > /dev/null 2>&1
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "fanout_comma: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+check first a
+check last c
+check quoted p,q
+check second x
+exit $fail
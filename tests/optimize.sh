@@ -0,0 +1,42 @@
+#!/bin/sh
+# The rewrites done with SHELLMA_OPTIMIZE set must not change what the
+# statements do: builtins stay in their pipeline, statuses are kept,
+# a function named true is still called and every file still opened.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+echo text > "$dir/in"
+printf '%s\n' "cd / | cat; pwd > $dir/cd" \
+    "exit | cat" "echo alive > $dir/exit" \
+    "false | cat; echo \$? > $dir/false" \
+    "cat $dir/in | tr a-z A-Z > $dir/upper" \
+    "cat /nonexistent | wc -l > $dir/lines; echo \$? > $dir/lines_st" \
+    "echo x > $dir/first > $dir/last" \
+    "echo y > /nonexistent/f > $dir/unopened; echo \$? > $dir/unopened_st" \
+    "true() { echo called > $dir/fn; }" "true && echo ran > $dir/and" |
+    SHELLMA_OPTIMIZE=1 "$shell" > /dev/null 2>&1
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "optimize: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+check cd "$PWD"
+check exit alive
+check false 0
+check upper TEXT
+check lines 0
+check lines_st 0
+check first ""
+check last x
+check unopened_st 1
+check fn called
+check and ran
+if [ ! -e "$dir/first" ] || [ -e "$dir/unopened" ]; then
+    echo "optimize: an earlier redirection was not opened" >&2
+    fail=1
+fi
+exit $fail
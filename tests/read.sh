@@ -0,0 +1,48 @@
+#!/bin/sh
+# read and mapfile read in blocks but take no more of the input than
+# the lines they return, from a file as from a pipe, so the commands
+# after them see the rest; a bare for keeps the list it started with
+# when mapfile replaces the parameters.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf 'one\ntwo\nthree\n' > "$dir/in"
+printf 'x  y z\nco\\\nntinued\nlast' > "$dir/fields"
+printf '%s\n' "{ read a; read b; cat > $dir/rest; } < $dir/in" \
+    "echo \"\$a \$b\" > $dir/ab" \
+    "printf 'l1\nl2\nl3\n' | { read a; cat > $dir/piped; }" \
+    "while read -r line; do echo \"[\$line]\"; done < $dir/in > $dir/loop" \
+    "{ read p q; read c; read l; echo \$? > $dir/eof; } < $dir/fields" \
+    "echo \"\$p|\$q|\$c|\$l\" > $dir/split" \
+    "mapfile -t < $dir/in; echo \$# \$3 > $dir/map" \
+    "{ mapfile -t -n 1; cat > $dir/map_rest; } < $dir/in" \
+    "echo \"\$# \$1\" > $dir/map_n" \
+    "mapfile -t < $dir/in" \
+    "for x; do mapfile -t < $dir/fields; echo \$x; done > $dir/for" |
+    "$shell" > /dev/null 2>&1
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "read: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+check ab "one two"
+check rest three
+check piped "l2
+l3"
+check loop "[one]
+[two]
+[three]"
+check eof 1
+check split "x|y z|continued|last"
+check map "3 three"
+check map_n "1 one"
+check map_rest "two
+three"
+check for "one
+two
+three"
+exit $fail
@@ -0,0 +1,21 @@
+#!/bin/sh
+# What the shell prints itself (prompt, status, logs) must not end up in
+# the file a command's output is redirected to.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf '%s\n' "/bin/echo x > $dir/f1" "/bin/echo y > $dir/f2" \
+    "echo z > $dir/f3" | "$shell" > /dev/null 2>&1
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "redirect_flush: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+check f1 x
+check f2 y
+check f3 z
+exit $fail
@@ -0,0 +1,17 @@
+#!/bin/sh
+# A script without #! runs in the forked child with its arguments as
+# the parameters and only exported variables.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf '%s\n' 'echo "$1 $2 [$LOCAL] [$SHARED]" > "$3"' > "$dir/plain"
+chmod +x "$dir/plain"
+printf '%s\n' "LOCAL=no" "export SHARED=yes" \
+    "$dir/plain a b $dir/out" | "$shell" > /dev/null 2>&1
+
+got=$(cat "$dir/out" 2>/dev/null)
+if [ "$got" != "a b [] [yes]" ]; then
+    echo "script_exec: expected 'a b [] [yes]', got '$got'" >&2
+    exit 1
+fi
@@ -0,0 +1,42 @@
+#!/bin/sh
+# A script run through --client gets the arguments, cwd, environment and
+# stdio of the client, and the client exits with the script's status,
+# also when the script ends in exec.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+
+"$shell" --server "$dir/sock" > /dev/null 2>&1 &
+server=$!
+i=0
+while [ ! -S "$dir/sock" ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+
+(cd "$dir" && X=env1 "$OLDPWD/$shell" --client sock \
+    -c 'echo "$1 $X"; pwd; exit 3' name arg) > "$dir/out" 2> /dev/null
+echo $? > "$dir/st"
+"$shell" --client "$dir/sock" -c 'exec /bin/sh -c "exit 5"' 2> /dev/null
+echo $? > "$dir/exec_st"
+kill $server
+wait $server
+echo $? > "$dir/server_st"
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "server: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+check out "arg env1
+$dir"
+check st 3
+check exec_st 5
+check server_st 0
+if [ -e "$dir/sock" ]; then
+    echo "server: the socket was left behind" >&2
+    fail=1
+fi
+exit $fail
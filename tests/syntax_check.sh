@@ -0,0 +1,54 @@
+#!/bin/sh
+# shellma -n parses its files without running them and reports each
+# error as file:line:column in argument order, however the files are
+# spread over the threads; it exits 2 on a syntax error, else 1 if a
+# file could not be read.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf 'echo ok > %s\nif true; then\n    echo x\nfi\n' "$dir/ran" \
+    > "$dir/good.sh"
+printf 'echo a\n  echo b ) c\n' > "$dir/bad.sh"
+printf 'echo a\necho b |\n' > "$dir/eof.sh"
+printf 'echo \\\ncont\nfi\n' > "$dir/cont.sh"
+: > "$dir/empty.sh"
+i=0
+while [ $i -lt 200 ]; do
+    cp "$dir/good.sh" "$dir/many$i.sh"
+    i=$((i + 1))
+done
+cp "$dir/bad.sh" "$dir/many150.sh"
+
+"$shell" -n "$dir/good.sh" "$dir/empty.sh" > "$dir/good" 2>&1
+echo $? >> "$dir/good"
+"$shell" -n "$dir/bad.sh" "$dir/missing" "$dir/eof.sh" "$dir/cont.sh" \
+    > "$dir/bad" 2>&1
+echo $? >> "$dir/bad"
+"$shell" -n "$dir/missing" > /dev/null 2>&1
+echo $? > "$dir/missing_st"
+"$shell" -n $(i=0; while [ $i -lt 200 ]; do
+    echo "$dir/many$i.sh"; i=$((i + 1)); done) > "$dir/many" 2>&1
+echo $? >> "$dir/many"
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "syntax_check: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+check good 0
+check bad "$dir/bad.sh:2:10: syntax error near )
+$dir/missing: No such file or directory
+$dir/eof.sh:2:9: syntax error near end of file
+$dir/cont.sh:3:1: syntax error near word
+2"
+check missing_st 1
+check many "$dir/many150.sh:2:10: syntax error near )
+2"
+if [ -e "$dir/ran" ]; then
+    echo "syntax_check: a checked file was run" >&2
+    fail=1
+fi
+exit $fail
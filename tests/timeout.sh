@@ -0,0 +1,40 @@
+#!/bin/sh
+# timeout and $SHELLMA_CMD_TIMEOUT stop a command, its whole process
+# group and every stage of a pipeline with status 124, escalating to
+# SIGKILL after -k; commands that finish in time keep their status.
+shell=${SHELLMA:-./shellma}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+start=$(date +%s)
+printf '%s\n' "timeout 0.3 sleep 5; echo \$? > $dir/plain" \
+    "timeout 0.3 sh -c 'sleep 1; echo late > $dir/late'" \
+    "timeout -k 0.2 0.2 sh -c 'trap \"\" TERM; sleep 5'; echo \$? > $dir/kill" \
+    "timeout 5 false; echo \$? > $dir/in_time" \
+    "SHELLMA_CMD_TIMEOUT=0.3" "sleep 5 | sleep 5; echo \$? > $dir/pipeline" \
+    "SHELLMA_CMD_TIMEOUT=" "sleep 0.5; echo \$? > $dir/unset" |
+    "$shell" > /dev/null 2>&1
+elapsed=$(($(date +%s) - start))
+sleep 1
+
+fail=0
+check() {
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "timeout: $1: expected '$2', got '$(cat "$dir/$1")'" >&2
+        fail=1
+    fi
+}
+check plain 124
+check kill 124
+check in_time 1
+check pipeline 124
+check unset 0
+if [ -e "$dir/late" ]; then
+    echo "timeout: a child of the timed out command survived" >&2
+    fail=1
+fi
+if [ $elapsed -gt 4 ]; then
+    echo "timeout: took ${elapsed}s" >&2
+    fail=1
+fi
+exit $fail
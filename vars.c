@@ -0,0 +1,237 @@
+#include "vars.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <errno.h>
+
+
+extern char **environ;
+
+static unsigned hash_name(const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while (*name != '\0') {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+static var_entry **find_slot(const var_table *vars, const char *name)
+{
+    var_entry **slot;
+
+    slot = &vars->buckets[hash_name(name) & (vars->bucket_count - 1)];
+    while (*slot != NULL && strcmp((*slot)->name, name) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void grow_table(var_table *vars)
+{
+    var_entry **old = vars->buckets;
+    int i, old_count = vars->bucket_count;
+
+    vars->bucket_count *= 2;
+    vars->buckets = calloc(vars->bucket_count, sizeof(var_entry *));
+    for (i = 0; i < old_count; i++) {
+        while (old[i] != NULL) {
+            var_entry *tmp = old[i];
+            unsigned h = hash_name(tmp->name) & (vars->bucket_count - 1);
+
+            old[i] = tmp->next;
+            tmp->next = vars->buckets[h];
+            vars->buckets[h] = tmp;
+        }
+    }
+    free(old);
+}
+
+/* Values are overwritten in place when they fit, so counters updated in
+ * a loop do not allocate. */
+static void store_value(var_entry *var, const char *value, int len)
+{
+    if (len + 1 > var->value_size) {
+        var->value_size = len + 1 < 24 ? 24 : len + 1;
+        free(var->value);
+        var->value = malloc(var->value_size);
+    }
+    memcpy(var->value, value, len + 1);
+    var->int_valid = 0;
+}
+
+static var_entry *get_entry(var_table *vars, const char *name)
+{
+    var_entry **slot;
+
+    slot = find_slot(vars, name);
+    if (*slot == NULL) {
+        if (vars->count >= vars->bucket_count) {
+            grow_table(vars);
+            slot = find_slot(vars, name);
+        }
+        *slot = calloc(1, sizeof(var_entry));
+        (*slot)->name = strdup(name);
+        vars->count++;
+    }
+    return *slot;
+}
+
+void vars_init(var_table *vars)
+{
+    char **env;
+
+    vars->bucket_count = 256;
+    vars->count = 0;
+    vars->buckets = calloc(vars->bucket_count, sizeof(var_entry *));
+    for (env = environ; *env != NULL; env++) {
+        const char *eq = strchr(*env, '=');
+        var_entry *var;
+        char *name;
+
+        if (eq == NULL || !is_var_name(*env, eq - *env)) {
+            continue;
+        }
+        name = strndup(*env, eq - *env);
+        var = get_entry(vars, name);
+        store_value(var, eq + 1, strlen(eq + 1));
+        var->exported = 1;
+        free(name);
+    }
+}
+
+void vars_free(var_table *vars)
+{
+    int i;
+
+    for (i = 0; i < vars->bucket_count; i++) {
+        while (vars->buckets[i] != NULL) {
+            var_entry *tmp = vars->buckets[i];
+
+            vars->buckets[i] = tmp->next;
+            free(tmp->name);
+            free(tmp->value);
+            free(tmp);
+        }
+    }
+    free(vars->buckets);
+}
+
+int is_var_name(const char *name, int len)
+{
+    int i;
+
+    if (len == 0 || !(isalpha(name[0]) || name[0] == '_')) {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if (!(isalnum(name[i]) || name[i] == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+const char *var_get(const var_table *vars, const char *name)
+{
+    var_entry *var;
+
+    var = *find_slot(vars, name);
+    return var != NULL ? var->value : NULL;
+}
+
+void var_set(var_table *vars, const char *name, const char *value)
+{
+    var_entry *var;
+
+    var = get_entry(vars, name);
+    store_value(var, value, strlen(value));
+    if (var->exported) {
+        setenv(name, value, 1);
+    }
+}
+
+/* Empty and blank strings count as zero. */
+int var_parse_int(const char *str, long long *res)
+{
+    char *end;
+
+    while (isspace(*str)) {
+        str++;
+    }
+    if (*str == '\0') {
+        *res = 0;
+        return 0;
+    }
+    errno = 0;
+    *res = strtoll(str, &end, 0);
+    while (isspace(*end)) {
+        end++;
+    }
+    return *end != '\0' || errno == ERANGE ? -1 : 0;
+}
+
+int var_get_int(var_table *vars, const char *name, long long *res)
+{
+    var_entry *var;
+
+    var = *find_slot(vars, name);
+    if (var == NULL || var->value == NULL) {
+        *res = 0;
+        return 0;
+    }
+    if (!var->int_valid) {
+        if (var_parse_int(var->value, &var->int_val) != 0) {
+            return -1;
+        }
+        var->int_valid = 1;
+    }
+    *res = var->int_val;
+    return 0;
+}
+
+void var_set_int(var_table *vars, const char *name, long long value)
+{
+    var_entry *var;
+    char buf[24];
+    int len;
+
+    var = get_entry(vars, name);
+    len = sprintf(buf, "%lld", value);
+    store_value(var, buf, len);
+    var->int_val = value;
+    var->int_valid = 1;
+    if (var->exported) {
+        setenv(name, buf, 1);
+    }
+}
+
+void var_unset(var_table *vars, const char *name)
+{
+    var_entry **slot, *var;
+
+    slot = find_slot(vars, name);
+    var = *slot;
+    if (var == NULL) {
+        return;
+    }
+    if (var->exported) {
+        unsetenv(name);
+    }
+    *slot = var->next;
+    free(var->name);
+    free(var->value);
+    free(var);
+    vars->count--;
+}
+
+void var_export(var_table *vars, const char *name)
+{
+    var_entry *var;
+
+    var = get_entry(vars, name);
+    var->exported = 1;
+    setenv(name, var->value != NULL ? var->value : "", 1);
+}
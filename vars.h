@@ -0,0 +1,39 @@
+#ifndef VARS_SENTRY
+#define VARS_SENTRY
+
+
+typedef struct var_entry_tag {
+    char *name, *value;
+    int value_size, exported;
+    long long int_val;
+    int int_valid;
+    struct var_entry_tag *next;
+} var_entry;
+
+typedef struct {
+    var_entry **buckets;
+    int bucket_count, count;
+} var_table;
+
+/* Positional parameters of the running function, or of the shell itself
+ * at the bottom of the stack. Frames live on the C stack of the call;
+ * owned is a block of parameters set by mapfile, freed with the frame. */
+typedef struct param_frame_tag {
+    char **argv;
+    int argc;
+    void *owned;
+    struct param_frame_tag *prev;
+} param_frame;
+
+void vars_init(var_table *vars);
+void vars_free(var_table *vars);
+int is_var_name(const char *name, int len);
+const char *var_get(const var_table *vars, const char *name);
+void var_set(var_table *vars, const char *name, const char *value);
+int var_parse_int(const char *str, long long *res);
+int var_get_int(var_table *vars, const char *name, long long *res);
+void var_set_int(var_table *vars, const char *name, long long value);
+void var_unset(var_table *vars, const char *name);
+void var_export(var_table *vars, const char *name);
+
+#endif
@@ -1,4 +1,5 @@
 #include "wrappers.h"
+#include "metrics.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
@@ -28,6 +29,9 @@ int xfork()
         log_error("fork: %s", strerror(errno));
         exit(13);
     }
+    if (pid != 0) {
+        METRICS_ADD(forks, 1);
+    }
     return pid;
 }
 
@@ -42,13 +46,6 @@ void xpipe(int fd[2])
     }
 }
 
-void xexecvp(const char *file, char *const argv[])
-{
-    execvp(file, argv);
-    log_error("%s: %s", file, strerror(errno));
-    _exit(13);
-}
-
 int xwait(int *status)
 {
     int p;
@@ -112,6 +109,30 @@ int xclose(int fd)
     return status;
 }
 
+/* Fds the shell keeps for itself live from internal_fd_base up and are
+ * close-on-exec, out of the way of the fds scripts use. Returns -1 if
+ * fd is not open. */
+int dup_internal_fd(int fd)
+{
+    int copy;
+
+    copy = fcntl(fd, F_DUPFD_CLOEXEC, internal_fd_base);
+    if (copy == -1 && errno != EBADF) {
+        log_error("dup: %s", strerror(errno));
+        exit(13);
+    }
+    return copy;
+}
+
+int move_internal_fd(int fd)
+{
+    int copy;
+
+    copy = dup_internal_fd(fd);
+    close(fd);
+    return copy;
+}
+
 int xopen(const char *path, int flags, mode_t mode)
 {
     int status; 